@@ -10,21 +10,64 @@
 // I can't figure out how to create a non-debug build.  I'm using Xcode's menu option:
 // Product | Build For | Running
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <coroutine>
 #include <iostream>
 #include <iomanip>
 #include <sstream>
 #include <stdio.h>
 #include <stdarg.h>
+#include <errno.h>
 #include <string>
 #include <string.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/select.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <net/if.h>
+#include <ifaddrs.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <queue>
 #include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+#if defined(__linux__)
+#include <linux/errqueue.h>
+#include <linux/ethtool.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+#include <linux/version.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+// Headers from Linux 6.2 on have this (as an enumerator, so not testable
+// with #ifdef alone); older ones don't, though the kernel running us may.
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,2,0) && !defined(SOF_TIMESTAMPING_OPT_ID_TCP)
+#define SOF_TIMESTAMPING_OPT_ID_TCP (1 << 16)
+#endif
+#else
+#include <poll.h>
+#endif
 
 using std::string;
 
@@ -35,15 +78,119 @@ using std::string;
 #define DEFAULT_SECS 10
 #define DEFAULT_BYTES_PER_BUF 12288
 #define DEFAULT_PORT 54811
+#define MAX_COMMAND_LEN 1024
+#define RECV_TIMEOUT_SECS 5
+#define ABORT_BYTE 'x'              // Client to sender: stop the test now.
+#define ABORT_CHECK_SECS 0.1
+#define TASK_TIME_SLICE_US 500
+#define WORKER_STATS_SECS 10
+#define PROBE_SECS 2
+#define PROBE_BYTES_PER_BUF 65536
+#define PROBE_PINGS 10
+#define DEFAULT_TRAINS 20
+#define DEFAULT_TRAIN_LEN 16
+#define DEFAULT_PKT_SIZE 1400
+#define TRAIN_GAP_MS 50
+#define DEFAULT_RAMP_STEP_MS 5
+#define MAX_RAMP_STEP_MS 10
+#define MAX_RAMP_MS 30000
+#define PROBE_REQUEST_BYTES 64
+#define DEFAULT_PROBE_INTERVAL_MS 10
+#define MIXED_IDLE_SECS 1
+#define RPM_IDLE_SECS 2
+#define RPM_PROBE_INTERVAL_MS 100
+#define RPM_DEFAULT_STREAMS 4
+#define MAX_WORKERS 64
+#define DEFAULT_AGENT_MAX_SECS 60
+#define DEFAULT_AGENT_MAX_STREAMS 8
+#define DEFAULT_AGENT_MAX_TESTS 32
+#define AGENT_RATE_SLACK_SECS 0.01
+#define AGENT_MAX_BYTES_PER_BUF (4*1024*1024)
+#define AGENT_MAX_TRAIN_LEN 256
+#define MAX_UDP_PAYLOAD 65507
+
+#define DEFAULT_RESULTS_FILE "netthruresults.bin"
+#define COMPARE_ALPHA 0.05
+#define DEFAULT_TOLERANCE_PCT 2
+#define DEFAULT_PROFILES_FILE "netthru.profiles"
+#define CPU_STAT_TOP 3              // Busiest cores shown per interval.
+#define GSO_MAX_BYTES 65536         // Largest GSO/TSO super-packet, headers included.
+#define GSO_HEADROOM_BYTES 256      // Room for IP and TCP headers and options.
+#define UDP_IP_HEADER_BYTES 28
+#define TCP_IP_HEADER_BYTES 40
+#define PMTU_MIN 576                // Every IPv4 path must carry this.
+#define PMTU_PROBE_PKTS 8           // DF datagrams per probe size...
+#define PMTU_PROBE_PASS 4           // ...of which this many must arrive.
+#define PMTU_TEST_SECS 2            // Throughput test at each candidate MTU.
+
+// Which stored results -mode:query looks at, and how it groups them.
+// Zero or empty fields match everything.
+struct ResultFilter {
+    time_t  from = 0;           // Runs that started at or after from...
+    time_t  to = 0;             // ...and before to.
+    string  host;
+    string  cc;
+    string  msg;
+    int     secs = 0;
+    int     nbytes = 0;
+    int     streams = 0;
+    string  by;                 // Group by day, host, nbytes, cc, msg or streams.
+    bool    list = false;       // Print each matching run and its intervals.
+};
 
 struct Settings {
-    enum enum_mode {unknown, server, client} mode = unknown;
+    enum enum_mode {unknown, server, client, query, compare} mode = unknown;
     string  remoteip;
     int     secs = DEFAULT_SECS;
     int     bytes_per_buf = DEFAULT_BYTES_PER_BUF;
     int     port = 54811;
     string  msg="";
     string  logfilename;
+    string  think;      // Think-time distribution between sends; see ThinkTime.
+    string  onoff;      // On/off send pattern, "onMs/offMs".
+    int     sndbuf = 0;     // SO_SNDBUF for the server; 0 for the system default.
+    int     rcvbuf = 0;     // SO_RCVBUF for the client; 0 for the system default.
+    bool    autotune = false;   // Pick buffer sizes from a BDP probe.
+    bool    capacity = false;   // Estimate capacity with UDP packet trains.
+    int     trains = DEFAULT_TRAINS;
+    int     trainlen = DEFAULT_TRAIN_LEN;
+    int     pktsize = DEFAULT_PKT_SIZE;
+    bool    rxts = false;       // Time arrivals with kernel receive timestamps.
+    int     txts = 0;           // Sender samples transmit timestamps every txts sends.
+    string  transport = "tcp";  // "tcp", or "shm" for the shared-memory baseline.
+    int     pings = 0;          // RTT pings before the transfer.
+    string  cc;                 // Congestion control for the server's socket.
+    std::vector<string> ccList; // Algorithms to compare, one stream each.
+    bool    ccSequential = false;   // Compare one at a time instead of competing.
+    int     concurrent = 0;     // Server: event-loop threads serving connections
+                                // simultaneously; 0 to serve one at a time.
+    int     rampMs = 0;         // Length of the ramp-up profile; 0 for none.
+    int     rampStepMs = DEFAULT_RAMP_STEP_MS;
+    int     streams = 1;        // Parallel streams for the test.
+    int     mixed = 0;          // Bulk streams to run under a latency probe.
+    int     probeIntervalMs = DEFAULT_PROBE_INTERVAL_MS;
+    bool    rpm = false;        // Responsiveness (latency under load) test.
+    bool    live = false;       // Redraw a live view in place of the per-second lines.
+    bool    counters = false;   // Report stack and NIC counter deltas from both ends.
+    bool    cpustat = false;    // Report the busiest cores each interval, on both ends.
+    string  align;              // Size writes by the MSS: "mss", "gso" or "compare".
+    int     mss = 0;            // Clamp the connection's MSS (TCP_MAXSEG); 0 for none.
+    bool    pmtu = false;       // Probe the path MTU.
+    int     workers = 0;        // Server: pre-forked worker processes; 0 for none.
+    bool    pin = false;        // Pin each worker to its own CPU.
+    bool    agent = false;      // Server: authenticate clients and limit their tests.
+    string  key;                // Shared secret for agents and their clients.
+    int     maxSecs = DEFAULT_AGENT_MAX_SECS;
+    double  maxRate = 0;        // Agent: MB/sec per client; 0 for no limit.
+    int     maxStreams = DEFAULT_AGENT_MAX_STREAMS;
+    int     maxTests = DEFAULT_AGENT_MAX_TESTS;
+    string  store = DEFAULT_RESULTS_FILE;   // Binary results file; "none" for none.
+    ResultFilter filter;        // For -mode:query and -mode:compare.
+    string  against;            // Compare: results file of the runs after the change...
+    time_t  split = 0;          // ...or when the change was made, in store.
+    double  tolerancePct = DEFAULT_TOLERANCE_PCT;   // Smallest change that fails a comparison.
+    string  profile;            // Named test profile the settings came from.
+    string  profilesFile;       // Config file of profiles; see TestProfiles.
 };
 
 FILE *fileLog=NULL;
@@ -53,7 +200,7 @@ FILE *fileLog=NULL;
 void safe_strcpy(char *dest, size_t destAlloc, const char *source)
 {
     if(destAlloc > 0) {
-        while(destAlloc-- > 1){
+        while(destAlloc-- > 1 && *source){
             *(dest++) = *(source++);
         }
         *dest = '\0';
@@ -69,7 +216,9 @@ static std::string timePointToString(const Clock::time_point &tp, const std::str
     const Clock::time_point::duration tt = tp.time_since_epoch();
     const time_t durS = std::chrono::duration_cast<std::chrono::seconds>(tt).count();
     std::ostringstream ss;
-    if (const std::tm *tm = (utc ? std::gmtime(&durS) : std::localtime(&durS))) {
+    // The _r versions, since tasks on several threads log at once.
+    std::tm tmBuf;
+    if (const std::tm *tm = (utc ? gmtime_r(&durS, &tmBuf) : localtime_r(&durS, &tmBuf))) {
         ss << std::put_time(tm, format.c_str());
         if (withMs) {
             const long long durMs = std::chrono::duration_cast<std::chrono::milliseconds>(tt).count();
@@ -85,7 +234,7 @@ static std::string timePointToString(const Clock::time_point &tp, const std::str
 
 void logMsg(const char *fmt, ...)
 {
-    char buf[200];
+    char buf[400];
     
     Clock::time_point now = std::chrono::system_clock::now();
     std::string stamp = timePointToString(now, "%Y-%m-%d %H:%M:%S.");
@@ -130,325 +279,5453 @@ double getCurrentSeconds()
     return secs;
 }
 
-// Send a buffer of bytes, making multiple calls to send if necessary
-// to send the entire buffer.
-bool sendAll(int sock, unsigned char *buf, size_t nbytes)
+// Return seconds from a monotonic, high-resolution clock, for timing
+// short intervals that shouldn't be disturbed by clock adjustments.
+double getMonotonicSeconds()
 {
-    bool bOK=true;
-    ssize_t totSent = 0;
-    size_t nBytesToSend = nbytes;
-    size_t offset = 0;
-    const int flags = 0;
-    do {
-        ssize_t bytes_sent = send(sock, buf+offset, nBytesToSend, flags);
-        if(bytes_sent < 0) {
-            perror("Error sending");
-            bOK = false;
-            break;
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Return CPU seconds used by the calling thread, or with bProcess by the
+// whole process.
+double getCpuSeconds(bool bProcess = false)
+{
+    struct timespec ts;
+    if(0 != clock_gettime(bProcess ? CLOCK_PROCESS_CPUTIME_ID : CLOCK_THREAD_CPUTIME_ID, &ts)) return 0;
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+// Sleep for the given (possibly fractional) number of seconds.
+void sleepSeconds(double secs)
+{
+    if(secs <= 0) return;
+    struct timespec ts;
+    ts.tv_sec = (time_t) secs;
+    ts.tv_nsec = (long) ((secs - ts.tv_sec) * 1e9);
+    while(nanosleep(&ts, &ts) < 0 && EINTR == errno) {
+        // Interrupted by a signal; sleep for the remainder.
+    }
+}
+
+// Coroutines for connection handling.  The per-connection engines are
+// straight-line coroutines that co_await their socket I/O and sleeps.  On
+// an IoLoop, a wait suspends the coroutine until epoll (poll elsewhere)
+// says the socket is ready, so a few threads can drive thousands of
+// connections.  With no loop, every wait completes at once and the same
+// code simply blocks; runSync runs a task that way.
+template<typename T>
+struct Task {
+    struct promise_type {
+        T                       value{};
+        std::coroutine_handle<> continuation;
+        std::atomic<int>       *pnDetached = NULL;  // The loop's count, for spawned tasks.
+
+        Task get_return_object() {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
         }
-        //printf("sendAll sent %ld bytes\n", bytes_sent);
-        totSent += bytes_sent;
-        offset += bytes_sent;
-    } while(totSent < nbytes);
-    return bOK;
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        // On completion, resume whoever awaited the task.  A spawned task
+        // has no awaiter, so it frees itself.
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                promise_type &promise = h.promise();
+                if(promise.continuation) return promise.continuation;
+                std::atomic<int> *pnDetached = promise.pnDetached;
+                if(pnDetached) {
+                    h.destroy();
+                    (*pnDetached)--;
+                }
+                return std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void return_value(T val) { value = std::move(val); }
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+
+    explicit Task(std::coroutine_handle<promise_type> h) : handle(h) {}
+    Task(Task &&other) noexcept : handle(other.handle) { other.handle = NULL; }
+    Task(const Task &) = delete;
+    ~Task() { if(handle) handle.destroy(); }
+
+    // Awaiting a task starts it; the awaiter resumes when it finishes.
+    bool await_ready() { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) {
+        handle.promise().continuation = awaiter;
+        return handle;
+    }
+    T await_resume() { return std::move(handle.promise().value); }
+};
+
+// Run a task with no loop, blocking until it finishes.
+template<typename T>
+T runSync(Task<T> task)
+{
+    task.handle.resume();
+    return task.await_resume();
 }
 
-// Read from a TCP socket until the provided buffer is full, or we
-// see the connection close (or return an error).
-// Entry:   sock    is the socket to read from.
-//          nbytes  is the size of the buffer pbuf.
-// Exit:    Returns the number of bytes read, or -1 if error.
-//          pbuf    contains the bytes that were read.
-//          bEOF is true iff the connection closed.
-ssize_t recvAll(int sock, unsigned char *pbuf, ssize_t nbytes, bool &bEOF)
+bool isWouldBlock(int err)
 {
-    fd_set fd_read, fd_write, fd_error;
-    bEOF = false;
+    return EAGAIN == err || EWOULDBLOCK == err;
+}
 
-    // The first argument to select() is weird.
-    const int nfds_to_examine = 1 + sock;
-    ssize_t bytesReadSoFar = 0;
-    int flags = 0;
-    do {
-        FD_ZERO(&fd_read);
-        FD_ZERO(&fd_write);
-        FD_ZERO(&fd_error);
-        FD_SET(sock, &fd_read);
-        FD_SET(sock, &fd_error);
-        
-        struct timeval timeout;
-        timeout.tv_sec = 5;
-        timeout.tv_usec = 0;
-        int nfds = select(nfds_to_examine, &fd_read, &fd_write, &fd_error, &timeout);
-        if(nfds < 0) {
-            perror("Error in select");
-            break;
-        } else if(0==nfds) {
-            puts("Timeout in select");
-            bytesReadSoFar = -1;
-            break;
-        } else {
-            // recv returns # of bytes returned, else 0 if connection was closed,
-            // else -1 if error.
-            ssize_t nbytesThisRead = recv(sock, bytesReadSoFar+pbuf,
-                                          nbytes-bytesReadSoFar, flags);
-            if(nbytesThisRead < 0) {
-                perror("reading from socket");
-                break;
-            } else if(0==nbytesThisRead) {
-                bEOF = true;
-                break;
+void setNonBlocking(int fd, bool bNonBlocking)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, bNonBlocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+}
+
+// Wait up to timeoutSecs for a blocking socket to become readable or
+// writable.  Returns false on timeout or error.
+bool waitForSocket(int sock, bool bWrite, double timeoutSecs)
+{
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(sock, &fds);
+    struct timeval timeout;
+    timeout.tv_sec = (time_t) timeoutSecs;
+    timeout.tv_usec = (suseconds_t) ((timeoutSecs - timeout.tv_sec) * 1e6);
+    int nfds;
+    double timeEnd = getMonotonicSeconds() + timeoutSecs;
+    while((nfds = select(1 + sock, bWrite ? NULL : &fds, bWrite ? &fds : NULL, NULL, &timeout)) < 0 &&
+          EINTR == errno) {
+        // Interrupted by a signal; wait for the rest of the time.
+        double secsLeft = std::max(0.0, timeEnd - getMonotonicSeconds());
+        FD_ZERO(&fds);
+        FD_SET(sock, &fds);
+        timeout.tv_sec = (time_t) secsLeft;
+        timeout.tv_usec = (suseconds_t) ((secsLeft - timeout.tv_sec) * 1e6);
+    }
+    if(nfds < 0) perror("Error in select");
+    return nfds > 0;
+}
+
+// SIGINT or SIGTERM stops tests cleanly: the handler records the signal
+// and writes to a self-pipe, whose read end wakes whatever is waiting for
+// the next connection; transfer loops check stopRequested() as they go.
+// A second signal kills the process as usual.
+volatile sig_atomic_t stopSignal = 0;
+int stopPipe[2] = {-1, -1};
+
+void onStopSignal(int sig)
+{
+    if(stopSignal) {
+        signal(sig, SIG_DFL);
+        raise(sig);
+        return;
+    }
+    stopSignal = sig;
+    int savedErrno = errno;
+    if(write(stopPipe[1], "s", 1) < 0) {
+        // The pipe is full, so a wakeup is pending anyway.
+    }
+    errno = savedErrno;
+}
+
+bool stopRequested()
+{
+    return 0 != stopSignal;
+}
+
+// Catch SIGINT and SIGTERM, with a fresh self-pipe (a forked worker calls
+// this again, so it doesn't share its parent's).  Without SA_RESTART,
+// blocking calls in the thread that takes the signal return EINTR.
+void installStopHandlers()
+{
+    if(stopPipe[0] >= 0) {
+        close(stopPipe[0]);
+        close(stopPipe[1]);
+    }
+    if(0 != pipe(stopPipe)) {
+        perror("pipe failed");
+        return;
+    }
+    for(int j=0; j<2; j++) {
+        setNonBlocking(stopPipe[j], true);
+        fcntl(stopPipe[j], F_SETFD, FD_CLOEXEC);
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onStopSignal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+}
+
+// Wait up to timeoutSecs for sock to become readable, or for a stop
+// signal.  Returns true if sock is readable.
+bool waitForSocketOrStop(int sock, double timeoutSecs)
+{
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(sock, &fds);
+    if(stopPipe[0] >= 0) FD_SET(stopPipe[0], &fds);
+    struct timeval timeout;
+    timeout.tv_sec = (time_t) timeoutSecs;
+    timeout.tv_usec = (suseconds_t) ((timeoutSecs - timeout.tv_sec) * 1e6);
+    int nfds = select(1 + std::max(sock, stopPipe[0]), &fds, NULL, NULL, &timeout);
+    return nfds > 0 && FD_ISSET(sock, &fds);
+}
+
+// Pin the calling process or thread to one CPU.
+bool pinToCpu(int cpu)
+{
+#if defined(__linux__)
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    return 0 == sched_setaffinity(0, sizeof(cpus), &cpus);
+#else
+    return false;
+#endif
+}
+
+// A task suspended until its fd is ready or its deadline passes.
+struct IoWaiter {
+    std::coroutine_handle<> handle;
+    int     fd = -1;            // -1 for a plain sleep.
+    bool    bWrite = false;
+    bool    bTimedOut = false;
+};
+
+// Counters written by one thread and read by a reporter thread without
+// locks, and without read-modify-write atomics on the writer's side: the
+// writer bumps a sequence number before and after each update (a
+// seqlock), and a reader retries if it changed under it or was odd.  On
+// x86 the writer's stores are plain moves.  Each thread's counters get
+// their own cache line, so writers never share one.
+struct alignas(64) ThreadCounters {
+    struct Values {
+        uint64_t    bytes = 0;      // Transferred by tasks on this thread.
+        uint64_t    ops = 0;        // Sends or receives.
+        uint64_t    busyUs = 0;     // Time spent running tasks.
+        uint64_t    runs = 0;       // Times a task was resumed.
+        uint64_t    steals = 0;     // ...after being stolen from another worker.
+    };
+    std::atomic<uint32_t>   seq;
+    std::atomic<uint64_t>   bytes, ops, busyUs, runs, steals;
+
+    ThreadCounters() : seq(0), bytes(0), ops(0), busyUs(0), runs(0), steals(0) {}
+
+    void beginWrite() {
+        seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+    void endWrite() {
+        seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+    static void bump(std::atomic<uint64_t> &counter, uint64_t n) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    // Writer only.
+    void addTransfer(uint64_t nbytes) {
+        beginWrite();
+        bump(bytes, nbytes);
+        bump(ops, 1);
+        endWrite();
+    }
+    void addRun(uint64_t us, bool bStolen) {
+        beginWrite();
+        bump(busyUs, us);
+        bump(runs, 1);
+        bump(steals, bStolen ? 1 : 0);
+        endWrite();
+    }
+
+    // Any thread: a consistent copy of all the counters.
+    Values snapshot() const {
+        Values vals;
+        uint32_t seqBefore, seqAfter;
+        do {
+            seqBefore = seq.load(std::memory_order_acquire);
+            vals.bytes = bytes.load(std::memory_order_relaxed);
+            vals.ops = ops.load(std::memory_order_relaxed);
+            vals.busyUs = busyUs.load(std::memory_order_relaxed);
+            vals.runs = runs.load(std::memory_order_relaxed);
+            vals.steals = steals.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            seqAfter = seq.load(std::memory_order_relaxed);
+        } while((seqBefore & 1) || seqBefore != seqAfter);
+        return vals;
+    }
+};
+
+struct IoLoop;
+
+// One worker thread of an IoLoop, with its own epoll set (poll elsewhere),
+// timers and queue of tasks ready to run.  Only the worker itself touches
+// its waiters and timers; the queue is shared with thieves.
+struct IoWorker {
+    IoLoop             *ploop = NULL;
+    int                 index = 0;
+    std::map<uint64_t, IoWaiter *> waiters;     // Suspended tasks, by wait id.
+    // Deadlines of timed waits, soonest first.  Entries whose wait has
+    // already completed are skipped.
+    std::priority_queue<std::pair<double, uint64_t>, std::vector<std::pair<double, uint64_t>>,
+                        std::greater<std::pair<double, uint64_t>>> deadlines;
+    uint64_t            nextId = 1;             // 0 is the wakeup pipe.
+    std::mutex          mutexQueue;
+    std::deque<std::coroutine_handle<>> runQueue;
+    std::atomic<bool>   bSleeping;
+    int                 wakeFds[2];             // Other workers write here to wake us.
+    double              timeSliceStart = 0;     // When the running task was resumed.
+    double              timeLastPoll = 0;
+    ThreadCounters      counters;               // Read by the loop's reporter.
+#if defined(__linux__)
+    int                 epfd;
+#endif
+
+    IoWorker() : bSleeping(false) {
+        if(pipe(wakeFds) < 0) perror("pipe");
+        setNonBlocking(wakeFds[0], true);
+        setNonBlocking(wakeFds[1], true);
+#if defined(__linux__)
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = 0;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, wakeFds[0], &ev);
+#endif
+    }
+    ~IoWorker() {
+#if defined(__linux__)
+        close(epfd);
+#endif
+        close(wakeFds[0]);
+        close(wakeFds[1]);
+    }
+
+    // Returns how many tasks are now queued.
+    size_t push(std::coroutine_handle<> h) {
+        std::lock_guard<std::mutex> lock(mutexQueue);
+        runQueue.push_back(h);
+        return runQueue.size();
+    }
+
+    // The owner runs its queue in order, so tasks that yield take turns.
+    bool pop(std::coroutine_handle<> &h) {
+        std::lock_guard<std::mutex> lock(mutexQueue);
+        if(runQueue.empty()) return false;
+        h = runQueue.front();
+        runQueue.pop_front();
+        return true;
+    }
+
+    // Thieves take from the back, the task that would wait longest here.
+    bool stealFrom(IoWorker &victim, std::coroutine_handle<> &h) {
+        std::lock_guard<std::mutex> lock(victim.mutexQueue);
+        if(victim.runQueue.empty()) return false;
+        h = victim.runQueue.back();
+        victim.runQueue.pop_back();
+        return true;
+    }
+
+    void wake() {
+        char ch = 'w';
+        if(write(wakeFds[1], &ch, 1) < 0) {
+            // The pipe's full, so a wakeup is already pending.
+        }
+    }
+
+    // Suspend a task until its fd is ready or until deadline (if nonzero).
+    void add(IoWaiter *pwaiter, double deadline) {
+        uint64_t id = nextId++;
+        waiters[id] = pwaiter;
+        if(deadline > 0) deadlines.push(std::make_pair(deadline, id));
+#if defined(__linux__)
+        if(pwaiter->fd >= 0) {
+            // One-shot, so a connection's socket is armed only while its
+            // task waits on it.
+            struct epoll_event ev;
+            ev.events = (pwaiter->bWrite ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+            ev.data.u64 = id;
+            if(epoll_ctl(epfd, EPOLL_CTL_MOD, pwaiter->fd, &ev) < 0 &&
+               epoll_ctl(epfd, EPOLL_CTL_ADD, pwaiter->fd, &ev) < 0) {
+                perror("epoll_ctl");
+            }
+        }
+#endif
+    }
+
+    // Queue the task whose wait has finished.
+    void complete(uint64_t id, bool bTimedOut) {
+        std::map<uint64_t, IoWaiter *>::iterator it = waiters.find(id);
+        if(waiters.end() == it) return;
+        IoWaiter *pwaiter = it->second;
+        waiters.erase(it);
+#if defined(__linux__)
+        if(bTimedOut && pwaiter->fd >= 0) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, pwaiter->fd, NULL);
+        }
+#endif
+        pwaiter->bTimedOut = bTimedOut;
+        push(pwaiter->handle);
+    }
+
+    // Milliseconds until the next deadline, at most maxMs.
+    int msToNextDeadline(int maxMs) {
+        while(!deadlines.empty() && !waiters.count(deadlines.top().second)) {
+            deadlines.pop();
+        }
+        if(deadlines.empty()) return maxMs;
+        double secs = deadlines.top().first - getMonotonicSeconds();
+        return std::min(maxMs, std::max(0, (int) ceil(1000 * secs)));
+    }
+
+    // Wait up to timeoutMs for sockets, then queue the tasks whose sockets
+    // are ready or whose deadlines have passed.
+    void poll(int timeoutMs) {
+        const int maxEvents = 256;
+#if defined(__linux__)
+        struct epoll_event events[maxEvents];
+        int nEvents = epoll_wait(epfd, events, maxEvents, timeoutMs);
+        for(int j=0; j<nEvents; j++) {
+            if(0 == events[j].data.u64) {
+                char buf[64];
+                while(read(wakeFds[0], buf, sizeof(buf)) > 0) {}
             } else {
-                bytesReadSoFar += nbytesThisRead;
+                complete(events[j].data.u64, false);
             }
         }
-    } while(bytesReadSoFar < nbytes);
-    //printf("recvAll returning %ld\n", bytesReadSoFar);
-    return bytesReadSoFar;
-}
+#else
+        std::vector<struct pollfd> pollfds;
+        std::vector<uint64_t> ids;
+        struct pollfd pfd;
+        pfd.fd = wakeFds[0];
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        pollfds.push_back(pfd);
+        ids.push_back(0);
+        for(std::map<uint64_t, IoWaiter *>::iterator it = waiters.begin(); it != waiters.end(); ++it) {
+            if(it->second->fd < 0) continue;
+            pfd.fd = it->second->fd;
+            pfd.events = it->second->bWrite ? POLLOUT : POLLIN;
+            pollfds.push_back(pfd);
+            ids.push_back(it->first);
+        }
+        int nEvents = ::poll(pollfds.data(), pollfds.size(), timeoutMs);
+        for(size_t j=0; nEvents > 0 && j<pollfds.size(); j++) {
+            if(!pollfds[j].revents) continue;
+            if(0 == ids[j]) {
+                char buf[64];
+                while(read(wakeFds[0], buf, sizeof(buf)) > 0) {}
+            } else {
+                complete(ids[j], false);
+            }
+        }
+#endif
+        double timeNow = getMonotonicSeconds();
+        while(!deadlines.empty() && deadlines.top().first <= timeNow) {
+            uint64_t id = deadlines.top().second;
+            deadlines.pop();
+            complete(id, true);
+        }
+        timeLastPoll = timeNow;
+    }
+};
 
-int handleServerConnection(int socket_to_client)
-{
-    int retval = 0;
-    char bufFromClient[256];
-    ssize_t nbytes;
-    
-    ssize_t nBytesSoFar = 0;
-    ssize_t freeBytes = sizeof(bufFromClient)-1;
-    string msgFromClient;
-    int secsToSend=0;
-    int bytesPerBuf=0;
-    
-    // Read the message from the client, which tells us what to do
-    // and what the parameters are.
-    do {
-        nbytes = recv(socket_to_client, nBytesSoFar+bufFromClient, freeBytes, 0);
-        if(nbytes > 0) {
-            nBytesSoFar += nbytes;
-            freeBytes -= nbytes;
-            bufFromClient[nBytesSoFar] = '\0';
-            if(NULL != strchr(bufFromClient, '\n')) break;
-        } else if(0==nbytes) {
-            puts("Error: unexpected early end of stream");
-            break;
-        } else {
-            perror("Error during initial msg from client");
-            break;
+// The worker the calling thread runs, if any.
+thread_local IoWorker *pcurrentWorker = NULL;
+
+// Executor for tasks waiting on sockets and timers: a fixed set of worker
+// threads, optionally pinned one per CPU.  A task resumes on the worker
+// whose poll saw its wait finish, and a worker with nothing to run steals
+// from the others' queues, so a few heavy connections can't keep one
+// worker busy while others idle.  Tasks go back on the queue after each
+// time slice (YieldIfDue), which is what makes long transfers stealable.
+struct IoLoop {
+    std::vector<std::unique_ptr<IoWorker>> workers;
+    std::atomic<int>    nTasks;             // Spawned tasks not yet finished.
+    bool                bPin;
+    bool                bForever = false;
+    double              timeStart;
+
+    explicit IoLoop(int nWorkers = 1, bool bPinWorkers = false)
+        : nTasks(0), bPin(bPinWorkers), timeStart(getMonotonicSeconds()) {
+        for(int j=0; j<std::max(1, nWorkers); j++) {
+            workers.push_back(std::unique_ptr<IoWorker>(new IoWorker));
+            workers.back()->ploop = this;
+            workers.back()->index = j;
         }
-    } while(nBytesSoFar < sizeof(bufFromClient)-1);
-    
-    char *ptok = strtok(bufFromClient, "|");
-    // Ignore the first token, which should always be "send".
-    if(ptok) {
-        // Parse the # of seconds to send.
-        ptok = strtok(NULL, "|");
     }
-    if(ptok) {
-        secsToSend = atoi(ptok);
-        // Parse the # of bytes to send at once.
-        ptok = strtok(NULL, "|");
+
+    // The calling thread's worker, or the first for threads outside the loop.
+    IoWorker &current() {
+        return pcurrentWorker && this == pcurrentWorker->ploop ? *pcurrentWorker : *workers[0];
     }
-    if(ptok) {
-        bytesPerBuf = atoi(ptok);
-        // Parse the message the client wants us to log.
-        ptok = strtok(NULL, "|");
-        if(ptok) {
-            msgFromClient = ptok;
+
+    // Queue a task that's ready to run on this thread's worker, and wake
+    // a sleeping worker to steal it if this one has a backlog.
+    void ready(std::coroutine_handle<> h) {
+        IoWorker &worker = current();
+        if(worker.push(h) < 2) return;
+        for(size_t j=0; j<workers.size(); j++) {
+            if(workers[j].get() != &worker && workers[j]->bSleeping.load()) {
+                workers[j]->wake();
+                break;
+            }
         }
     }
-    
-    logMsg("Client says send for %d secs; %d bytes per send; msg: %s",
-           secsToSend, bytesPerBuf, msgFromClient.c_str());
 
-    // This will auto-delete the array when it goes out of scope.
-    std::unique_ptr<unsigned char> pbuf(new unsigned char[bytesPerBuf]);
-    
-    // Fill the buffer with data.
-    unsigned char mybyte = (unsigned char) 'A';
-    for(int j=0; j<bytesPerBuf; j++) {
-        pbuf.get()[j] = mybyte;
-        mybyte++;
-        if(!isprint(mybyte)) mybyte = 'A';
+    // Start a task that runs on this loop until it finishes.
+    void spawn(Task<int> task) {
+        std::coroutine_handle<Task<int>::promise_type> h = task.handle;
+        task.handle = NULL;
+        h.promise().pnDetached = &nTasks;
+        nTasks++;
+        ready(h);
     }
-    
-    double timeStart = getCurrentSeconds();
-    double timeLastUIUpdate = timeStart;
-    double secsSinceStart;
-    size_t totBytesSent = 0;
-    size_t nSends = 0;
-    do {
-        bool bOK = sendAll(socket_to_client, pbuf.get(), bytesPerBuf);
-        if(!bOK) {
-            perror("Error sending buffer");
-            break;
+
+    bool steal(IoWorker &thief, std::coroutine_handle<> &h) {
+        for(size_t j=1; j<workers.size(); j++) {
+            IoWorker &victim = *workers[(thief.index + j) % workers.size()];
+            if(thief.stealFrom(victim, h)) return true;
         }
-        totBytesSent += bytesPerBuf;
-        nSends++;
-        double timeNow = getCurrentSeconds();
-        double secsSinceLastUIUpdate = timeNow - timeLastUIUpdate;
-        if(secsSinceLastUIUpdate >= 1.0) {
-            timeLastUIUpdate = timeNow;
+        return false;
+    }
+
+    void runWorker(IoWorker &worker) {
+        pcurrentWorker = &worker;
+        if(bPin && workers.size() > 1) {
+            pinToCpu(worker.index % std::max(1u, std::thread::hardware_concurrency()));
         }
-        secsSinceStart = timeNow - timeStart;
-        //printf("handleServerConnection: secsSinceStart=%7.2f secsToSend=%d\n",secsSinceStart, secsToSend);
-    } while(secsSinceStart < secsToSend);
-    
-    close(socket_to_client);
-    
-    double timeEnd = getCurrentSeconds();
-    double secs = timeEnd - timeStart;
-    double mbPerSec = totBytesSent / secs / (1024.0*1024.0);
-    logMsg("Sent %ld bytes in %.3f secs for %.3f MB/sec (%.3f Mb/sec)", totBytesSent, secs, mbPerSec, 8*mbPerSec);
-    
-    return retval;
-}
+        while(bForever || nTasks > 0) {
+            std::coroutine_handle<> h;
+            bool bStolen = false;
+            if(!worker.pop(h) && !(bStolen = steal(worker, h))) {
+                // Nothing to run: sleep until a socket or timer is ready
+                // or another worker has work for us.  Look once more after
+                // saying we're asleep, in case work arrived meanwhile.
+                worker.bSleeping = true;
+                if(!(bStolen = steal(worker, h))) {
+                    worker.poll(worker.msToNextDeadline(100));
+                    worker.bSleeping = false;
+                    continue;
+                }
+                worker.bSleeping = false;
+            }
+            double timeResume = getMonotonicSeconds();
+            worker.timeSliceStart = timeResume;
+            h.resume();
+            double timeNow = getMonotonicSeconds();
+            worker.counters.addRun((uint64_t) (1e6 * (timeNow - timeResume)), bStolen);
+            // Keep sockets and timers serviced while the queue is busy.
+            if(timeNow - worker.timeLastPoll >= TASK_TIME_SLICE_US / 1e6) {
+                worker.poll(0);
+            }
+        }
+        pcurrentWorker = NULL;
+    }
 
-int doServer(Settings settings)
-{
-    int retval = 0;
-    int socket_listen, socket_to_client, addr_len;
-    struct sockaddr_in server_addr, client_addr;
-    
-    //Create socket
-    int protocol = 0;  // protocol is IP.
-    socket_listen = socket(AF_INET , SOCK_STREAM , protocol);
-    if (socket_listen == -1) {
-        printf("Could not create socket");
+    // Run the workers, this thread being the first, until no spawned tasks
+    // remain or, if bForever, indefinitely.
+    void run(bool bRunForever) {
+        bForever = bRunForever;
+        std::vector<std::thread> threads;
+        for(size_t j=1; j<workers.size(); j++) {
+            threads.push_back(std::thread(&IoLoop::runWorker, this, std::ref(*workers[j])));
+        }
+        runWorker(*workers[0]);
+        for(size_t j=0; j<threads.size(); j++) {
+            threads[j].join();
+        }
     }
-    
-    //Prepare the sockaddr_in structure
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(settings.port);
-    
-    // Call bind to prepare to start listening.
-    if( bind(socket_listen,(struct sockaddr *)&server_addr , sizeof(server_addr)) < 0)
-    {
-        perror("bind failed.");
-        //return 1;
+
+    // Count a transfer by the running task in its worker's counters.
+    void countTransfer(size_t nbytes) {
+        current().counters.addTransfer(nbytes);
     }
-    
-    // Listen on the socket. Do not allow a backlog, because since the purpose
-    // of this program is to measure total throughput, we do not want simultaneous
-    // connections.
-    int backlog = 0;
-    if(-1 == listen(socket_listen, backlog)) {
-        perror("Error listening");
+
+    // Per-worker utilization since the loop started: "busy%/runs/steals".
+    string describeWorkers() {
+        string str;
+        char buf[80];
+        double secs = getMonotonicSeconds() - timeStart;
+        for(size_t j=0; j<workers.size(); j++) {
+            ThreadCounters::Values vals = workers[j]->counters.snapshot();
+            snprintf(buf, sizeof(buf), "%s%zu: %.0f%% %llu/%llu", j ? "; " : "", j,
+                     secs > 0 ? vals.busyUs / (1e4 * secs) : 0.0,
+                     (unsigned long long) vals.runs, (unsigned long long) vals.steals);
+            str += buf;
+        }
+        return str;
     }
-    
-    addr_len = sizeof(struct sockaddr_in);
-    
-    do {
-        // Accept connection from an incoming client.
-        logMsg("Waiting to accept a connection on port %d", settings.port);
-        socket_to_client = accept(socket_listen, (struct sockaddr *)&client_addr, (socklen_t*)&addr_len);
-        if (socket_to_client < 0) {
-            perror("accept failed");
-        } else {
-            logMsg("Accepted connection");
-            
-            // Weirdly, macos seems to kill the app with SIGPIPE when a connection
-            // closes.  Prevent that from happening.
-            int option_value = 1; /* Set NOSIGPIPE to ON */
-            if (setsockopt (socket_to_client, SOL_SOCKET, SO_NOSIGPIPE, &option_value, sizeof (option_value)) < 0) {
-                perror ("setsockopt(,,SO_NOSIGPIPE)");
-            }
-            
-            retval = handleServerConnection(socket_to_client);
-            logMsg("Client connection closed.");
-            flushLogFile();
+};
+
+// Reporter thread for a loop.  At each interval boundary it snapshots
+// every worker's counters, then logs the total rate across all streams
+// and each worker's share of the bytes and busy time.  Intervals with no
+// transfers aren't logged.
+struct LoopReporter {
+    IoLoop             *ploop = NULL;
+    double              secsInterval = 1;
+    std::atomic<bool>   bStop;
+    std::thread         thread;
+
+    LoopReporter() : bStop(false) {}
+
+    void start(IoLoop *ploopToReport, double secs) {
+        ploop = ploopToReport;
+        secsInterval = secs;
+        thread = std::thread(&LoopReporter::run, this);
+    }
+
+    void stop() {
+        bStop = true;
+        if(thread.joinable()) thread.join();
+    }
+
+    void run() {
+        size_t nWorkers = ploop->workers.size();
+        std::vector<ThreadCounters::Values> prev(nWorkers), cur(nWorkers);
+        double timePrev = getMonotonicSeconds();
+        double timeNext = timePrev + secsInterval;
+        while(!bStop) {
+            sleepSeconds(std::min(0.05, timeNext - getMonotonicSeconds()));
+            if(getMonotonicSeconds() < timeNext) continue;
+            for(size_t j=0; j<nWorkers; j++) {
+                cur[j] = ploop->workers[j]->counters.snapshot();
+            }
+            double timeNow = getMonotonicSeconds();
+            double secs = timeNow - timePrev;
+            uint64_t bytes = 0;
+            string perWorker;
+            char buf[80];
+            for(size_t j=0; j<nWorkers; j++) {
+                uint64_t bytesWorker = cur[j].bytes - prev[j].bytes;
+                bytes += bytesWorker;
+                snprintf(buf, sizeof(buf), "%s%zu: %.1f MB/sec %.0f%%", j ? "; " : "", j,
+                         bytesWorker / secs / (1024*1024), (cur[j].busyUs - prev[j].busyUs) / (1e4 * secs));
+                perWorker += buf;
+            }
+            if(bytes > 0) {
+                double mbPerSec = bytes / secs / (1024*1024);
+                logMsg("%9.3f MB/sec (%.3f Mb/sec) all streams; workers %s", mbPerSec, 8*mbPerSec,
+                       perWorker.c_str());
+            }
+            prev = cur;
+            timePrev = timeNow;
+            timeNext += secsInterval;
+        }
+    }
+};
+
+// co_await IoWait(ploop, sock, bWrite, timeoutSecs) waits for a socket to
+// be readable or writable, giving up after timeoutSecs unless that's 0.
+// Evaluates to false on timeout.  With no loop, a timed wait blocks in
+// select() and an untimed one returns at once, leaving the I/O to block.
+struct IoWait {
+    IoLoop         *ploop;
+    IoWaiter        waiter;
+    double          timeoutSecs;
+
+    IoWait(IoLoop *ploopToUse, int fd, bool bWrite, double timeout = 0)
+        : ploop(ploopToUse), timeoutSecs(timeout) {
+        waiter.fd = fd;
+        waiter.bWrite = bWrite;
+    }
+    bool await_ready() {
+        if(ploop) return false;
+        if(timeoutSecs > 0) waiter.bTimedOut = !waitForSocket(waiter.fd, waiter.bWrite, timeoutSecs);
+        return true;
+    }
+    void await_suspend(std::coroutine_handle<> h) {
+        waiter.handle = h;
+        ploop->current().add(&waiter, timeoutSecs > 0 ? getMonotonicSeconds() + timeoutSecs : 0);
+    }
+    bool await_resume() { return !waiter.bTimedOut; }
+};
+
+// co_await SleepFor(ploop, secs): sleepSeconds for tasks.
+struct SleepFor {
+    IoLoop         *ploop;
+    IoWaiter        waiter;
+    double          secs;
+
+    SleepFor(IoLoop *ploopToUse, double secsToSleep) : ploop(ploopToUse), secs(secsToSleep) {}
+    bool await_ready() {
+        if(ploop && secs > 0) return false;
+        sleepSeconds(secs);
+        return true;
+    }
+    void await_suspend(std::coroutine_handle<> h) {
+        waiter.handle = h;
+        ploop->current().add(&waiter, getMonotonicSeconds() + secs);
+    }
+    void await_resume() {}
+};
+
+// co_await YieldIfDue(ploop) lets other tasks run if this one has had its
+// worker for a whole time slice.  A socket that never fills or empties,
+// as on loopback, would otherwise let one connection starve the rest.
+struct YieldIfDue {
+    IoLoop         *ploop;
+
+    explicit YieldIfDue(IoLoop *ploopToUse) : ploop(ploopToUse) {}
+    bool await_ready() {
+        return !ploop || getMonotonicSeconds() - ploop->current().timeSliceStart < TASK_TIME_SLICE_US / 1e6;
+    }
+    void await_suspend(std::coroutine_handle<> h) {
+        ploop->ready(h);
+    }
+    void await_resume() {}
+};
+
+// co_await MoveToOwnThread() resumes the task on a new thread, for work
+// that has to block or spin, such as the shared-memory ring or timed UDP
+// trains.  Afterwards the task must use no loop and a blocking socket.
+struct MoveToOwnThread {
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> h) {
+        std::thread([h]() { h.resume(); }).detach();
+    }
+    void await_resume() {}
+};
+
+// Minimum, average and maximum of a series of samples.
+struct RunningStats {
+    size_t  n = 0;
+    double  sum = 0;
+    double  min = 0;
+    double  max = 0;
+
+    void add(double val) {
+        if(0 == n || val < min) min = val;
+        if(0 == n || val > max) max = val;
+        sum += val;
+        n++;
+    }
+    double avg() const { return n ? sum / n : 0; }
+};
+
+// Return the pth percentile (0-100) of a series of samples, interpolating
+// between the closest ranks.  Sorts the vector.
+double percentile(std::vector<double> &vals, double p)
+{
+    if(vals.empty()) return 0;
+    std::sort(vals.begin(), vals.end());
+    double rank = (p / 100.0) * (vals.size() - 1);
+    size_t lo = (size_t) rank;
+    size_t hi = std::min(lo + 1, vals.size() - 1);
+    return vals[lo] + (rank - lo) * (vals[hi] - vals[lo]);
+}
+
+// Mean of the lowest pctKeep percent of vals, which it sorts, to discount
+// a few outliers.
+double trimmedMean(std::vector<double> &vals, double pctKeep)
+{
+    if(vals.empty()) return 0;
+    std::sort(vals.begin(), vals.end());
+    size_t n = std::max<size_t>(1, (size_t) ceil(vals.size() * pctKeep / 100));
+    double sum = 0;
+    for(size_t j=0; j<n; j++) sum += vals[j];
+    return sum / n;
+}
+
+// Mann-Whitney U test of whether samples a and b come from the same
+// distribution, for comparing runs without assuming they're normal.
+// Returns the two-sided p-value from the normal approximation, corrected
+// for ties, and sets delta to Cliff's delta, the effect size: how much
+// more likely a value from b is to exceed one from a than the reverse,
+// from -1 to 1.
+double mannWhitney(const std::vector<double> &a, const std::vector<double> &b, double &delta)
+{
+    delta = 0;
+    double n1 = a.size(), n2 = b.size(), n = n1 + n2;
+    if(0 == n1 || 0 == n2) return 1;
+    std::vector<std::pair<double,bool>> pooled;     // Value, and whether it's from a.
+    for(double val : a) pooled.push_back(std::make_pair(val, true));
+    for(double val : b) pooled.push_back(std::make_pair(val, false));
+    std::sort(pooled.begin(), pooled.end());
+    // Sum a's ranks, giving tied values the average of their ranks.
+    double rankSumA = 0, tieTerm = 0;
+    for(size_t j=0; j<pooled.size(); ) {
+        size_t k = j;
+        while(k < pooled.size() && pooled[k].first == pooled[j].first) k++;
+        double t = k - j, rank = (j + 1 + k) / 2.0;
+        for(size_t i=j; i<k; i++) {
+            if(pooled[i].second) rankSumA += rank;
+        }
+        tieTerm += t*t*t - t;
+        j = k;
+    }
+    double uA = rankSumA - n1*(n1 + 1)/2;   // Pairs in which a's value is bigger.
+    delta = 1 - 2*uA/(n1*n2);
+    double sigma = sqrt(n1*n2/12 * ((n + 1) - tieTerm/(n*(n - 1))));
+    if(0 == sigma) return 1;
+    double diff = fabs(uA - n1*n2/2) - 0.5;  // With continuity correction.
+    return std::min(1.0, erfc(std::max(0.0, diff) / sigma / sqrt(2.0)));
+}
+
+// Histogram of latencies in microseconds, with fixed memory and about 3%
+// resolution: exact buckets below 64 us, then 32 buckets per power of two.
+// Recording a sample never allocates, so it's safe in the transfer loop.
+#define HISTO_SUB_BUCKETS 32
+#define HISTO_OCTAVES 40
+struct LatencyHistogram {
+    uint64_t    counts[2*HISTO_SUB_BUCKETS + HISTO_OCTAVES*HISTO_SUB_BUCKETS] = {};
+    RunningStats stats;
+
+    static size_t bucketFor(uint64_t usecs) {
+        if(usecs < 2*HISTO_SUB_BUCKETS) return (size_t) usecs;
+        int msb = 0;
+        while((usecs >> (msb+1)) != 0) msb++;
+        int shift = msb - 5;
+        size_t bucket = 2*HISTO_SUB_BUCKETS + (shift-1)*HISTO_SUB_BUCKETS +
+                        (size_t) ((usecs >> shift) - HISTO_SUB_BUCKETS);
+        return std::min(bucket, sizeof(counts)/sizeof(counts[0]) - 1);
+    }
+    static double bucketLowerBound(size_t bucket) {
+        if(bucket < 2*HISTO_SUB_BUCKETS) return (double) bucket;
+        size_t shift = 1 + (bucket - 2*HISTO_SUB_BUCKETS) / HISTO_SUB_BUCKETS;
+        size_t top = HISTO_SUB_BUCKETS + (bucket - 2*HISTO_SUB_BUCKETS) % HISTO_SUB_BUCKETS;
+        return (double) (top << shift);
+    }
+    void record(double usecs) {
+        if(usecs < 0) usecs = 0;
+        counts[bucketFor((uint64_t) usecs)]++;
+        stats.add(usecs);
+    }
+    size_t count() const { return stats.n; }
+    // Return the pth percentile (0-100), to within the bucket resolution.
+    double percentile(double p) const {
+        if(0 == stats.n) return 0;
+        uint64_t target = (uint64_t) (p / 100.0 * (stats.n - 1)) + 1;
+        if(target >= stats.n) return stats.max;
+        uint64_t cum = 0;
+        for(size_t j=0; j<sizeof(counts)/sizeof(counts[0]); j++) {
+            cum += counts[j];
+            if(cum >= target) {
+                return std::min(stats.max, std::max(stats.min, bucketLowerBound(j)));
+            }
+        }
+        return stats.max;
+    }
+    void reset() {
+        memset(counts, 0, sizeof(counts));
+        stats = RunningStats();
+    }
+};
+
+// Transport-level statistics for a connected TCP socket, as reported by
+// the kernel.  Fields the platform doesn't provide are left at zero.
+struct TcpStats {
+    double   rttMs = 0;         // Smoothed round trip time.
+    double   rttVarMs = 0;
+    double   rcvRttMs = 0;      // Receiver's estimate of the RTT (Linux only).
+    uint32_t cwndBytes = 0;     // Sender's congestion window.
+    uint32_t mss = 0;
+    uint32_t totalRetrans = 0;  // Segments retransmitted over the connection.
+};
+
+// Fetch TCP_INFO (Linux) or TCP_CONNECTION_INFO (macOS) for a socket.
+// Returns false if the information isn't available.
+bool getTcpStats(int sock, TcpStats &stats)
+{
+#if defined(__linux__)
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    memset(&info, 0, sizeof(info));
+    if(getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) {
+        return false;
+    }
+    stats.rttMs = info.tcpi_rtt / 1000.0;
+    stats.rttVarMs = info.tcpi_rttvar / 1000.0;
+    stats.rcvRttMs = info.tcpi_rcv_rtt / 1000.0;
+    stats.cwndBytes = info.tcpi_snd_cwnd * info.tcpi_snd_mss;
+    stats.mss = info.tcpi_snd_mss;
+    stats.totalRetrans = info.tcpi_total_retrans;
+    return true;
+#elif defined(__APPLE__)
+    struct tcp_connection_info info;
+    socklen_t len = sizeof(info);
+    memset(&info, 0, sizeof(info));
+    if(getsockopt(sock, IPPROTO_TCP, TCP_CONNECTION_INFO, &info, &len) < 0) {
+        return false;
+    }
+    stats.rttMs = info.tcpi_srtt;
+    stats.rttVarMs = info.tcpi_rttvar;
+    stats.cwndBytes = info.tcpi_snd_cwnd;
+    stats.mss = info.tcpi_maxseg;
+    stats.totalRetrans = (uint32_t) info.tcpi_txretransmitpackets;
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Set SO_SNDBUF or SO_RCVBUF and return the size the kernel actually chose
+// (Linux doubles the request to allow for bookkeeping overhead).
+int setSocketBufferSize(int sock, int which, int nbytes)
+{
+    if(setsockopt(sock, SOL_SOCKET, which, &nbytes, sizeof(nbytes)) < 0) {
+        perror(SO_SNDBUF == which ? "setsockopt(,,SO_SNDBUF)" : "setsockopt(,,SO_RCVBUF)");
+    }
+    int actual = 0;
+    socklen_t len = sizeof(actual);
+    getsockopt(sock, SOL_SOCKET, which, &actual, &len);
+    return actual;
+}
+
+// Set the congestion control algorithm (TCP_CONGESTION) for a socket.
+bool setCongestionControl(int sock, const string &cc)
+{
+#if defined(TCP_CONGESTION)
+    if(setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, cc.c_str(), (socklen_t) cc.length()) < 0) {
+        perror("setsockopt(,,TCP_CONGESTION)");
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Return the congestion control algorithm in use, or "" if unknown.
+string getCongestionControl(int sock)
+{
+#if defined(TCP_CONGESTION)
+    char name[32] = "";
+    socklen_t len = sizeof(name) - 1;
+    if(0 == getsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, name, &len)) {
+        name[len] = '\0';
+        return string(name);
+    }
+#endif
+    return "";
+}
+
+// Split a string into fields separated by delim.  Unlike strtok, empty
+// fields are preserved, so "a||b" yields three fields.
+std::vector<string> splitFields(const string &str, char delim)
+{
+    std::vector<string> fields;
+    size_t start = 0;
+    do {
+        size_t pos = str.find(delim, start);
+        if(string::npos == pos) {
+            fields.push_back(str.substr(start));
+            break;
+        }
+        fields.push_back(str.substr(start, pos-start));
+        start = pos + 1;
+    } while(true);
+    return fields;
+}
+
+// Parse "name=value" fields into a map.  Fields without '=' are ignored.
+void parseNameValues(const std::vector<string> &fields, size_t first,
+                     std::map<string,string> &values)
+{
+    for(size_t j=first; j<fields.size(); j++) {
+        size_t pos = fields[j].find('=');
+        if(string::npos != pos) {
+            values[fields[j].substr(0, pos)] = fields[j].substr(pos+1);
+        }
+    }
+}
+
+// s without leading and trailing white space, line ends included.
+string trimSpaces(const string &s)
+{
+    size_t first = s.find_first_not_of(" \t\r\n");
+    if(string::npos == first) return "";
+    return s.substr(first, s.find_last_not_of(" \t\r\n") - first + 1);
+}
+
+// The connected socket's MSS (TCP_MAXSEG) and path MTU (IP_MTU, Linux
+// only; 0 elsewhere).  Returns false if the MSS isn't known.
+bool getPathMtu(int sock, int &mtu, int &mss)
+{
+    socklen_t len = sizeof(mss);
+    mtu = 0;
+    if(getsockopt(sock, IPPROTO_TCP, TCP_MAXSEG, &mss, &len) < 0 || mss <= 0) {
+        mss = 0;
+        return false;
+    }
+#if defined(__linux__)
+    len = sizeof(mtu);
+    if(getsockopt(sock, IPPROTO_IP, IP_MTU, &mtu, &len) < 0) mtu = 0;
+#endif
+    return true;
+}
+
+// Size of the sender's writes for -align: "mss" rounds nbytes down to a
+// whole number of segments (at least one), and "gso" makes each write the
+// most segments that fit in one GSO/TSO super-packet, so the stack can
+// hand the NIC full 64 KB batches with no runt segment at the end.
+int alignedBufferSize(const string &align, int nbytes, int mss)
+{
+    if(mss <= 0) return nbytes;
+    if("mss" == align) return std::max(1, nbytes / mss) * mss;
+    if("gso" == align) return std::max(1, (GSO_MAX_BYTES - GSO_HEADROOM_BYTES) / mss) * mss;
+    return nbytes;
+}
+
+// The name of the interface with the socket's local address, or "" if
+// there's none (or it can't be found).
+string interfaceOf(int sock)
+{
+    struct sockaddr_in local;
+    socklen_t len = sizeof(local);
+    struct ifaddrs *pifaddrs = NULL;
+    string name;
+    if(getsockname(sock, (struct sockaddr *) &local, &len) < 0 || AF_INET != local.sin_family ||
+       getifaddrs(&pifaddrs) < 0) {
+        return name;
+    }
+    for(struct ifaddrs *pifa = pifaddrs; pifa; pifa = pifa->ifa_next) {
+        if(pifa->ifa_addr && AF_INET == pifa->ifa_addr->sa_family &&
+           ((struct sockaddr_in *) pifa->ifa_addr)->sin_addr.s_addr == local.sin_addr.s_addr) {
+            name = pifa->ifa_name;
+            break;
+        }
+    }
+    freeifaddrs(pifaddrs);
+    return name;
+}
+
+// The name of the interface that traffic to host leaves by, found by
+// connecting a UDP socket (which sends nothing).
+string interfaceToward(const string &host)
+{
+    struct addrinfo hints, *paddrs = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    string name;
+    if(0 != getaddrinfo(host.c_str(), "9", &hints, &paddrs) || NULL == paddrs) return name;
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if(sock >= 0 && 0 == connect(sock, paddrs->ai_addr, paddrs->ai_addrlen)) {
+        name = interfaceOf(sock);
+    }
+    if(sock >= 0) close(sock);
+    freeaddrinfo(paddrs);
+    return name;
+}
+
+// Host-wide and interface counters that explain a result: the IP, TCP
+// and UDP MIBs in /proc/net/snmp, the TcpExt and IpExt ones (drops,
+// prunes, retransmit kinds) in /proc/net/netstat, the interface's
+// /sys/class/net/<if>/statistics, and its driver's ethtool -S counters.
+// Named "Tcp.RetransSegs", "TcpExt.PruneCalled", "if.rx_dropped" and
+// "nic.<driver's name>".  Linux only; elsewhere there are none.
+struct StackCounters {
+    std::map<string, int64_t> values;
+
+    void snapshot(const string &ifname) {
+        values.clear();
+#if defined(__linux__)
+        readMibs("/proc/net/snmp");
+        readMibs("/proc/net/netstat");
+        if(ifname.empty()) return;
+        string dir = "/sys/class/net/" + ifname + "/statistics/";
+        static const char *ifStats[] = {"rx_packets", "tx_packets", "rx_bytes", "tx_bytes",
+            "rx_errors", "tx_errors", "rx_dropped", "tx_dropped", "rx_missed_errors",
+            "rx_fifo_errors", "tx_fifo_errors", "rx_over_errors", "rx_crc_errors",
+            "rx_frame_errors", "rx_length_errors", "tx_carrier_errors", "collisions"};
+        for(const char *stat : ifStats) {
+            FILE *file = fopen((dir + stat).c_str(), "r");
+            if(NULL == file) continue;
+            long long val;
+            if(1 == fscanf(file, "%lld", &val)) values[string("if.") + stat] = val;
+            fclose(file);
+        }
+        readEthtool(ifname);
+#endif
+    }
+
+    // Counters that changed between before and this snapshot.
+    std::vector<std::pair<string,int64_t>> deltasSince(const StackCounters &before) const {
+        std::vector<std::pair<string,int64_t>> deltas;
+        for(const auto &val : values) {
+            auto it = before.values.find(val.first);
+            if(it != before.values.end() && it->second != val.second) {
+                deltas.push_back(std::make_pair(val.first, val.second - it->second));
+            }
+        }
+        return deltas;
+    }
+
+#if defined(__linux__)
+    // Read a file of "Proto: name name ..." lines, each followed by a
+    // "Proto: value value ..." line.
+    void readMibs(const char *path) {
+        FILE *file = fopen(path, "r");
+        if(NULL == file) return;
+        // Lines grow as the kernel adds counters, so getline sizes them.
+        char *pnames = NULL, *pvals = NULL;
+        size_t namesCap = 0, valsCap = 0;
+        while(getline(&pnames, &namesCap, file) > 0 && getline(&pvals, &valsCap, file) > 0) {
+            std::vector<string> nameFields = splitFields(trimSpaces(pnames), ' ');
+            std::vector<string> valFields = splitFields(trimSpaces(pvals), ' ');
+            if(nameFields.size() != valFields.size() || nameFields.empty()) continue;
+            string proto = nameFields[0].substr(0, nameFields[0].size() - 1);
+            for(size_t j=1; j<nameFields.size(); j++) {
+                values[proto + "." + nameFields[j]] = atoll(valFields[j].c_str());
+            }
+        }
+        free(pnames);
+        free(pvals);
+        fclose(file);
+    }
+
+    // The driver's statistics, as ethtool -S shows them.
+    void readEthtool(const string &ifname) {
+        int sock = socket(AF_INET, SOCK_DGRAM, 0);
+        if(sock < 0) return;
+        struct ifreq ifr;
+        memset(&ifr, 0, sizeof(ifr));
+        safe_strcpy(ifr.ifr_name, sizeof(ifr.ifr_name), ifname.c_str());
+        struct ethtool_drvinfo drvinfo;
+        memset(&drvinfo, 0, sizeof(drvinfo));
+        drvinfo.cmd = ETHTOOL_GDRVINFO;
+        ifr.ifr_data = (char *) &drvinfo;
+        uint32_t nStats = 0;
+        if(0 == ioctl(sock, SIOCETHTOOL, &ifr)) nStats = drvinfo.n_stats;
+        if(nStats > 0) {
+            std::vector<unsigned char> stringsBuf(sizeof(struct ethtool_gstrings) + nStats * ETH_GSTRING_LEN);
+            std::vector<unsigned char> statsBuf(sizeof(struct ethtool_stats) + nStats * sizeof(uint64_t));
+            struct ethtool_gstrings *pstrings = (struct ethtool_gstrings *) stringsBuf.data();
+            struct ethtool_stats *pstats = (struct ethtool_stats *) statsBuf.data();
+            pstrings->cmd = ETHTOOL_GSTRINGS;
+            pstrings->string_set = ETH_SS_STATS;
+            pstrings->len = nStats;
+            pstats->cmd = ETHTOOL_GSTATS;
+            pstats->n_stats = nStats;
+            ifr.ifr_data = (char *) pstrings;
+            bool bOK = 0 == ioctl(sock, SIOCETHTOOL, &ifr);
+            ifr.ifr_data = (char *) pstats;
+            bOK = bOK && 0 == ioctl(sock, SIOCETHTOOL, &ifr);
+            for(uint32_t j=0; bOK && j<std::min(nStats, pstrings->len); j++) {
+                string name((const char *) pstrings->data + j * ETH_GSTRING_LEN,
+                            strnlen((const char *) pstrings->data + j * ETH_GSTRING_LEN, ETH_GSTRING_LEN));
+                values["nic." + name] = (int64_t) pstats->data[j];
+            }
+        }
+        close(sock);
+    }
+#endif
+};
+
+// The sender's counter deltas from its final report.
+std::vector<std::pair<string,int64_t>> counterDeltasFromReport(const std::map<string,string> &report)
+{
+    std::vector<std::pair<string,int64_t>> deltas;
+    for(const auto &field : report) {
+        if(0 == field.first.compare(0, 2, "c.")) {
+            deltas.push_back(std::make_pair(field.first.substr(2), atoll(field.second.c_str())));
+        }
+    }
+    return deltas;
+}
+
+// Log counter deltas a few to a line, under a heading naming whose they are,
+// and how many more the sender had to leave out of its report.
+void logCounterDeltas(const char *pszWhose, const std::vector<std::pair<string,int64_t>> &deltas,
+                      long nDropped = 0)
+{
+    if(deltas.empty() && nDropped <= 0) return;
+    logMsg("%s counters changed during the test:", pszWhose);
+    string line;
+    char buf[128];
+    for(size_t j=0; j<deltas.size(); j++) {
+        snprintf(buf, sizeof(buf), "%s%s %+lld", line.empty() ? "  " : "; ",
+                 deltas[j].first.c_str(), (long long) deltas[j].second);
+        line += buf;
+        if(line.length() > 90 || j+1 == deltas.size()) {
+            logMsg("%s", line.c_str());
+            line.clear();
+        }
+    }
+    if(nDropped > 0) {
+        logMsg("  and %ld more that didn't fit in the server's report; its log has them all", nDropped);
+    }
+}
+
+// Time each CPU has spent in user, system, hard and soft interrupt
+// context, from /proc/stat, and its NET_RX and NET_TX softirq counts from
+// /proc/softirqs.  Between two samples, they show whether one core is
+// saturated by softirq from a NIC queue while others idle, as happens
+// when receive-side scaling or RPS doesn't spread the load.  Linux only.
+struct CpuTimes {
+    struct Core {
+        bool     bOnline = false;
+        uint64_t user = 0, sys = 0, irq = 0, softirq = 0, idle = 0, total = 0;  // In ticks.
+        uint64_t netRx = 0, netTx = 0;
+    };
+    std::vector<Core> cores;
+
+    bool sample() {
+        cores.clear();
+#if defined(__linux__)
+        FILE *file = fopen("/proc/stat", "r");
+        if(NULL == file) return false;
+        char line[512];
+        while(fgets(line, sizeof(line), file)) {
+            unsigned cpu;
+            unsigned long long user, nice, sys, idle, iowait, irq, softirq, steal = 0;
+            if(sscanf(line, "cpu%u %llu %llu %llu %llu %llu %llu %llu %llu", &cpu, &user, &nice,
+                      &sys, &idle, &iowait, &irq, &softirq, &steal) < 8) {
+                continue;
+            }
+            if(cpu >= cores.size()) cores.resize(cpu + 1);
+            Core &core = cores[cpu];
+            core.bOnline = true;
+            core.user = user + nice;
+            core.sys = sys;
+            core.irq = irq;
+            core.softirq = softirq;
+            core.idle = idle + iowait;
+            core.total = core.user + sys + core.idle + irq + softirq + steal;
+        }
+        fclose(file);
+        file = fopen("/proc/softirqs", "r");
+        if(file) {
+            // A header of CPU names, then a row of counts per softirq.
+            // Lines grow with the number of CPUs, so getline sizes them.
+            char *prow = NULL;
+            size_t rowCap = 0;
+            std::vector<unsigned> columns;
+            if(getline(&prow, &rowCap, file) > 0) {
+                for(const string &field : splitFields(trimSpaces(prow), ' ')) {
+                    unsigned cpu;
+                    if(1 == sscanf(field.c_str(), "CPU%u", &cpu)) columns.push_back(cpu);
+                }
+            }
+            while(getline(&prow, &rowCap, file) > 0) {
+                std::vector<string> fields = splitFields(trimSpaces(prow), ' ');
+                fields.erase(std::remove(fields.begin(), fields.end(), string()), fields.end());
+                bool bRx = !fields.empty() && "NET_RX:" == fields[0];
+                bool bTx = !fields.empty() && "NET_TX:" == fields[0];
+                for(size_t j=1; (bRx || bTx) && j<fields.size() && j<=columns.size(); j++) {
+                    if(columns[j-1] >= cores.size()) continue;
+                    (bRx ? cores[columns[j-1]].netRx : cores[columns[j-1]].netTx) = strtoull(fields[j].c_str(), NULL, 10);
+                }
+            }
+            free(prow);
+            fclose(file);
+        }
+        return !cores.empty();
+#else
+        return false;
+#endif
+    }
+};
+
+// One core's load over an interval, in percent of its time.
+struct CoreLoad {
+    int      cpu = 0;
+    double   busyPct = 0, userPct = 0, sysPct = 0, irqPct = 0, softirqPct = 0;
+    uint64_t netRx = 0, netTx = 0;  // Softirqs raised.
+};
+
+// The nMax busiest cores between two samples, busiest first.
+std::vector<CoreLoad> busiestCores(const CpuTimes &before, const CpuTimes &after, size_t nMax)
+{
+    std::vector<CoreLoad> loads;
+    for(size_t cpu=0; cpu<std::min(before.cores.size(), after.cores.size()); cpu++) {
+        const CpuTimes::Core &b = before.cores[cpu], &a = after.cores[cpu];
+        if(!a.bOnline || !b.bOnline || a.total <= b.total) continue;
+        double total = (double) (a.total - b.total) / 100;
+        CoreLoad load;
+        load.cpu = (int) cpu;
+        load.userPct = (a.user - b.user) / total;
+        load.sysPct = (a.sys - b.sys) / total;
+        load.irqPct = (a.irq - b.irq) / total;
+        load.softirqPct = (a.softirq - b.softirq) / total;
+        load.busyPct = 100 - (a.idle - b.idle) / total;
+        load.netRx = a.netRx - b.netRx;
+        load.netTx = a.netTx - b.netTx;
+        loads.push_back(load);
+    }
+    std::stable_sort(loads.begin(), loads.end(),
+                     [](const CoreLoad &x, const CoreLoad &y) { return x.busyPct > y.busyPct; });
+    if(loads.size() > nMax) loads.resize(nMax);
+    return loads;
+}
+
+// E.g. "cpu3 98% (usr 5 sys 20 irq 0 si 73; NET_RX 51234)", separated
+// by "; " for several cores; bShort leaves out the breakdown.
+string describeCoreLoads(const std::vector<CoreLoad> &loads, bool bShort = false)
+{
+    string str;
+    char buf[128];
+    for(const CoreLoad &load : loads) {
+        if(bShort) {
+            snprintf(buf, sizeof(buf), "%scpu%d %.0f%% si %.0f%%", str.empty() ? "" : "; ",
+                     load.cpu, load.busyPct, load.softirqPct);
+        } else {
+            snprintf(buf, sizeof(buf), "%scpu%d %.0f%% (usr %.0f sys %.0f irq %.0f si %.0f; NET_RX %llu NET_TX %llu)",
+                     str.empty() ? "" : "; ", load.cpu, load.busyPct, load.userPct, load.sysPct,
+                     load.irqPct, load.softirqPct, (unsigned long long) load.netRx, (unsigned long long) load.netTx);
+        }
+        str += buf;
+    }
+    return str;
+}
+
+// SHA-256 (FIPS 180-4), just enough for HMAC authentication of clients
+// without depending on a crypto library.
+struct Sha256 {
+    uint32_t    h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    uint8_t     block[64];
+    size_t      nBlock = 0;
+    uint64_t    nTotal = 0;
+
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void compress() {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+        uint32_t w[64];
+        for(int j=0; j<16; j++) {
+            w[j] = (uint32_t) block[4*j] << 24 | (uint32_t) block[4*j+1] << 16 |
+                   (uint32_t) block[4*j+2] << 8 | block[4*j+3];
+        }
+        for(int j=16; j<64; j++) {
+            uint32_t s0 = rotr(w[j-15], 7) ^ rotr(w[j-15], 18) ^ (w[j-15] >> 3);
+            uint32_t s1 = rotr(w[j-2], 17) ^ rotr(w[j-2], 19) ^ (w[j-2] >> 10);
+            w[j] = w[j-16] + s0 + w[j-7] + s1;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for(int j=0; j<64; j++) {
+            uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[j] + w[j];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+        h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    }
+
+    void update(const void *pdata, size_t n) {
+        const uint8_t *p = (const uint8_t *) pdata;
+        nTotal += n;
+        while(n--) {
+            block[nBlock++] = *p++;
+            if(64 == nBlock) {
+                compress();
+                nBlock = 0;
+            }
+        }
+    }
+
+    void final(uint8_t digest[32]) {
+        uint64_t nBits = 8 * nTotal;
+        uint8_t pad = 0x80;
+        update(&pad, 1);
+        pad = 0;
+        while(56 != nBlock) update(&pad, 1);
+        for(int j=7; j>=0; j--) {
+            uint8_t byte = (uint8_t) (nBits >> (8*j));
+            update(&byte, 1);
+        }
+        for(int j=0; j<32; j++) digest[j] = (uint8_t) (h[j/4] >> (24 - 8*(j%4)));
+    }
+};
+
+// HMAC-SHA256 of msg under key (RFC 2104), as lowercase hex.
+string hmacSha256(const string &key, const string &msg)
+{
+    uint8_t keyBlock[64] = {0}, digest[32];
+    if(key.size() > sizeof(keyBlock)) {
+        Sha256 keyHash;
+        keyHash.update(key.data(), key.size());
+        keyHash.final(keyBlock);
+    } else {
+        memcpy(keyBlock, key.data(), key.size());
+    }
+    uint8_t pad[64];
+    Sha256 inner, outer;
+    for(int j=0; j<64; j++) pad[j] = keyBlock[j] ^ 0x36;
+    inner.update(pad, sizeof(pad));
+    inner.update(msg.data(), msg.size());
+    inner.final(digest);
+    for(int j=0; j<64; j++) pad[j] = keyBlock[j] ^ 0x5c;
+    outer.update(pad, sizeof(pad));
+    outer.update(digest, sizeof(digest));
+    outer.final(digest);
+    string hex;
+    char buf[3];
+    for(int j=0; j<32; j++) {
+        snprintf(buf, sizeof(buf), "%02x", digest[j]);
+        hex += buf;
+    }
+    return hex;
+}
+
+// Compare strings in time that depends only on their lengths, so a
+// client can't find a valid MAC a byte at a time.
+bool equalsConstantTime(const string &a, const string &b)
+{
+    if(a.size() != b.size()) return false;
+    unsigned char diff = 0;
+    for(size_t j=0; j<a.size(); j++) diff |= a[j] ^ b[j];
+    return 0 == diff;
+}
+
+// The command the client sends to the server to start a test:
+//   send|secs|bytesPerBuf|msg|name=value|...|\n
+// The name=value options are optional, so older clients still work.
+struct ClientCommand {
+    string  verb;
+    int     secs = 0;
+    int     bytesPerBuf = 0;
+    string  msg;
+    std::map<string,string> options;
+
+    string option(const string &name, const string &def="") const {
+        auto it = options.find(name);
+        return it == options.end() ? def : it->second;
+    }
+    int optionInt(const string &name, int def) const {
+        auto it = options.find(name);
+        return it == options.end() ? def : atoi(it->second.c_str());
+    }
+};
+
+bool parseClientCommand(const string &line, ClientCommand &cmd)
+{
+    string trimmed = line;
+    while(!trimmed.empty() && ('\n' == trimmed.back() || '\r' == trimmed.back())) {
+        trimmed.pop_back();
+    }
+    std::vector<string> fields = splitFields(trimmed, '|');
+    if(fields.size() < 3) {
+        return false;
+    }
+    cmd.verb = fields[0];
+    cmd.secs = atoi(fields[1].c_str());
+    cmd.bytesPerBuf = atoi(fields[2].c_str());
+    if(fields.size() > 3) {
+        cmd.msg = fields[3];
+    }
+    parseNameValues(fields, 4, cmd.options);
+    return true;
+}
+
+// Named test profiles from a config file, so that a standard test matrix
+// can be kept under version control instead of in shell scripts:
+//   # Comment
+//   [bulk4]
+//   secs = 30
+//   nbytes = 65536
+//   streams = 4
+//   rxts
+// Each line is a command-line option without its '-', applied where
+// -profile:name appears, so options after it override the profile's.
+typedef std::vector<std::pair<string,string>> ProfileOptions;
+
+struct TestProfiles {
+    std::map<string, ProfileOptions> byName;
+
+    // Read the profiles in path.  On error, returns false with a message
+    // naming the line.
+    bool read(const string &path, string &error) {
+        FILE *file = fopen(path.c_str(), "r");
+        if(NULL == file) {
+            error = "can't read " + path;
+            return false;
+        }
+        char buf[MAX_COMMAND_LEN];
+        string section;
+        bool bOK = true;
+        for(int lineNum=1; bOK && NULL != fgets(buf, sizeof(buf), file); lineNum++) {
+            string line = trimSpaces(buf);
+            if(line.empty() || '#' == line[0] || ';' == line[0]) continue;
+            if('[' == line[0]) {
+                if(']' != line.back() || line.size() < 3) {
+                    error = path + ":" + std::to_string(lineNum) + ": bad section name";
+                    bOK = false;
+                    break;
+                }
+                section = trimSpaces(line.substr(1, line.size() - 2));
+                byName[section];
+                continue;
+            }
+            if(section.empty()) {
+                error = path + ":" + std::to_string(lineNum) + ": option outside a [profile]";
+                bOK = false;
+                break;
+            }
+            size_t equals = line.find('=');
+            string name = trimSpaces(line.substr(0, equals));
+            string val = string::npos == equals ? "" : trimSpaces(line.substr(equals + 1));
+            if(!name.empty() && '-' == name[0]) name.erase(0, 1);
+            if(val.size() >= 2 && '"' == val[0] && '"' == val.back()) val = val.substr(1, val.size() - 2);
+            if("profile" == name || "profiles" == name || "mode" == name) {
+                error = path + ":" + std::to_string(lineNum) + ": " + name + " can't be set in a profile";
+                bOK = false;
+                break;
+            }
+            byName[section].push_back(std::make_pair(name, val));
+        }
+        fclose(file);
+        return bOK;
+    }
+
+    const ProfileOptions *find(const string &name) const {
+        auto it = byName.find(name);
+        return it == byName.end() ? NULL : &it->second;
+    }
+};
+
+// Profiles a server was started with; a client naming one of them gets
+// the server's copy of its sending options rather than its own.
+const TestProfiles *pserverProfiles = NULL;
+
+// Make cmd follow the sender's part of a profile: the test's length,
+// pacing and socket options.  The buffer size stays the client's, since
+// it reads report records in buffers of that size, and so does a list of
+// algorithms for a comparison, which the client sets one per stream.
+void applyProfileToCommand(const ProfileOptions &options, ClientCommand &cmd)
+{
+    for(const auto &opt : options) {
+        const string &name = opt.first;
+        if("secs" == name) {
+            cmd.secs = atoi(opt.second.c_str());
+        } else if("cc" == name && string::npos != opt.second.find(',')) {
+            // Per stream.
+        } else if("think" == name || "onoff" == name || "sndbuf" == name || "cc" == name ||
+                  "txts" == name || "ramp" == name || "rampstep" == name) {
+            cmd.options[name] = opt.second;
+        }
+    }
+}
+
+// Distribution of idle "think time" the sender inserts after each send,
+// to emulate an application-limited sender.  Specified as one of
+//   fixed:MS  uniform:LO-HI  exp:MEAN
+// where all values are in milliseconds.
+struct ThinkTime {
+    enum enum_kind {none, fixed, uniform, exponential} kind = none;
+    double  a = 0;
+    double  b = 0;
+};
+
+bool parseThinkTime(const string &spec, ThinkTime &think)
+{
+    think = ThinkTime();
+    if(spec.empty() || "none" == spec) return true;
+    size_t colon = spec.find(':');
+    if(string::npos == colon) return false;
+    string kind = spec.substr(0, colon);
+    string args = spec.substr(colon+1);
+    if("fixed" == kind) {
+        think.kind = ThinkTime::fixed;
+        think.a = atof(args.c_str());
+    } else if("uniform" == kind) {
+        size_t dash = args.find('-');
+        if(string::npos == dash) return false;
+        think.kind = ThinkTime::uniform;
+        think.a = atof(args.substr(0, dash).c_str());
+        think.b = atof(args.substr(dash+1).c_str());
+        if(think.b < think.a) return false;
+    } else if("exp" == kind) {
+        think.kind = ThinkTime::exponential;
+        think.a = atof(args.c_str());
+    } else {
+        return false;
+    }
+    return think.a >= 0;
+}
+
+// Return a think time in seconds drawn from the distribution.
+double sampleThinkTime(const ThinkTime &think, std::mt19937 &rng)
+{
+    double ms = 0;
+    switch(think.kind) {
+        case ThinkTime::fixed:
+            ms = think.a;
+            break;
+        case ThinkTime::uniform:
+            ms = std::uniform_real_distribution<double>(think.a, think.b)(rng);
+            break;
+        case ThinkTime::exponential:
+            if(think.a > 0) {
+                ms = std::exponential_distribution<double>(1.0/think.a)(rng);
+            }
+            break;
+        default:
+            break;
+    }
+    return ms / 1000.0;
+}
+
+// Parse an on/off pattern "onMs/offMs": send flat out for onMs, then
+// stay idle for offMs.
+bool parseOnOff(const string &spec, double &onSecs, double &offSecs)
+{
+    onSecs = offSecs = 0;
+    if(spec.empty()) return true;
+    size_t slash = spec.find('/');
+    if(string::npos == slash) return false;
+    onSecs = atof(spec.substr(0, slash).c_str()) / 1000.0;
+    offSecs = atof(spec.substr(slash+1).c_str()) / 1000.0;
+    return onSecs > 0 && offSecs >= 0;
+}
+
+// When the client asks for them (option reports=1), the sender
+// periodically sends a report record in place of one of its data buffers.
+// Because the client always reads exactly bytesPerBuf bytes at a time,
+// records stay aligned with its reads.  A record is REPORT_MAGIC followed
+// by |-separated name=value fields and a NUL; the rest of the buffer is
+// filler.  Data buffers are filled with printable characters, so they
+// can never be mistaken for a report.
+#define REPORT_MAGIC "\x01NTREPORT|"
+#define MIN_BYTES_FOR_REPORTS 256
+
+bool isReportRecord(const unsigned char *pbuf, size_t nbytes)
+{
+    const size_t lenMagic = sizeof(REPORT_MAGIC)-1;
+    return nbytes > lenMagic && 0 == memcmp(pbuf, REPORT_MAGIC, lenMagic);
+}
+
+// Build a report record in pbuf, which must hold a whole send buffer.
+void makeReportRecord(unsigned char *pbuf, size_t nbytes, const string &fields)
+{
+    string rec = REPORT_MAGIC + fields;
+    size_t ncopy = std::min(rec.length(), nbytes-1);
+    memcpy(pbuf, rec.c_str(), ncopy);
+    pbuf[ncopy] = '\0';
+}
+
+void parseReportRecord(const unsigned char *pbuf, size_t nbytes,
+                       std::map<string,string> &values)
+{
+    const size_t lenMagic = sizeof(REPORT_MAGIC)-1;
+    size_t len = strnlen((const char *)pbuf, nbytes);
+    string body((const char *)pbuf + lenMagic, len - lenMagic);
+    values.clear();
+    parseNameValues(splitFields(body, '|'), 0, values);
+}
+
+// Append a "name=value|" field to a report or command string.
+void addField(string &str, const char *name, const char *fmt, ...)
+{
+    char val[128];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(val, sizeof(val), fmt, args);
+    va_end(args);
+    str += name;
+    str += "=";
+    str += val;
+    str += "|";
+}
+
+// send() that asks the kernel for scheduler, driver and ACK transmit
+// timestamps on this write only; they're read back from the socket's error
+// queue by TxTimestamper.
+ssize_t sendWithTxTimestamps(int sock, unsigned char *buf, size_t nbytes, int flags)
+{
+#if defined(__linux__)
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg;
+    iov.iov_base = buf;
+    iov.iov_len = nbytes;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *pcmsg = CMSG_FIRSTHDR(&msg);
+    pcmsg->cmsg_level = SOL_SOCKET;
+    pcmsg->cmsg_type = SO_TIMESTAMPING;
+    pcmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    int tsflags = SOF_TIMESTAMPING_TX_SCHED | SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_TX_ACK;
+    memcpy(CMSG_DATA(pcmsg), &tsflags, sizeof(tsflags));
+    return sendmsg(sock, &msg, flags);
+#else
+    return send(sock, buf, nbytes, flags);
+#endif
+}
+
+// Send a buffer of bytes, making multiple calls to send if necessary
+// to send the entire buffer.  If bTxTimestamp, request transmit
+// timestamps for the data.  On a loop, the socket is non-blocking and
+// the task waits whenever the send buffer is full.
+Task<bool> sendAllAsync(IoLoop *ploop, int sock, unsigned char *buf, size_t nbytes, bool bTxTimestamp = false)
+{
+    bool bOK=true;
+    ssize_t totSent = 0;
+    size_t nBytesToSend = nbytes;
+    size_t offset = 0;
+    const int flags = 0;
+    do {
+        ssize_t bytes_sent = bTxTimestamp ?
+            sendWithTxTimestamps(sock, buf+offset, nBytesToSend, flags) :
+            send(sock, buf+offset, nBytesToSend, flags);
+        if(bytes_sent < 0 && ploop && isWouldBlock(errno)) {
+            co_await IoWait(ploop, sock, true);
+            continue;
+        }
+        if(bytes_sent < 0 && EINTR == errno) {
+            continue;
+        }
+        if(bytes_sent < 0) {
+            perror("Error sending");
+            bOK = false;
+            break;
+        }
+        //printf("sendAll sent %ld bytes\n", bytes_sent);
+        totSent += bytes_sent;
+        offset += bytes_sent;
+        nBytesToSend -= bytes_sent;
+    } while(totSent < nbytes);
+    co_await YieldIfDue(ploop);
+    co_return bOK;
+}
+
+bool sendAll(int sock, unsigned char *buf, size_t nbytes, bool bTxTimestamp = false)
+{
+    return runSync(sendAllAsync(NULL, sock, buf, nbytes, bTxTimestamp));
+}
+
+// Kernel receive timestamps for data read from a socket with
+// SO_TIMESTAMPING enabled, in seconds.  Software timestamps use the same
+// clock as getCurrentSeconds; hardware ones use the NIC's clock, so only
+// differences between them are meaningful.  Zero if not supplied.
+struct RecvTimestamp {
+    double  sw = 0;
+    double  hw = 0;
+};
+
+// Turn on software and, where the NIC supports it, hardware receive
+// timestamps for a TCP socket.  Returns false if the platform lacks them.
+bool enableTcpRecvTimestamping(int sock)
+{
+#if defined(__linux__)
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+                SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+    if(setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+        perror("setsockopt(,,SO_TIMESTAMPING)");
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+// recv() that also picks up any SO_TIMESTAMPING control message.
+ssize_t recvWithTimestamp(int sock, unsigned char *pbuf, size_t nbytes, RecvTimestamp *pts)
+{
+#if defined(__linux__)
+    char control[256];
+    struct iovec iov;
+    struct msghdr msg;
+    iov.iov_base = pbuf;
+    iov.iov_len = nbytes;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t nBytesRec = recvmsg(sock, &msg, 0);
+    if(nBytesRec <= 0) return nBytesRec;
+    for(struct cmsghdr *pcmsg = CMSG_FIRSTHDR(&msg); pcmsg; pcmsg = CMSG_NXTHDR(&msg, pcmsg)) {
+        if(SOL_SOCKET == pcmsg->cmsg_level && SCM_TIMESTAMPING == pcmsg->cmsg_type) {
+            struct scm_timestamping tss;
+            memcpy(&tss, CMSG_DATA(pcmsg), sizeof(tss));
+            if(tss.ts[0].tv_sec) pts->sw = tss.ts[0].tv_sec + 1e-9 * tss.ts[0].tv_nsec;
+            if(tss.ts[2].tv_sec) pts->hw = tss.ts[2].tv_sec + 1e-9 * tss.ts[2].tv_nsec;
+        }
+    }
+    return nBytesRec;
+#else
+    return recv(sock, pbuf, nbytes, 0);
+#endif
+}
+
+// Read from a TCP socket until the provided buffer is full, or we
+// see the connection close (or return an error).
+// Entry:   ploop   is the task's loop, or NULL to block.
+//          sock    is the socket to read from.
+//          nbytes  is the size of the buffer pbuf.
+//          pts     if not NULL, receives the kernel timestamps of the most
+//                  recently read data; left alone if none were supplied.
+// Exit:    Returns the number of bytes read, or -1 if error.
+//          pbuf    contains the bytes that were read.
+//          bEOF is true iff the connection closed.
+Task<ssize_t> recvAllAsync(IoLoop *ploop, int sock, unsigned char *pbuf, ssize_t nbytes, bool &bEOF,
+                           RecvTimestamp *pts = NULL)
+{
+    bEOF = false;
+    ssize_t bytesReadSoFar = 0;
+    int flags = 0;
+    // On a loop, try reading before waiting, since data is usually there.
+    bool bTryFirst = NULL != ploop;
+    do {
+        if(!bTryFirst && !co_await IoWait(ploop, sock, false, RECV_TIMEOUT_SECS)) {
+            puts("Timeout in select");
+            bytesReadSoFar = -1;
+            break;
+        }
+        // recv returns # of bytes returned, else 0 if connection was closed,
+        // else -1 if error.
+        ssize_t nbytesThisRead = pts ?
+            recvWithTimestamp(sock, bytesReadSoFar+pbuf, nbytes-bytesReadSoFar, pts) :
+            recv(sock, bytesReadSoFar+pbuf, nbytes-bytesReadSoFar, flags);
+        bTryFirst = false;
+        if(nbytesThisRead < 0 && ((ploop && isWouldBlock(errno)) || EINTR == errno)) {
+            continue;
+        } else if(nbytesThisRead < 0) {
+            perror("reading from socket");
+            break;
+        } else if(0==nbytesThisRead) {
+            bEOF = true;
+            break;
+        } else {
+            bytesReadSoFar += nbytesThisRead;
+        }
+    } while(bytesReadSoFar < nbytes);
+    //printf("recvAll returning %ld\n", bytesReadSoFar);
+    co_await YieldIfDue(ploop);
+    co_return bytesReadSoFar;
+}
+
+ssize_t recvAll(int sock, unsigned char *pbuf, ssize_t nbytes, bool &bEOF,
+                RecvTimestamp *pts = NULL)
+{
+    return runSync(recvAllAsync(NULL, sock, pbuf, nbytes, bEOF, pts));
+}
+
+// Measures how long sampled writes wait in the sender's socket buffer and
+// qdisc.  Each sampled sendAll asks for SCHED (entered the packet
+// scheduler), SND (handed to the driver) and ACK (acknowledged by the
+// peer) timestamps; the kernel returns them on the error queue tagged
+// with the byte offset of the write's last byte (SOF_TIMESTAMPING_OPT_ID),
+// which we match against the time the write was accepted by send().
+#define TXTS_MAX_PENDING 256
+enum TxStage {txSched, txSoftware, txAck, txStageCount};
+const char *txStageNames[txStageCount] = {"sched", "sw", "ack"};
+
+struct TxTimestamper {
+    struct Pending {
+        uint32_t    key;
+        double      timeWritten;
+    };
+    int         sock = -1;
+    uint64_t    bytesWritten = 0;   // Since timestamping was enabled.
+    Pending     pending[TXTS_MAX_PENDING];
+    size_t      nextPending = 0;
+    LatencyHistogram histoInterval[txStageCount];
+    LatencyHistogram histoTotal[txStageCount];
+
+    // Enable timestamp reporting on the socket.  Must be called before any
+    // data is sent, so that byte offsets start at zero.
+    bool enable(int sockToEnable) {
+#if defined(__linux__)
+        sock = sockToEnable;
+        // SOF_TIMESTAMPING_OPT_ID_TCP (Linux 6.2+) counts from the bytes
+        // written rather than acknowledged; older kernels reject it.
+        int flags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_ID |
+                    SOF_TIMESTAMPING_OPT_TSONLY | SOF_TIMESTAMPING_OPT_ID_TCP;
+        if(setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+            flags &= ~SOF_TIMESTAMPING_OPT_ID_TCP;
+            if(setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+                perror("setsockopt(,,SO_TIMESTAMPING)");
+                return false;
+            }
+        }
+        memset(pending, 0, sizeof(pending));
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // Account for a write of nbytes that send() accepted at timeWritten.
+    void onSend(size_t nbytes, bool bSampled, double timeWritten) {
+        bytesWritten += nbytes;
+        if(bSampled) {
+            Pending &p = pending[nextPending++ % TXTS_MAX_PENDING];
+            p.key = (uint32_t) (bytesWritten - 1);
+            p.timeWritten = timeWritten;
+            drain();
+        }
+    }
+
+    // Read all timestamps waiting on the error queue.
+    void drain() {
+#if defined(__linux__)
+        char control[512];
+        struct msghdr msg;
+        do {
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if(recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) break;
+            double stamp = 0;
+            struct sock_extended_err *perr = NULL;
+            for(struct cmsghdr *pcmsg = CMSG_FIRSTHDR(&msg); pcmsg; pcmsg = CMSG_NXTHDR(&msg, pcmsg)) {
+                if(SOL_SOCKET == pcmsg->cmsg_level && SCM_TIMESTAMPING == pcmsg->cmsg_type) {
+                    struct scm_timestamping tss;
+                    memcpy(&tss, CMSG_DATA(pcmsg), sizeof(tss));
+                    stamp = tss.ts[0].tv_sec + 1e-9 * tss.ts[0].tv_nsec;
+                } else if((IPPROTO_IP == pcmsg->cmsg_level && IP_RECVERR == pcmsg->cmsg_type) ||
+                          (IPPROTO_IPV6 == pcmsg->cmsg_level && IPV6_RECVERR == pcmsg->cmsg_type)) {
+                    perr = (struct sock_extended_err *) CMSG_DATA(pcmsg);
+                }
+            }
+            if(perr && stamp > 0 && SO_EE_ORIGIN_TIMESTAMPING == perr->ee_origin) {
+                record(perr->ee_info, perr->ee_data, stamp);
+            }
+        } while(true);
+#endif
+    }
+
+    void record(uint32_t tstampType, uint32_t key, double stamp) {
+#if defined(__linux__)
+        TxStage stage;
+        switch(tstampType) {
+            case SCM_TSTAMP_SCHED:  stage = txSched; break;
+            case SCM_TSTAMP_SND:    stage = txSoftware; break;
+            case SCM_TSTAMP_ACK:    stage = txAck; break;
+            default:                return;
+        }
+        for(size_t j=0; j<TXTS_MAX_PENDING; j++) {
+            if(pending[j].timeWritten > 0 && pending[j].key == key) {
+                double usecs = 1e6 * (stamp - pending[j].timeWritten);
+                histoInterval[stage].record(usecs);
+                histoTotal[stage].record(usecs);
+                if(txAck == stage) pending[j].timeWritten = 0;
+                break;
+            }
+        }
+#endif
+    }
+
+    // Describe the delays for each stage as "stage p50/p99/max us (n)".
+    static string describe(const LatencyHistogram *histos) {
+        string str;
+        char buf[120];
+        for(int stage=0; stage<txStageCount; stage++) {
+            snprintf(buf, sizeof(buf), "%s%s %.0f/%.0f/%.0f us (%zu)", stage ? "; " : "",
+                     txStageNames[stage], histos[stage].percentile(50), histos[stage].percentile(99),
+                     histos[stage].stats.max, histos[stage].count());
+            str += buf;
+        }
+        return str;
+    }
+};
+
+// Read a \n-terminated line, such as the command the client sends at the
+// start of a connection.  Returns false if the connection closed or
+// failed before a full line arrived, or if timeDeadline (monotonic
+// seconds) isn't 0 and passed first.
+Task<bool> readLineAsync(IoLoop *ploop, int socket_to_client, string &line, double timeDeadline = 0)
+{
+    char bufFromClient[MAX_COMMAND_LEN];
+    ssize_t nbytes;
+    ssize_t nBytesSoFar = 0;
+    ssize_t freeBytes = sizeof(bufFromClient)-1;
+    bool bGotLine = false;
+    
+    // Read the message from the client, which tells us what to do
+    // and what the parameters are.
+    do {
+        if(timeDeadline > 0) {
+            // Wait only as long as is left, so that recv doesn't block.
+            double secsLeft = timeDeadline - getMonotonicSeconds();
+            if(secsLeft <= 0 || !co_await IoWait(ploop, socket_to_client, false, secsLeft)) {
+                puts("Error: timed out waiting for a line from the other end");
+                break;
+            }
+        }
+        nbytes = recv(socket_to_client, nBytesSoFar+bufFromClient, freeBytes, 0);
+        if(nbytes < 0 && ploop && isWouldBlock(errno)) {
+            if(0 == timeDeadline) co_await IoWait(ploop, socket_to_client, false);
+        } else if(nbytes > 0) {
+            nBytesSoFar += nbytes;
+            freeBytes -= nbytes;
+            bufFromClient[nBytesSoFar] = '\0';
+            if(NULL != strchr(bufFromClient, '\n')) {
+                bGotLine = true;
+                break;
+            }
+        } else if(0==nbytes) {
+            puts("Error: unexpected early end of stream");
+            break;
+        } else {
+            perror("Error during initial msg from client");
+            break;
+        }
+    } while(nBytesSoFar < sizeof(bufFromClient)-1);
+    line = bufFromClient;
+    co_return bGotLine;
+}
+
+bool readLine(int sock, string &line)
+{
+    return runSync(readLineAsync(NULL, sock, line));
+}
+
+// Read /proc/sys/net/ipv4/tcp_slow_start_after_idle, which decides whether
+// an idle sender's congestion window is reset.  Returns -1 if unknown.
+int getSlowStartAfterIdle()
+{
+    int val = -1;
+#if defined(__linux__)
+    FILE *file = fopen("/proc/sys/net/ipv4/tcp_slow_start_after_idle", "r");
+    if(file) {
+        if(1 != fscanf(file, "%d", &val)) val = -1;
+        fclose(file);
+    }
+#endif
+    return val;
+}
+
+// Acknowledge the client's command with a ready byte (so it can time the
+// command's round trip), then echo back each of its one-byte RTT pings.
+Task<bool> answerPingsAsync(IoLoop *ploop, int socket_to_client, int pings)
+{
+    unsigned char ch = 'r';
+    if(!co_await sendAllAsync(ploop, socket_to_client, &ch, 1)) co_return false;
+    if(pings > 0) {
+        int option_value = 1;
+        setsockopt(socket_to_client, IPPROTO_TCP, TCP_NODELAY, &option_value, sizeof(option_value));
+    }
+    for(int j=0; j<pings; j++) {
+        bool bEOF;
+        if(1 != co_await recvAllAsync(ploop, socket_to_client, &ch, 1, bEOF)) co_return false;
+        if(!co_await sendAllAsync(ploop, socket_to_client, &ch, 1)) co_return false;
+    }
+    co_return true;
+}
+
+// Set the don't-fragment flag on a UDP socket's datagrams.  Returns false
+// if the platform can't.
+bool setDontFragment(int sock)
+{
+#if defined(IP_MTU_DISCOVER)
+    int val = IP_PMTUDISC_DO;
+    return 0 == setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val));
+#elif defined(IP_DONTFRAG)
+    int val = 1;
+    return 0 == setsockopt(sock, IPPROTO_IP, IP_DONTFRAG, &val, sizeof(val));
+#else
+    return false;
+#endif
+}
+
+// Header at the start of each packet in a capacity-estimation train.
+// All fields are in network byte order.
+#define TRAIN_MAGIC 0x4e545452      // "NTTR"
+struct TrainPacketHeader {
+    uint32_t    magic;
+    uint32_t    train;
+    uint32_t    seq;
+    uint32_t    trainLen;
+};
+
+// Send the packet trains a client asked for with the "train" command:
+// back-to-back UDP packets, to the client's address at the port it gave,
+// with a pause between trains so the load stays negligible.
+int sendPacketTrains(int socket_to_client, const ClientCommand &cmd)
+{
+    int pktSize = std::max((int) sizeof(TrainPacketHeader), cmd.bytesPerBuf);
+    int trains = cmd.optionInt("trains", DEFAULT_TRAINS);
+    int trainLen = cmd.optionInt("trainlen", DEFAULT_TRAIN_LEN);
+    struct sockaddr_in dest_addr;
+    socklen_t addr_len = sizeof(dest_addr);
+    if(getpeername(socket_to_client, (struct sockaddr *)&dest_addr, &addr_len) < 0) {
+        perror("getpeername");
+        return 1;
+    }
+    dest_addr.sin_port = htons(cmd.optionInt("udpport", 0));
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if(sock < 0) {
+        perror("Could not create UDP socket");
+        return 1;
+    }
+    // Path MTU probes ask for the don't-fragment flag, so a datagram too big
+    // for the path is dropped (or refused here) rather than fragmented.
+    bool bDontFragment = cmd.optionInt("df", 0) && setDontFragment(sock);
+    logMsg("Sending %d trains of %d packets of %d bytes to UDP port %d%s",
+           trains, trainLen, pktSize, ntohs(dest_addr.sin_port), bDontFragment ? " with DF set" : "");
+
+    std::unique_ptr<unsigned char[]> pbuf(new unsigned char[pktSize]);
+    memset(pbuf.get(), 'A', pktSize);
+    TrainPacketHeader hdr;
+    hdr.magic = htonl(TRAIN_MAGIC);
+    hdr.trainLen = htonl(trainLen);
+    int nErrors = 0, nTooBig = 0;
+    for(int train=0; train<trains; train++) {
+        hdr.train = htonl(train);
+        for(int seq=0; seq<trainLen; seq++) {
+            hdr.seq = htonl(seq);
+            memcpy(pbuf.get(), &hdr, sizeof(hdr));
+            if(sendto(sock, pbuf.get(), pktSize, 0, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) < 0) {
+                nErrors++;
+                if(EMSGSIZE == errno) nTooBig++;
+            }
+        }
+        sleepSeconds(TRAIN_GAP_MS / 1000.0);
+    }
+    if(bDontFragment) {
+        // Tell the prober what our kernel knows: datagrams it refused as
+        // bigger than the path MTU, which it learned from ICMP or the route.
+        int mtu = 0;
+        socklen_t len = sizeof(mtu);
+#if defined(IP_MTU)
+        if(0 != connect(sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) ||
+           0 != getsockopt(sock, IPPROTO_IP, IP_MTU, &mtu, &len)) {
+            mtu = 0;
+        }
+#endif
+        string reply = "trained|";
+        addField(reply, "sent", "%d", trains * trainLen - nErrors);
+        addField(reply, "toobig", "%d", nTooBig);
+        addField(reply, "mtu", "%d", mtu);
+        reply += "\n";
+        sendAll(socket_to_client, (unsigned char *) reply.c_str(), reply.length());
+    }
+    close(sock);
+    if(nErrors) {
+        logMsg("%d errors sending train packets (%d too big for the path)", nErrors, nTooBig);
+    }
+    return 0;
+}
+
+// Shared-memory transport: a lock-free single-producer/single-consumer
+// byte ring in a mapping shared by the server (producer) and client
+// (consumer) on the same host.  It moves the same bytes as the TCP path,
+// so comparing the two shows how much of a loopback result is the cost
+// of the TCP stack.  head and tail count bytes produced and consumed since
+// the start, and each is written by only one side.
+#define SHM_RING_MAGIC 0x4e545247      // "NTRG"
+#define SHM_RING_MIN_BYTES (4*1024*1024)
+#define SHM_RING_DATA_OFFSET 256
+#define SHM_TIMEOUT_SECS 5
+
+struct ShmRingHeader {
+    uint32_t    magic;
+    uint32_t    capacity;               // Power of two.
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) std::atomic<uint32_t> done;
+};
+static_assert(sizeof(ShmRingHeader) <= SHM_RING_DATA_OFFSET, "ring header too big");
+
+// Back off while waiting for the other side of the ring: spin briefly,
+// then yield the CPU.  Returns false once we've waited SHM_TIMEOUT_SECS
+// without progress.
+bool shmBackoff(unsigned &spins, double &timeWaitStart)
+{
+    if(++spins < 64) return true;
+    sched_yield();
+    if(0 == (spins & 1023)) {
+        double timeNow = getCurrentSeconds();
+        if(0 == timeWaitStart) {
+            timeWaitStart = timeNow;
+        } else if(timeNow - timeWaitStart > SHM_TIMEOUT_SECS) {
+            return false;
+        }
+    }
+    return true;
+}
+
+struct ShmRing {
+    ShmRingHeader  *phdr = NULL;
+    unsigned char  *pdata = NULL;
+    size_t          mapSize = 0;
+
+    bool isMapped() const { return NULL != phdr; }
+
+    // Map the ring in fd.  The creator sizes the file and initializes it.
+    bool map(int fd, uint32_t capacity, bool bCreate) {
+        mapSize = SHM_RING_DATA_OFFSET + (size_t) capacity;
+        if(bCreate && ftruncate(fd, mapSize) < 0) {
+            perror("ftruncate of shared-memory ring");
+            return false;
+        }
+        void *p = mmap(NULL, mapSize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        if(MAP_FAILED == p) {
+            perror("mmap of shared-memory ring");
+            return false;
+        }
+        phdr = (ShmRingHeader *) p;
+        pdata = (unsigned char *) p + SHM_RING_DATA_OFFSET;
+        if(bCreate) {
+            phdr->magic = SHM_RING_MAGIC;
+            phdr->capacity = capacity;
+            phdr->head.store(0);
+            phdr->tail.store(0);
+            phdr->done.store(0);
+        } else if(SHM_RING_MAGIC != phdr->magic || capacity != phdr->capacity) {
+            unmap();
+            return false;
+        }
+        return true;
+    }
+
+    void unmap() {
+        if(phdr) munmap(phdr, mapSize);
+        phdr = NULL;
+        pdata = NULL;
+    }
+
+    // Producer: copy nbytes into the ring, waiting for space as needed.
+    bool writeAll(const unsigned char *buf, size_t nbytes) {
+        const uint64_t mask = phdr->capacity - 1;
+        uint64_t head = phdr->head.load(std::memory_order_relaxed);
+        unsigned spins = 0;
+        double timeWaitStart = 0;
+        while(nbytes > 0) {
+            uint64_t space = phdr->capacity - (head - phdr->tail.load(std::memory_order_acquire));
+            if(0 == space) {
+                if(!shmBackoff(spins, timeWaitStart)) return false;
+                continue;
+            }
+            size_t n = (size_t) std::min<uint64_t>(space, nbytes);
+            size_t offset = (size_t) (head & mask);
+            size_t nFirst = std::min(n, (size_t) phdr->capacity - offset);
+            memcpy(pdata + offset, buf, nFirst);
+            memcpy(pdata, buf + nFirst, n - nFirst);
+            head += n;
+            buf += n;
+            nbytes -= n;
+            phdr->head.store(head, std::memory_order_release);
+            spins = 0;
+            timeWaitStart = 0;
+        }
+        return true;
+    }
+
+    // Producer: tell the consumer no more data is coming.
+    void finish() {
+        phdr->done.store(1, std::memory_order_release);
+    }
+
+    // Consumer: the ring's equivalent of recvAll.  Fills pbuf unless the
+    // producer finishes first; bEOF is set once the ring is finished and
+    // drained.  Returns -1 if the producer stops making progress.
+    ssize_t readAll(unsigned char *pbuf, size_t nbytes, bool &bEOF) {
+        const uint64_t mask = phdr->capacity - 1;
+        uint64_t tail = phdr->tail.load(std::memory_order_relaxed);
+        size_t bytesReadSoFar = 0;
+        unsigned spins = 0;
+        double timeWaitStart = 0;
+        bEOF = false;
+        while(bytesReadSoFar < nbytes) {
+            bool bDone = 0 != phdr->done.load(std::memory_order_acquire);
+            uint64_t avail = phdr->head.load(std::memory_order_acquire) - tail;
+            if(0 == avail) {
+                if(bDone) {
+                    bEOF = true;
+                    break;
+                }
+                if(!shmBackoff(spins, timeWaitStart)) return -1;
+                continue;
+            }
+            size_t n = (size_t) std::min<uint64_t>(avail, nbytes - bytesReadSoFar);
+            size_t offset = (size_t) (tail & mask);
+            size_t nFirst = std::min(n, (size_t) phdr->capacity - offset);
+            memcpy(pbuf + bytesReadSoFar, pdata + offset, nFirst);
+            memcpy(pbuf + bytesReadSoFar + nFirst, pdata, n - nFirst);
+            tail += n;
+            bytesReadSoFar += n;
+            phdr->tail.store(tail, std::memory_order_release);
+            spins = 0;
+            timeWaitStart = 0;
+        }
+        return (ssize_t) bytesReadSoFar;
+    }
+};
+
+// Send a data buffer over the connection, or into the shared-memory ring
+// if the test uses one.
+Task<bool> sendBufferAsync(IoLoop *ploop, int sock, ShmRing &ring, unsigned char *buf, size_t nbytes,
+                           bool bTxTimestamp = false)
+{
+    if(ring.isMapped()) co_return ring.writeAll(buf, nbytes);
+    co_return co_await sendAllAsync(ploop, sock, buf, nbytes, bTxTimestamp);
+}
+
+// Pass a file descriptor over a Unix-domain socket.
+bool sendFd(int sockUnix, int fd)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    unsigned char ch = 'f';
+    struct iovec iov;
+    struct msghdr msg;
+    iov.iov_base = &ch;
+    iov.iov_len = 1;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *pcmsg = CMSG_FIRSTHDR(&msg);
+    pcmsg->cmsg_level = SOL_SOCKET;
+    pcmsg->cmsg_type = SCM_RIGHTS;
+    pcmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(pcmsg), &fd, sizeof(fd));
+    return sendmsg(sockUnix, &msg, 0) == 1;
+}
+
+// Receive a file descriptor sent with sendFd.  Returns -1 on error.
+int recvFd(int sockUnix)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    unsigned char ch;
+    struct iovec iov;
+    struct msghdr msg;
+    iov.iov_base = &ch;
+    iov.iov_len = 1;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if(recvmsg(sockUnix, &msg, 0) != 1) return -1;
+    struct cmsghdr *pcmsg = CMSG_FIRSTHDR(&msg);
+    if(!pcmsg || SOL_SOCKET != pcmsg->cmsg_level || SCM_RIGHTS != pcmsg->cmsg_type) return -1;
+    int fd;
+    memcpy(&fd, CMSG_DATA(pcmsg), sizeof(fd));
+    return fd;
+}
+
+// The address of the other end of a connection, as text.
+string peerAddress(int sock)
+{
+    struct sockaddr_in addr;
+    socklen_t addrLen = sizeof(addr);
+    char buf[INET_ADDRSTRLEN] = "unknown";
+    if(0 == getpeername(sock, (struct sockaddr *)&addr, &addrLen)) {
+        inet_ntop(AF_INET, &addr.sin_addr, buf, sizeof(buf));
+    }
+    return buf;
+}
+
+// Server side of setting up the shared-memory transport.  Creates the ring
+// (a memfd on Linux, else a POSIX shared memory object), tells the client
+// over the TCP connection where to find it, and waits for the client to
+// say it has mapped the ring.  On Linux the memfd is handed over on a
+// short-lived Unix-domain socket, since it has no name.  The client must
+// connect from this host, and gets SHM_TIMEOUT_SECS for each step.
+bool offerShmRing(int socket_to_client, int bytesPerBuf, ShmRing &ring)
+{
+    struct sockaddr_in peer_addr, local_addr;
+    socklen_t peerLen = sizeof(peer_addr), localLen = sizeof(local_addr);
+    if(0 != getpeername(socket_to_client, (struct sockaddr *)&peer_addr, &peerLen) ||
+       0 != getsockname(socket_to_client, (struct sockaddr *)&local_addr, &localLen) ||
+       (127 != (ntohl(peer_addr.sin_addr.s_addr) >> 24) &&
+        peer_addr.sin_addr.s_addr != local_addr.sin_addr.s_addr)) {
+        logMsg("Refused shared-memory transport to %s, which isn't on this host",
+               peerAddress(socket_to_client).c_str());
+        return false;
+    }
+    uint32_t capacity = SHM_RING_MIN_BYTES;
+    while(capacity < 4 * (uint32_t) bytesPerBuf) capacity *= 2;
+    char name[108];
+    string reply;
+    bool bOK = false;
+#if defined(__linux__)
+    int fd = memfd_create("netthru-ring", MFD_CLOEXEC);
+    // The socket goes in a directory only we can use, so no one else can
+    // take its name first or connect to it.
+    char dir[] = "/tmp/netthru-XXXXXX";
+    bool bDir = NULL != mkdtemp(dir);
+    snprintf(name, sizeof(name), "%s/ring.sock", dir);
+    int sockUnix = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un unix_addr;
+    memset(&unix_addr, 0, sizeof(unix_addr));
+    unix_addr.sun_family = AF_UNIX;
+    safe_strcpy(unix_addr.sun_path, sizeof(unix_addr.sun_path), name);
+    if(fd < 0 || !bDir || sockUnix < 0 || bind(sockUnix, (struct sockaddr *)&unix_addr, sizeof(unix_addr)) < 0 ||
+       listen(sockUnix, 1) < 0) {
+        perror("Setting up shared-memory ring");
+    } else if(ring.map(fd, capacity, true)) {
+        reply = "shm|";
+        addField(reply, "size", "%u", capacity);
+        addField(reply, "unix", "%s", name);
+        reply += "\n";
+        if(sendAll(socket_to_client, (unsigned char *)reply.c_str(), reply.length())) {
+            int sockFd = waitForSocket(sockUnix, false, SHM_TIMEOUT_SECS) ? accept(sockUnix, NULL, NULL) : -1;
+            // The ring carries the test's data; hand it only to our own user.
+            struct ucred cred;
+            socklen_t credLen = sizeof(cred);
+            if(sockFd >= 0 && (0 != getsockopt(sockFd, SOL_SOCKET, SO_PEERCRED, &cred, &credLen) ||
+                               cred.uid != geteuid())) {
+                logMsg("Refused the shared-memory ring to a process of another user");
+                close(sockFd);
+                sockFd = -1;
+            }
+            bOK = sockFd >= 0 && sendFd(sockFd, fd);
+            if(sockFd >= 0) close(sockFd);
+        }
+    }
+    if(sockUnix >= 0) close(sockUnix);
+    if(bDir) {
+        unlink(name);
+        rmdir(dir);
+    }
+#else
+    static std::atomic<int> nRings(0);
+    snprintf(name, sizeof(name), "/netthru-%d-%d", (int) getpid(), nRings++);
+    int fd = shm_open(name, O_CREAT|O_EXCL|O_RDWR, 0600);
+    if(fd < 0) {
+        perror("shm_open");
+    } else if(ring.map(fd, capacity, true)) {
+        reply = "shm|";
+        addField(reply, "size", "%u", capacity);
+        addField(reply, "name", "%s", name);
+        reply += "\n";
+        bOK = sendAll(socket_to_client, (unsigned char *)reply.c_str(), reply.length());
+    }
+#endif
+    if(fd >= 0) close(fd);
+    // Wait for the client to map the ring before we start timing.
+    unsigned char ch = 0;
+    bool bEOF;
+    bOK = bOK && waitForSocket(socket_to_client, false, SHM_TIMEOUT_SECS) &&
+          1 == recvAll(socket_to_client, &ch, 1, bEOF) && 'a' == ch;
+#if !defined(__linux__)
+    if(fd >= 0) shm_unlink(name);
+#endif
+    if(!bOK && ring.isMapped()) ring.unmap();
+    return bOK;
+}
+
+// Client side: map the ring the server offered, then acknowledge.
+bool attachShmRing(int sock, ShmRing &ring)
+{
+    string line;
+    if(!readLine(sock, line) || 0 != line.compare(0, 4, "shm|")) {
+        logMsg("Server didn't offer a shared-memory ring; is it on this host?");
+        return false;
+    }
+    while(!line.empty() && '\n' == line.back()) line.pop_back();
+    std::map<string,string> values;
+    parseNameValues(splitFields(line, '|'), 1, values);
+    uint32_t capacity = (uint32_t) atol(values["size"].c_str());
+    int fd = -1;
+    if(!values["unix"].empty()) {
+        int sockUnix = socket(AF_UNIX, SOCK_STREAM, 0);
+        struct sockaddr_un unix_addr;
+        memset(&unix_addr, 0, sizeof(unix_addr));
+        unix_addr.sun_family = AF_UNIX;
+        safe_strcpy(unix_addr.sun_path, sizeof(unix_addr.sun_path), values["unix"].c_str());
+        if(sockUnix >= 0 && 0 == connect(sockUnix, (struct sockaddr *)&unix_addr, sizeof(unix_addr))) {
+            fd = recvFd(sockUnix);
+        }
+        if(sockUnix >= 0) close(sockUnix);
+    } else if(!values["name"].empty()) {
+        fd = shm_open(values["name"].c_str(), O_RDWR, 0600);
+    }
+    if(fd < 0) {
+        logMsg("Couldn't open the server's shared-memory ring");
+        return false;
+    }
+    bool bOK = ring.map(fd, capacity, false);
+    close(fd);
+    unsigned char ch = 'a';
+    bOK = bOK && sendAll(sock, &ch, 1);
+    if(bOK) {
+        logMsg("Using shared-memory ring of %u KB", capacity/1024);
+    }
+    return bOK;
+}
+
+// Samples the sender's TCP state every few milliseconds for the first part
+// of a connection, to show how fast it ramps up to line rate.  It runs on
+// its own thread so the cadence doesn't depend on how long sends block,
+// and fills an array sized up front, so sampling never allocates.
+struct RampSample {
+    uint32_t    cwndBytes;
+    float       rttMs;
+    uint32_t    retrans;
+};
+
+struct RampSampler {
+    int                 sock = -1;
+    double              stepSecs = 0;
+    std::vector<RampSample> samples;
+    std::atomic<size_t> nSamples;
+    std::atomic<bool>   bStop;
+    std::thread         thread;
+
+    RampSampler() : nSamples(0), bStop(false) {}
+
+    void start(int sockToSample, int rampMs, int stepMs) {
+        sock = sockToSample;
+        stepSecs = stepMs / 1000.0;
+        samples.resize(std::max(1, rampMs / stepMs));
+        thread = std::thread(&RampSampler::run, this);
+    }
+
+    void run() {
+        double timeStart = getMonotonicSeconds();
+        TcpStats tcpStats;
+        for(size_t j=0; j<samples.size() && !bStop.load(); j++) {
+            sleepSeconds(timeStart + (j+1)*stepSecs - getMonotonicSeconds());
+            getTcpStats(sock, tcpStats);
+            samples[j].cwndBytes = tcpStats.cwndBytes;
+            samples[j].rttMs = (float) tcpStats.rttMs;
+            samples[j].retrans = tcpStats.totalRetrans;
+            nSamples.store(j+1);
+        }
+    }
+
+    // Stop sampling and wait for the thread.
+    void stop() {
+        bStop.store(true);
+        if(thread.joinable()) thread.join();
+    }
+};
+
+// Send the ramp samples to the client as report records of type "ramp",
+// as many "cwnd,rttms,retrans;" triples per record as fit.
+Task<bool> sendRampRecords(IoLoop *ploop, int sock, ShmRing &ring, unsigned char *prepbuf, int bytesPerBuf,
+                           const RampSampler &sampler, size_t &totBytesSent)
+{
+    const size_t maxFieldLen = (size_t) bytesPerBuf - 64;
+    size_t nSamples = sampler.nSamples.load();
+    size_t j = 0;
+    while(j < nSamples) {
+        string fields, list;
+        addField(fields, "type", "ramp");
+        addField(fields, "first", "%zu", j);
+        addField(fields, "stepms", "%.3f", 1000 * sampler.stepSecs);
+        char buf[64];
+        for(; j < nSamples; j++) {
+            const RampSample &sample = sampler.samples[j];
+            snprintf(buf, sizeof(buf), "%u,%.3f,%u;", sample.cwndBytes, sample.rttMs, sample.retrans);
+            if(fields.length() + list.length() + strlen(buf) + 3 > maxFieldLen) break;
+            list += buf;
+        }
+        fields += "s=" + list + "|";
+        makeReportRecord(prepbuf, bytesPerBuf, fields);
+        if(!co_await sendBufferAsync(ploop, sock, ring, prepbuf, bytesPerBuf)) co_return false;
+        totBytesSent += bytesPerBuf;
+    }
+    co_return true;
+}
+
+// Counters for each pre-forked server worker.  They live in a shared
+// anonymous mapping that the master creates before forking, so the master
+// can total throughput across workers, and notice what a crashed worker
+// was doing, without any messages from them.  Each worker's counters get
+// their own cache line, since only that worker writes them.
+struct alignas(64) WorkerCounters {
+    std::atomic<int>        pid;
+    std::atomic<uint64_t>   connections;
+    std::atomic<uint64_t>   active;
+    std::atomic<uint64_t>   bytesSent;
+};
+
+struct ServerCounters {
+    WorkerCounters  workers[MAX_WORKERS];
+};
+
+// This process's counters when it's a pre-forked worker; otherwise NULL.
+WorkerCounters *pworkerCounters = NULL;
+
+// Add the bytes sent since the last call to this worker's counters.
+void countBytesSent(size_t totBytesSent, size_t &bytesCounted)
+{
+    if(pworkerCounters) {
+        pworkerCounters->bytesSent.fetch_add(totBytesSent - bytesCounted, std::memory_order_relaxed);
+    }
+    bytesCounted = totBytesSent;
+}
+
+// Agent mode: a server left running where others can reach it.  Clients
+// must answer a challenge with the shared key, and each test is held to
+// limits on its duration, on its client's rate across all its streams,
+// on the client's concurrent tests and on concurrent tests in all.  With
+// -workers, each worker process enforces the limits separately.
+struct AgentClient {
+    int     nActive = 0;
+    double  timeNextSend = 0;       // When the client's rate next allows a send.
+};
+
+struct AgentPolicy {
+    string      key;
+    int         maxSecs = DEFAULT_AGENT_MAX_SECS;
+    double      maxMbPerSec = 0;    // 0 for no limit.
+    int         maxStreams = DEFAULT_AGENT_MAX_STREAMS;
+    int         maxTests = DEFAULT_AGENT_MAX_TESTS;
+    std::mutex  mutex;
+    std::map<string, AgentClient> clients;      // By address, while they have tests running.
+    int         nActive = 0;
+    int         nPending = 0;       // Connections yet to authenticate and send a command.
+
+    // Count a connection that has yet to authenticate against maxTests,
+    // so that a flood of them can't tie the agent up.  Returns false if
+    // there's no room for it.
+    bool beginHandshake() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(nActive + nPending >= maxTests) return false;
+        nPending++;
+        return true;
+    }
+
+    void endHandshake() {
+        std::lock_guard<std::mutex> lock(mutex);
+        nPending--;
+    }
+
+    // Check what a command would cost beyond its secs, which the caller
+    // limits: the buffer it needs, and for packet trains, how long they'd
+    // take and the rate of their bursts.  Sets reason if it's too much.
+    bool allows(const ClientCommand &cmd, string &reason) const {
+        if(cmd.bytesPerBuf > AGENT_MAX_BYTES_PER_BUF) {
+            reason = "nbytes over the limit of " + std::to_string(AGENT_MAX_BYTES_PER_BUF);
+            return false;
+        }
+        if("train" != cmd.verb) return true;
+        int trains = cmd.optionInt("trains", DEFAULT_TRAINS);
+        int trainLen = cmd.optionInt("trainlen", DEFAULT_TRAIN_LEN);
+        // A train goes out back to back, then the next waits TRAIN_GAP_MS.
+        double burstMbPerSec = (double) trainLen * cmd.bytesPerBuf / (TRAIN_GAP_MS / 1000.0) / (1024*1024);
+        if(cmd.bytesPerBuf > MAX_UDP_PAYLOAD) {
+            reason = "packet size over the limit of " + std::to_string(MAX_UDP_PAYLOAD);
+        } else if(trainLen > AGENT_MAX_TRAIN_LEN) {
+            reason = "train length over the limit of " + std::to_string(AGENT_MAX_TRAIN_LEN);
+        } else if((double) trains * TRAIN_GAP_MS > maxSecs * 1000.0) {
+            reason = "trains would take longer than the limit of " + std::to_string(maxSecs) + " secs";
+        } else if(maxMbPerSec > 0 && burstMbPerSec > maxMbPerSec) {
+            char buf[128];
+            snprintf(buf, sizeof(buf), "trains would average %.1f MB/sec, over the limit of %.1f",
+                     burstMbPerSec, maxMbPerSec);
+            reason = buf;
+        } else {
+            return true;
+        }
+        return false;
+    }
+
+    // Count a new test from the client at addr, or set reason and return
+    // NULL if it's over a limit.
+    AgentClient *admit(const string &addr, string &reason) {
+        std::lock_guard<std::mutex> lock(mutex);
+        AgentClient &client = clients[addr];
+        if(nActive >= maxTests) {
+            reason = "server busy: " + std::to_string(maxTests) + " tests running";
+        } else if(client.nActive >= maxStreams) {
+            reason = "limit of " + std::to_string(maxStreams) + " concurrent tests per client";
+        } else {
+            nActive++;
+            client.nActive++;
+            return &client;
+        }
+        if(0 == client.nActive) clients.erase(addr);
+        return NULL;
+    }
+
+    void release(const string &addr) {
+        std::lock_guard<std::mutex> lock(mutex);
+        nActive--;
+        if(0 == --clients[addr].nActive) clients.erase(addr);
+    }
+
+    // Reserve nbytes of the client's rate, and return how long to wait
+    // before sending them, if at all.  Only AGENT_RATE_SLACK_SECS of unused
+    // rate is saved up: enough to make up for oversleeping.
+    double reserve(AgentClient *pclient, size_t nbytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        double timeNow = getMonotonicSeconds();
+        double timeSend = std::max(timeNow - AGENT_RATE_SLACK_SECS, pclient->timeNextSend);
+        pclient->timeNextSend = timeSend + nbytes / (maxMbPerSec * 1024 * 1024);
+        return timeSend - timeNow;
+    }
+};
+
+// The server's policy in agent mode; otherwise NULL.
+AgentPolicy *pagent = NULL;
+
+// A test's place among the agent's limits, given up when the test ends.
+struct AgentTicket {
+    string          addr;
+    AgentClient    *pclient = NULL;
+    bool            bPending = false;   // Counted by beginHandshake.
+
+    void endHandshake() {
+        if(bPending) pagent->endHandshake();
+        bPending = false;
+    }
+
+    ~AgentTicket() {
+        endHandshake();
+        if(pclient) pagent->release(addr);
+    }
+};
+
+// Challenge a client to prove it has the agent's key: send "auth|nonce|"
+// with a random nonce and expect "auth|mac|" back, mac being the nonce's
+// HMAC-SHA256 under the key.  Acknowledges success with 'a'.  The reply
+// must arrive by timeDeadline.
+Task<bool> authenticateClient(IoLoop *ploop, int sock, const string &key, double timeDeadline)
+{
+    std::random_device rd;
+    char buf[64];
+    snprintf(buf, sizeof(buf), "auth|%08x%08x%08x%08x|\n", rd(), rd(), rd(), rd());
+    string nonce(buf + 5, 32);
+    string line;
+    if(!co_await sendAllAsync(ploop, sock, (unsigned char *) buf, strlen(buf)) ||
+       !co_await readLineAsync(ploop, sock, line, timeDeadline)) {
+        co_return false;
+    }
+    std::vector<string> fields = splitFields(line, '|');
+    if(fields.size() < 2 || "auth" != fields[0] || !equalsConstantTime(fields[1], hmacSha256(key, nonce))) {
+        co_return false;
+    }
+    unsigned char ch = 'a';
+    co_return co_await sendAllAsync(ploop, sock, &ch, 1);
+}
+
+// The client's side of authenticateClient.
+Task<bool> answerChallengeAsync(IoLoop *ploop, int sock, const string &key)
+{
+    string line;
+    if(!co_await IoWait(ploop, sock, false, RECV_TIMEOUT_SECS) ||
+       !co_await readLineAsync(ploop, sock, line)) {
+        co_return false;
+    }
+    std::vector<string> fields = splitFields(line, '|');
+    if(fields.size() < 2 || "auth" != fields[0]) co_return false;
+    string reply = "auth|" + hmacSha256(key, fields[1]) + "|\n";
+    unsigned char ch;
+    bool bEOF;
+    co_return co_await sendAllAsync(ploop, sock, (unsigned char *) reply.c_str(), reply.length()) &&
+              co_await IoWait(ploop, sock, false, RECV_TIMEOUT_SECS) &&
+              1 == co_await recvAllAsync(ploop, sock, &ch, 1, bEOF) && 'a' == ch;
+}
+
+// Answer the requests of a latency probe connection: echo each
+// requestBytes request straight back, until the client closes, we're
+// stopped or, if secsMax isn't 0, for secsMax.
+Task<int> echoRequests(IoLoop *ploop, int socket_to_client, int requestBytes, int secsMax = 0)
+{
+    std::unique_ptr<unsigned char[]> pbuf(new unsigned char[requestBytes]);
+    int option_value = 1;
+    setsockopt(socket_to_client, IPPROTO_TCP, TCP_NODELAY, &option_value, sizeof(option_value));
+    size_t nRequests = 0;
+    bool bEOF = false;
+    double timeEnd = getMonotonicSeconds() + secsMax;
+    while(requestBytes == co_await recvAllAsync(ploop, socket_to_client, pbuf.get(), requestBytes, bEOF) &&
+          co_await sendAllAsync(ploop, socket_to_client, pbuf.get(), requestBytes)) {
+        nRequests++;
+        if((secsMax && getMonotonicSeconds() >= timeEnd) || stopRequested()) break;
+    }
+    // Connection probes only want the ready byte; don't log each one.
+    if(nRequests > 0) logMsg("Echoed %zu probe requests", nRequests);
+    co_return bEOF ? 0 : 1;
+}
+
+// Serve one test: read the client's command, then send.  ploop is the
+// loop the task runs on, or NULL to block.
+Task<int> handleServerConnection(IoLoop *ploop, int socket_to_client)
+{
+    int retval = 0;
+    string line;
+    ClientCommand cmd;
+    AgentTicket ticket;
+    
+    // The handshake and the command have RECV_TIMEOUT_SECS between them,
+    // so a client that connects and says nothing can't hold up the server.
+    double timeDeadline = getMonotonicSeconds() + RECV_TIMEOUT_SECS;
+    if(pagent) {
+        ticket.addr = peerAddress(socket_to_client);
+        if(!pagent->beginHandshake()) {
+            logMsg("Refused connection from %s: too many tests and handshakes in progress", ticket.addr.c_str());
+            close(socket_to_client);
+            co_return 1;
+        }
+        ticket.bPending = true;
+        if(!co_await authenticateClient(ploop, socket_to_client, pagent->key, timeDeadline)) {
+            logMsg("Client %s failed authentication", ticket.addr.c_str());
+            close(socket_to_client);
+            co_return 1;
+        }
+    }
+    if(!co_await readLineAsync(ploop, socket_to_client, line, timeDeadline) || !parseClientCommand(line, cmd)) {
+        logMsg("Invalid command from client");
+        close(socket_to_client);
+        co_return 1;
+    }
+    ticket.endHandshake();
+    string profile = cmd.option("profile");
+    if(!profile.empty() && pserverProfiles) {
+        const ProfileOptions *poptions = pserverProfiles->find(profile);
+        if(poptions) {
+            logMsg("Client runs profile %s", profile.c_str());
+            applyProfileToCommand(*poptions, cmd);
+        } else if(pagent) {
+            // A typo shouldn't quietly run some other test.  This doesn't
+            // confine clients to the profiles: those that name none run
+            // their own settings, within the agent's limits.
+            logMsg("Refused test with unknown profile %s", profile.c_str());
+            string refusal = "eunknown profile " + profile + "\n";
+            co_await sendAllAsync(ploop, socket_to_client, (unsigned char *) refusal.c_str(), refusal.length());
+            close(socket_to_client);
+            co_return 1;
+        } else {
+            logMsg("Client asks for profile %s, which isn't in ours; using the client's settings",
+                   profile.c_str());
+        }
+    }
+    if(pagent) {
+        // Tell a client that's over a limit why, in place of the ready byte.
+        string reason;
+        if(pagent->allows(cmd, reason)) ticket.pclient = pagent->admit(ticket.addr, reason);
+        if(!ticket.pclient) {
+            logMsg("Refused test from %s: %s", ticket.addr.c_str(), reason.c_str());
+            string refusal = "e" + reason + "\n";
+            co_await sendAllAsync(ploop, socket_to_client, (unsigned char *) refusal.c_str(), refusal.length());
+            close(socket_to_client);
+            co_return 1;
+        }
+        if(cmd.secs > pagent->maxSecs) {
+            logMsg("Limiting test from %s to %d of the %d secs asked for", ticket.addr.c_str(),
+                   pagent->maxSecs, cmd.secs);
+            cmd.secs = pagent->maxSecs;
+        }
+    }
+    int secsToSend = cmd.secs;
+    int bytesPerBuf = cmd.bytesPerBuf;
+    
+    logMsg("Client says send for %d secs; %d bytes per send; msg: %s",
+           secsToSend, bytesPerBuf, cmd.msg.c_str());
+    if(bytesPerBuf <= 0) {
+        close(socket_to_client);
+        co_return 1;
+    }
+    bool bShm = "shm" == cmd.option("transport");
+    if(ploop && ("train" == cmd.verb || bShm)) {
+        // These spin or need precise timing, so they get their own thread.
+        co_await MoveToOwnThread();
+        ploop = NULL;
+        setNonBlocking(socket_to_client, false);
+    }
+    if("train" == cmd.verb) {
+        retval = sendPacketTrains(socket_to_client, cmd);
+        close(socket_to_client);
+        co_return retval;
+    }
+    if("echo" == cmd.verb) {
+        if(co_await answerPingsAsync(ploop, socket_to_client, 0)) {
+            retval = co_await echoRequests(ploop, socket_to_client, bytesPerBuf, pagent ? pagent->maxSecs : 0);
+        }
+        close(socket_to_client);
+        co_return retval;
+    }
+
+    // Application-limited sending: think time after each send and/or
+    // an on/off pattern.
+    ThinkTime think;
+    double onSecs, offSecs;
+    if(!parseThinkTime(cmd.option("think"), think)) {
+        logMsg("Ignoring invalid think time: %s", cmd.option("think").c_str());
+        think = ThinkTime();
+    }
+    if(!parseOnOff(cmd.option("onoff"), onSecs, offSecs)) {
+        logMsg("Ignoring invalid on/off pattern: %s", cmd.option("onoff").c_str());
+        onSecs = offSecs = 0;
+    }
+    bool bAppLimited = ThinkTime::none != think.kind || onSecs > 0;
+    if(bAppLimited) {
+        logMsg("App-limited: think=%s onoff=%s; tcp_slow_start_after_idle=%d",
+               cmd.option("think", "none").c_str(), cmd.option("onoff", "none").c_str(),
+               getSlowStartAfterIdle());
+    }
+    bool bReports = cmd.optionInt("reports", 0) && bytesPerBuf >= MIN_BYTES_FOR_REPORTS;
+    std::mt19937 rng((unsigned) getCurrentSeconds());
+
+    // Send buffer size chosen by the client, e.g. from its BDP probe.
+    int sndbuf = cmd.optionInt("sndbuf", 0);
+    if(sndbuf > 0) {
+        logMsg("SO_SNDBUF %d requested; now %d", sndbuf,
+               setSocketBufferSize(socket_to_client, SO_SNDBUF, sndbuf));
+    }
+    // Transmit timestamps for every txtsEvery'th send.  They must be
+    // enabled before we send anything, including the ping replies.
+    int txtsEvery = bShm ? 0 : cmd.optionInt("txts", 0);
+    std::unique_ptr<TxTimestamper> ptxts;
+    if(txtsEvery > 0) {
+        ptxts.reset(new TxTimestamper);
+        if(ptxts->enable(socket_to_client)) {
+            logMsg("Sampling transmit timestamps every %d sends", txtsEvery);
+        } else {
+            logMsg("Transmit timestamps aren't available on this platform");
+            ptxts.reset();
+        }
+    }
+    string cc = cmd.option("cc");
+    if(!cc.empty() && !setCongestionControl(socket_to_client, cc)) {
+        logMsg("Couldn't use congestion control %s; using %s", cc.c_str(),
+               getCongestionControl(socket_to_client).c_str());
+    }
+    int pings = cmd.optionInt("pings", 0);
+    bool bAck = pings > 0 || cmd.optionInt("ack", 0);
+    if(bAck && !co_await answerPingsAsync(ploop, socket_to_client, pings)) {
+        logMsg("Error answering RTT pings");
+        close(socket_to_client);
+        co_return 1;
+    }
+    if(ptxts && bAck) {
+        // The ready byte and one reply per ping.
+        ptxts->onSend(1 + pings, false, 0);
+    }
+    ShmRing ring;
+    if(bShm && !offerShmRing(socket_to_client, bytesPerBuf, ring)) {
+        logMsg("Error setting up shared-memory transport");
+        close(socket_to_client);
+        co_return 1;
+    }
+
+    // This will auto-delete the array when it goes out of scope.
+    std::unique_ptr<unsigned char[]> pbuf(new unsigned char[bytesPerBuf]);
+    
+    // Fill the buffer with data.
+    unsigned char mybyte = (unsigned char) 'A';
+    for(int j=0; j<bytesPerBuf; j++) {
+        pbuf.get()[j] = mybyte;
+        mybyte++;
+        if(!isprint(mybyte)) mybyte = 'A';
+    }
+    // A second buffer, with the same filler, for report records.
+    std::unique_ptr<unsigned char[]> prepbuf(new unsigned char[bytesPerBuf]);
+    memcpy(prepbuf.get(), pbuf.get(), bytesPerBuf);
+    
+    // Ramp-up profile of the first rampMs of the connection.
+    // The samples are held until the end, so bound the profile by the
+    // test's length and MAX_RAMP_MS whatever the client asks for.
+    int rampMs = ring.isMapped() || !bReports ? 0 : cmd.optionInt("ramp", 0);
+    rampMs = std::min(rampMs, MAX_RAMP_MS);
+    if(rampMs > secsToSend * 1000.0) rampMs = secsToSend * 1000;
+    int rampStepMs = std::min(std::max(1, cmd.optionInt("rampstep", DEFAULT_RAMP_STEP_MS)), MAX_RAMP_STEP_MS);
+    RampSampler rampSampler;
+    if(rampMs > 0) {
+        rampSampler.start(socket_to_client, rampMs, rampStepMs);
+    }
+    
+    int mtu, mss;
+    if(getPathMtu(socket_to_client, mtu, mss)) {
+        logMsg("Path MTU %d; MSS %d; %d bytes per send is %.2f segments", mtu, mss, bytesPerBuf,
+               (double) bytesPerBuf / mss);
+    }
+    // Counters are snapshotted around the sending only, the closest we can
+    // get to the test; their changes go in the final report.
+    const bool bCounters = bReports && cmd.optionInt("counters", 0);
+    const string ifname = bCounters ? interfaceOf(socket_to_client) : "";
+    StackCounters countersStart, countersEnd;
+    if(bCounters) countersStart.snapshot(ifname);
+    const bool bCpuStat = bReports && cmd.optionInt("cpustat", 0);
+    CpuTimes cpuTimesStart, cpuTimesLast, cpuTimesNow;
+    if(bCpuStat) cpuTimesStart.sample();
+    cpuTimesLast = cpuTimesStart;
+
+    double timeStart = getCurrentSeconds();
+    double cpuStart = getCpuSeconds();
+    double timeLastUIUpdate = timeStart;
+    double timeOnStart = timeStart;
+    double secsSinceStart;
+    size_t totBytesSent = 0;
+    size_t bytesCounted = 0;
+    size_t nSends = 0;
+    size_t bytesSinceLastUIUpdate = 0;
+    double secsIdle = 0, secsIdleSinceLastUIUpdate = 0;
+    RunningStats statsRtt, statsCwnd;
+    TcpStats tcpStats;
+    // Who cut the test short, if anyone: the client sends ABORT_BYTE when
+    // it's interrupted, and a signal here stops it too.
+    const char *pszAborted = NULL;
+    double timeLastAbortCheck = timeStart;
+    do {
+        bool bSampled = ptxts && 0 == nSends % txtsEvery;
+        bool bOK = co_await sendBufferAsync(ploop, socket_to_client, ring, pbuf.get(), bytesPerBuf, bSampled);
+        if(!bOK) {
+            perror("Error sending buffer");
+            break;
+        }
+        totBytesSent += bytesPerBuf;
+        bytesSinceLastUIUpdate += bytesPerBuf;
+        nSends++;
+        if(ploop) ploop->countTransfer(bytesPerBuf);
+        if(ticket.pclient && pagent->maxMbPerSec > 0) {
+            // Hold the client to the agent's rate limit; the wait counts as idle.
+            double secsWait = pagent->reserve(ticket.pclient, bytesPerBuf);
+            if(secsWait > 0) {
+                co_await SleepFor(ploop, secsWait);
+                secsIdle += secsWait;
+                secsIdleSinceLastUIUpdate += secsWait;
+            }
+        }
+        double timeNow = getCurrentSeconds();
+        if(ptxts) {
+            ptxts->onSend(bytesPerBuf, bSampled, timeNow);
+        }
+        if(bAppLimited) {
+            double secsThink = sampleThinkTime(think, rng);
+            if(onSecs > 0 && timeNow - timeOnStart >= onSecs) {
+                secsThink += offSecs;
+            }
+            if(secsThink > 0) {
+                co_await SleepFor(ploop, secsThink);
+                double timeAfter = getCurrentSeconds();
+                secsIdle += timeAfter - timeNow;
+                secsIdleSinceLastUIUpdate += timeAfter - timeNow;
+                timeNow = timeAfter;
+                if(onSecs > 0 && timeNow - timeOnStart >= onSecs) {
+                    timeOnStart = timeNow;
+                }
+            }
+        }
+        double secsSinceLastUIUpdate = timeNow - timeLastUIUpdate;
+        if(secsSinceLastUIUpdate >= 1.0) {
+            if(getTcpStats(socket_to_client, tcpStats)) {
+                statsRtt.add(tcpStats.rttMs);
+                statsCwnd.add(tcpStats.cwndBytes);
+            }
+            double mbPerSec = bytesSinceLastUIUpdate / secsSinceLastUIUpdate / (1024.0*1024.0);
+            if(bAppLimited) {
+                logMsg("%9.3f MB/sec; idle %3.0f%%; rtt %.2f ms; cwnd %u KB; retrans %u",
+                       mbPerSec, 100.0*secsIdleSinceLastUIUpdate/secsSinceLastUIUpdate,
+                       tcpStats.rttMs, tcpStats.cwndBytes/1024, tcpStats.totalRetrans);
+            }
+            if(ptxts) {
+                ptxts->drain();
+                logMsg("Tx delay p50/p99/max: %s",
+                       TxTimestamper::describe(ptxts->histoInterval).c_str());
+            }
+            if(bReports) {
+                string fields;
+                addField(fields, "type", "interval");
+                addField(fields, "bytes", "%zu", bytesSinceLastUIUpdate);
+                addField(fields, "secs", "%.6f", secsSinceLastUIUpdate);
+                addField(fields, "idle", "%.6f", secsIdleSinceLastUIUpdate);
+                addField(fields, "rttms", "%.3f", tcpStats.rttMs);
+                addField(fields, "rttvarms", "%.3f", tcpStats.rttVarMs);
+                addField(fields, "cwnd", "%u", tcpStats.cwndBytes);
+                addField(fields, "retrans", "%u", tcpStats.totalRetrans);
+                if(!ploop) addField(fields, "cpusecs", "%.6f", getCpuSeconds() - cpuStart);
+                if(bCpuStat && cpuTimesNow.sample()) {
+                    addField(fields, "cores", "%s",
+                             describeCoreLoads(busiestCores(cpuTimesLast, cpuTimesNow, 1), true).c_str());
+                    cpuTimesLast = cpuTimesNow;
+                }
+                if(ptxts) {
+                    addField(fields, "txdelay", "%s",
+                             TxTimestamper::describe(ptxts->histoInterval).c_str());
+                }
+                makeReportRecord(prepbuf.get(), bytesPerBuf, fields);
+                if(!co_await sendBufferAsync(ploop, socket_to_client, ring, prepbuf.get(), bytesPerBuf)) {
+                    break;
+                }
+                totBytesSent += bytesPerBuf;
+                if(ptxts) {
+                    ptxts->onSend(bytesPerBuf, false, 0);
+                }
+            }
+            if(ptxts) {
+                for(int stage=0; stage<txStageCount; stage++) {
+                    ptxts->histoInterval[stage].reset();
+                }
+            }
+            countBytesSent(totBytesSent, bytesCounted);
+            timeLastUIUpdate = timeNow;
+            bytesSinceLastUIUpdate = 0;
+            secsIdleSinceLastUIUpdate = 0;
+        }
+        if(timeNow - timeLastAbortCheck >= ABORT_CHECK_SECS) {
+            timeLastAbortCheck = timeNow;
+            unsigned char ch;
+            if(stopRequested()) {
+                pszAborted = "server";
+            } else if(1 == recv(socket_to_client, &ch, 1, MSG_DONTWAIT) && ABORT_BYTE == ch) {
+                pszAborted = "client";
+            }
+            if(pszAborted) break;
+        }
+        secsSinceStart = timeNow - timeStart;
+        //printf("handleServerConnection: secsSinceStart=%7.2f secsToSend=%d\n",secsSinceStart, secsToSend);
+    } while(secsSinceStart < secsToSend);
+    
+    double timeEnd = getCurrentSeconds();
+    double secs = timeEnd - timeStart;
+    getTcpStats(socket_to_client, tcpStats);
+    std::vector<std::pair<string,int64_t>> counterDeltas;
+    if(bCounters) {
+        countersEnd.snapshot(ifname);
+        counterDeltas = countersEnd.deltasSince(countersStart);
+    }
+    std::vector<CoreLoad> coreLoads;
+    if(bCpuStat && cpuTimesNow.sample()) {
+        coreLoads = busiestCores(cpuTimesStart, cpuTimesNow, CPU_STAT_TOP);
+    }
+    if(rampMs > 0) {
+        rampSampler.stop();
+        co_await sendRampRecords(ploop, socket_to_client, ring, prepbuf.get(), bytesPerBuf, rampSampler, totBytesSent);
+    }
+    if(bReports) {
+        string fields;
+        addField(fields, "type", "final");
+        addField(fields, "bytes", "%zu", totBytesSent + bytesPerBuf);
+        addField(fields, "secs", "%.6f", secs);
+        addField(fields, "idle", "%.6f", secsIdle);
+        addField(fields, "rttmin", "%.3f", statsRtt.min);
+        addField(fields, "rttavg", "%.3f", statsRtt.avg());
+        addField(fields, "rttmax", "%.3f", statsRtt.max);
+        addField(fields, "cwndmin", "%.0f", statsCwnd.min);
+        addField(fields, "cwndavg", "%.0f", statsCwnd.avg());
+        addField(fields, "cwndmax", "%.0f", statsCwnd.max);
+        addField(fields, "retrans", "%u", tcpStats.totalRetrans);
+        addField(fields, "cc", "%s", getCongestionControl(socket_to_client).c_str());
+        addField(fields, "mss", "%u", tcpStats.mss);
+        if(pszAborted) addField(fields, "aborted", "%s", pszAborted);
+        if(!coreLoads.empty()) {
+            addField(fields, "cores", "%s", describeCoreLoads(
+                std::vector<CoreLoad>(coreLoads.begin(), coreLoads.begin() + 1), true).c_str());
+        }
+        if(bCounters) addField(fields, "ifname", "%s", ifname.c_str());
+        size_t nDeltasSent = 0;
+        for(const auto &delta : counterDeltas) {
+            // Leave room in the record for the fields below.
+            if(fields.length() + 256 > (size_t) bytesPerBuf) break;
+            addField(fields, ("c." + delta.first).c_str(), "%lld", (long long) delta.second);
+            nDeltasSent++;
+        }
+        if(nDeltasSent < counterDeltas.size()) {
+            addField(fields, "cdropped", "%zu", counterDeltas.size() - nDeltasSent);
+        }
+        if(!ploop) {
+            // On a loop, the thread's CPU time is shared with other tasks.
+            addField(fields, "cpusecs", "%.6f", getCpuSeconds() - cpuStart);
+        }
+        if(ptxts) {
+            ptxts->drain();
+            addField(fields, "txdelay", "%s", TxTimestamper::describe(ptxts->histoTotal).c_str());
+        }
+        makeReportRecord(prepbuf.get(), bytesPerBuf, fields);
+        if(co_await sendBufferAsync(ploop, socket_to_client, ring, prepbuf.get(), bytesPerBuf)) {
+            totBytesSent += bytesPerBuf;
+        }
+    }
+    
+    if(ring.isMapped()) {
+        ring.finish();
+        ring.unmap();
+    }
+    close(socket_to_client);
+    countBytesSent(totBytesSent, bytesCounted);
+    
+    double mbPerSec = totBytesSent / secs / (1024.0*1024.0);
+    if(pszAborted) {
+        logMsg("Test aborted by the %s after %.3f of %d secs", pszAborted, secs, secsToSend);
+    }
+    logMsg("Sent %ld bytes in %.3f secs for %.3f MB/sec (%.3f Mb/sec)", totBytesSent, secs, mbPerSec, 8*mbPerSec);
+    if(bAppLimited) {
+        logMsg("App-limited: idle %.1f%% of the time; rtt %.2f/%.2f/%.2f ms; cwnd %.0f/%.0f/%.0f KB (min/avg/max); retrans %u",
+               100.0*secsIdle/secs, statsRtt.min, statsRtt.avg(), statsRtt.max,
+               statsCwnd.min/1024, statsCwnd.avg()/1024, statsCwnd.max/1024, tcpStats.totalRetrans);
+    }
+    if(ptxts) {
+        logMsg("Tx delay p50/p99/max for whole test: %s",
+               TxTimestamper::describe(ptxts->histoTotal).c_str());
+    }
+    if(bCounters) {
+        logCounterDeltas(("Server" + (ifname.empty() ? string() : " (" + ifname + ")")).c_str(), counterDeltas);
+    }
+    if(!coreLoads.empty()) {
+        logMsg("Busiest cores: %s", describeCoreLoads(coreLoads).c_str());
+    }
+    
+    co_return retval;
+}
+
+// Serve one accepted connection, start to finish.
+Task<int> serveClient(IoLoop *ploop, int socket_to_client)
+{
+#ifdef SO_NOSIGPIPE
+    // Weirdly, macos seems to kill the app with SIGPIPE when a connection
+    // closes.  Prevent that from happening.
+    int option_value = 1; /* Set NOSIGPIPE to ON */
+    if (setsockopt (socket_to_client, SOL_SOCKET, SO_NOSIGPIPE, &option_value, sizeof (option_value)) < 0) {
+        perror ("setsockopt(,,SO_NOSIGPIPE)");
+    }
+#endif
+    
+    if(pworkerCounters) {
+        pworkerCounters->connections++;
+        pworkerCounters->active++;
+    }
+    int retval = co_await handleServerConnection(ploop, socket_to_client);
+    if(pworkerCounters) {
+        pworkerCounters->active--;
+    }
+    logMsg("Client connection closed.");
+    flushLogFile();
+    co_return retval;
+}
+
+// Accept connections on a loop, serving each as a task on the same loop.
+// The new tasks queue on the acceptor's worker, for idle workers to steal.
+Task<int> acceptOnLoop(IoLoop *ploop, int socket_listen)
+{
+    do {
+        // Time out now and then to notice a stop signal.
+        co_await IoWait(ploop, socket_listen, false, ABORT_CHECK_SECS);
+        if(stopRequested()) break;
+        do {
+            int socket_to_client = accept(socket_listen, NULL, NULL);
+            if(socket_to_client < 0) {
+                if(!isWouldBlock(errno)) perror("accept failed");
+                break;
+            }
+            logMsg("Accepted connection");
+            setNonBlocking(socket_to_client, true);
+            ploop->spawn(serveClient(ploop, socket_to_client));
+        } while(true);
+    } while(true);
+    co_return 0;
+}
+
+// Accept and serve connections until a stop signal: one at a time, or
+// with -concurrent, as tasks shared among that many event-loop workers.
+// Tests in progress finish early, with their partial results reported.
+void acceptConnections(int socket_listen, const Settings &settings)
+{
+    if(settings.concurrent > 0) {
+        // Pre-forked workers are already pinned, and their threads with them.
+        bool bPin = settings.pin && 0 == settings.workers;
+        logMsg("Serving connections on port %d with %d event-loop workers%s",
+               settings.port, settings.concurrent, bPin ? ", pinned" : "");
+        setNonBlocking(socket_listen, true);
+        IoLoop loop(settings.concurrent, bPin);
+        LoopReporter reporter;
+        reporter.start(&loop, WORKER_STATS_SECS);
+        loop.spawn(acceptOnLoop(&loop, socket_listen));
+        // The acceptor keeps the loop running until it's stopped.
+        loop.run(false);
+        reporter.stop();
+        logMsg("Stopped by signal %d", (int) stopSignal);
+        return;
+    }
+    struct sockaddr_in client_addr;
+    socklen_t addr_len = sizeof(client_addr);
+    do {
+        // Accept connection from an incoming client.
+        logMsg("Waiting to accept a connection on port %d", settings.port);
+        while(!stopRequested() && !waitForSocketOrStop(socket_listen, RECV_TIMEOUT_SECS)) {
+        }
+        if(stopRequested()) break;
+        int socket_to_client = accept(socket_listen, (struct sockaddr *)&client_addr, &addr_len);
+        if (socket_to_client < 0) {
+            perror("accept failed");
+        } else {
+            logMsg("Accepted connection");
+            runSync(serveClient(NULL, socket_to_client));
+        }
+    } while (!stopRequested());
+    logMsg("Stopped by signal %d", (int) stopSignal);
+}
+
+// Fork worker iWorker, which accepts connections on the master's listening
+// socket until it dies.  Returns the worker's pid in the master.
+pid_t spawnWorker(const Settings &settings, int socket_listen, ServerCounters *pcounters, int iWorker)
+{
+    // Don't let the worker inherit, and later repeat, unwritten output.
+    flushLogFile();
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid < 0) {
+        perror("fork failed");
+    } else if(0 == pid) {
+        installStopHandlers();
+        pworkerCounters = &pcounters->workers[iWorker];
+        pworkerCounters->pid = getpid();
+        pworkerCounters->active = 0;
+        if(settings.pin) {
+            int cpu = iWorker % std::max(1u, std::thread::hardware_concurrency());
+            if(pinToCpu(cpu)) {
+                logMsg("Worker %d (pid %d) pinned to CPU %d", iWorker, (int) getpid(), cpu);
+            } else {
+                logMsg("Worker %d couldn't be pinned to CPU %d", iWorker, cpu);
+            }
+        }
+        acceptConnections(socket_listen, settings);
+        flushLogFile();
+        _exit(0);
+    } else {
+        pcounters->workers[iWorker].pid = pid;
+    }
+    return pid;
+}
+
+// Master of the pre-forked server: start the workers, replace any that
+// die, and report total throughput from their shared counters.
+int runPreforkServer(const Settings &settings, int socket_listen)
+{
+    int nWorkers = std::min(settings.workers, MAX_WORKERS);
+    void *pmem = mmap(NULL, sizeof(ServerCounters), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(MAP_FAILED == pmem) {
+        perror("mmap failed");
+        return 1;
+    }
+    ServerCounters *pcounters = new(pmem) ServerCounters;
+    for(int j=0; j<nWorkers; j++) {
+        pcounters->workers[j].pid = 0;
+        pcounters->workers[j].connections = 0;
+        pcounters->workers[j].active = 0;
+        pcounters->workers[j].bytesSent = 0;
+    }
+    logMsg("Pre-forking %d workers on port %d", nWorkers, settings.port);
+    for(int j=0; j<nWorkers; j++) {
+        spawnWorker(settings, socket_listen, pcounters, j);
+    }
+    
+    uint64_t bytesLast = 0;
+    double timeLast = getMonotonicSeconds();
+    do {
+        sleepSeconds(1.0);
+        int status;
+        pid_t pid;
+        if(stopRequested()) {
+            // Pass the signal on, and let the workers finish their tests.
+            logMsg("Stopping %d workers", nWorkers);
+            for(int j=0; j<nWorkers; j++) {
+                if(pcounters->workers[j].pid > 0) kill(pcounters->workers[j].pid, SIGTERM);
+            }
+            while(waitpid(-1, &status, 0) > 0 || EINTR == errno) {
+            }
+            uint64_t connections = 0;
+            for(int j=0; j<nWorkers; j++) {
+                connections += pcounters->workers[j].connections;
+            }
+            logMsg("All workers stopped after serving %llu connections", (unsigned long long) connections);
+            break;
+        }
+        while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for(int j=0; j<nWorkers; j++) {
+                WorkerCounters &worker = pcounters->workers[j];
+                if(pid != worker.pid) continue;
+                if(WIFSIGNALED(status)) {
+                    logMsg("Worker %d (pid %d) killed by signal %d with %d connections open; restarting",
+                           j, (int) pid, WTERMSIG(status), (int) worker.active.load());
+                } else {
+                    logMsg("Worker %d (pid %d) exited with status %d; restarting",
+                           j, (int) pid, WEXITSTATUS(status));
+                }
+                worker.active = 0;
+                spawnWorker(settings, socket_listen, pcounters, j);
+            }
+        }
+        
+        uint64_t bytes = 0, connections = 0, active = 0;
+        for(int j=0; j<nWorkers; j++) {
+            bytes += pcounters->workers[j].bytesSent.load(std::memory_order_relaxed);
+            connections += pcounters->workers[j].connections.load(std::memory_order_relaxed);
+            active += pcounters->workers[j].active.load(std::memory_order_relaxed);
+        }
+        double timeNow = getMonotonicSeconds();
+        if(bytes != bytesLast) {
+            double mbPerSec = (bytes - bytesLast) / (timeNow - timeLast) / (1024.0*1024.0);
+            logMsg("All workers: %9.3f MB/sec (%.3f Mb/sec); %llu connections open, %llu served; %llu bytes sent",
+                   mbPerSec, 8*mbPerSec, (unsigned long long) active,
+                   (unsigned long long) connections, (unsigned long long) bytes);
+            flushLogFile();
+        }
+        bytesLast = bytes;
+        timeLast = timeNow;
+    } while(true);
+    
+    return 0;
+}
+
+int doServer(Settings settings)
+{
+    int socket_listen;
+    struct sockaddr_in server_addr;
+    
+    //Create socket
+    int protocol = 0;  // protocol is IP.
+    socket_listen = socket(AF_INET , SOCK_STREAM , protocol);
+    if (socket_listen == -1) {
+        printf("Could not create socket");
+    }
+    
+    //Prepare the sockaddr_in structure
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(settings.port);
+    
+    // Call bind to prepare to start listening.
+    if( bind(socket_listen,(struct sockaddr *)&server_addr , sizeof(server_addr)) < 0)
+    {
+        perror("bind failed.");
+        //return 1;
+    }
+    
+    // Listen on the socket. Do not allow a backlog, because since the purpose
+    // of this program is to measure total throughput, we do not want simultaneous
+    // connections.  The exceptions are -concurrent, for tests that deliberately
+    // run several streams against each other, and pre-forked workers.
+    int backlog = settings.concurrent || settings.workers > 0 ? SOMAXCONN : 0;
+    if(-1 == listen(socket_listen, backlog)) {
+        perror("Error listening");
+    }
+    
+    if(settings.agent) {
+        pagent = new AgentPolicy;
+        pagent->key = settings.key;
+        pagent->maxSecs = settings.maxSecs;
+        pagent->maxMbPerSec = settings.maxRate;
+        pagent->maxStreams = settings.maxStreams;
+        pagent->maxTests = settings.maxTests;
+        logMsg("Agent: authenticating clients; limits %d secs, %s per client, %d tests per client, %d in all",
+               settings.maxSecs, settings.maxRate > 0 ? (std::to_string(settings.maxRate) + " MB/sec").c_str() : "any rate",
+               settings.maxStreams, settings.maxTests);
+    }
+    if(!settings.profilesFile.empty()) {
+        TestProfiles *pprofiles = new TestProfiles;
+        string error;
+        if(!pprofiles->read(settings.profilesFile, error)) {
+            logMsg("Profiles: %s", error.c_str());
+            return 1;
+        }
+        pserverProfiles = pprofiles;
+        logMsg("Loaded %zu test profiles from %s", pprofiles->byName.size(), settings.profilesFile.c_str());
+    }
+    if(settings.workers > 0) {
+        return runPreforkServer(settings, socket_listen);
+    }
+    acceptConnections(socket_listen, settings);
+    return 0;
+}
+
+// Wait for the ready byte with which the server acknowledges our command
+// (the "ack" and "pings" command options), and return the time since the
+// command was sent at timeCommand.  If pfirstByte isn't NULL, a server
+// too old to know "ack" is tolerated: the first byte of its data ends the
+// wait instead, and is returned in *pfirstByte (else it's set to -1).
+Task<bool> waitForReadyAsync(IoLoop *ploop, int sock, double timeCommand, double &commandRttMs,
+                             int *pfirstByte = NULL)
+{
+    bool bEOF = false;
+    unsigned char ch;
+    bool bOK = 1 == co_await recvAllAsync(ploop, sock, &ch, 1, bEOF);
+    commandRttMs = 1000 * (getMonotonicSeconds() - timeCommand);
+    if(pfirstByte) *pfirstByte = -1;
+    if(bOK && 'e' == ch) {
+        // An agent refusing the test, with its reason.
+        string reason;
+        co_await readLineAsync(ploop, sock, reason);
+        while(!reason.empty() && '\n' == reason.back()) reason.pop_back();
+        logMsg("Server refused the test: %s", reason.c_str());
+        bOK = false;
+    } else if(bOK && pfirstByte && 'A' == ch) {
+        // The filler every buffer of data starts with.
+        logMsg("The server doesn't acknowledge commands, so it's an older version; "
+               "no command round trip");
+        *pfirstByte = ch;
+    } else if(bOK && 'r' != ch) {
+        logMsg("Unexpected reply from server%s", 'a' == ch ? "; it's an agent and needs -keyfile" : "");
+        bOK = false;
+    }
+    co_return bOK;
+}
+
+bool waitForReady(int sock, double timeCommand, double &commandRttMs)
+{
+    return runSync(waitForReadyAsync(NULL, sock, timeCommand, commandRttMs));
+}
+
+// Measure the RTT with one-byte pings that the server echoes.
+Task<bool> doPingsAsync(IoLoop *ploop, int sock, int pings, RunningStats &statsPing)
+{
+    bool bEOF = false;
+    unsigned char ch;
+    bool bOK = true;
+    int option_value = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &option_value, sizeof(option_value));
+    for(int j=0; bOK && j<pings; j++) {
+        double timePing = getCurrentSeconds();
+        ch = 'p';
+        bOK = co_await sendAllAsync(ploop, sock, &ch, 1) &&
+              1 == co_await recvAllAsync(ploop, sock, &ch, 1, bEOF);
+        statsPing.add(1000.0 * (getCurrentSeconds() - timePing));
+    }
+    co_return bOK;
+}
+
+bool doPings(int sock, int pings, RunningStats &statsPing)
+{
+    return runSync(doPingsAsync(NULL, sock, pings, statsPing));
+}
+
+// Where the time goes before steady-state transfer starts, in ms.
+// The command round trip ends when the server's ready byte arrives;
+// the first byte is the first byte of test data.  Both are measured from
+// when the command was sent.
+struct StartupTimes {
+    double  resolveMs = 0;
+    double  connectMs = 0;
+    double  commandRttMs = 0;
+    double  firstByteMs = 0;
+};
+
+// Outcome of one stream, for modes that run several and report them
+// together.
+struct StreamResult {
+    bool    bOK = false;
+    size_t  bytes = 0;
+    double  secs = 0;
+    double  mbPerSec = 0;
+    double  pingRttMs = 0;      // Idle RTT from the pings before the transfer.
+    int     bytesPerBuf = 0;    // As sent, after any -align...
+    int     mss = 0;            // ...by this MSS, from the client's socket.
+    StartupTimes startup;
+    std::map<string,string> finalReport;    // Sender's summary.
+    std::vector<double> senderRttMs;        // From each of the sender's interval reports.
+};
+
+// Binary results store: every client run is appended to a file of
+// fixed-size run records, each followed by its interval series, so months
+// of results can be queried without parsing the text log.  Records are in
+// the host's byte order.  Appends go through a mapping of the file's tail
+// and only count once the header's end offset covers them, so a crash
+// mid-append leaves the file readable; flock serializes concurrent clients.
+#define RESULTS_MAGIC 0x5352544e    // "NTRS"
+#define RESULTS_VERSION 2
+#define RESULTS_GROW_BYTES (1 << 20)
+
+struct ResultsHeader {
+    uint32_t    magic;
+    uint32_t    version;
+    uint64_t    endOffset;      // End of the last complete record.
+    uint64_t    nRuns;
+    uint8_t     reserved[40];
+};
+
+struct ResultRun {
+    uint32_t    recordBytes;    // This record and its interval series.
+    uint16_t    nIntervals;
+    uint8_t     bOK;
+    uint8_t     bShm;           // Shared-memory transport rather than TCP.
+    int64_t     startUs;        // Wall clock, microseconds since the epoch.
+    char        host[64];
+    char        cc[16];
+    char        msg[32];
+    int32_t     port;
+    int32_t     secs;
+    int32_t     bytesPerBuf;
+    int32_t     streams;
+    int32_t     sndbuf;
+    int32_t     rcvbuf;
+    uint64_t    bytes;
+    double      secsTot;
+    double      mbPerSec;
+    float       connectMs;
+    float       firstByteMs;
+    float       rttMinMs;       // From the sender's TCP_INFO; 0 if unknown.
+    float       rttAvgMs;
+    float       rttMaxMs;
+    uint32_t    retrans;
+    float       senderCpuPerGB;     // CPU seconds per GB moved; 0 if unknown.
+    float       receiverCpuPerGB;
+    uint8_t     bAborted;       // Stopped early by a signal; bOK is 0.
+    uint8_t     reserved[3];
+};
+
+static_assert(sizeof(ResultRun) % 8 == 0, "run records must stay 8-byte aligned");
+
+// One report interval (about a second) of a run.
+struct ResultInterval {
+    float       secs;           // Since the start of the transfer.
+    float       mbPerSec;
+    float       rttMs;
+    uint32_t    cwnd;
+};
+
+// A run record with the test's parameters filled in from settings.
+ResultRun makeResultRun(const Settings &settings, double timeStart)
+{
+    ResultRun run;
+    memset(&run, 0, sizeof(run));
+    run.startUs = (int64_t) (timeStart * 1e6);
+    safe_strcpy(run.host, sizeof(run.host), settings.remoteip.c_str());
+    safe_strcpy(run.cc, sizeof(run.cc), settings.cc.c_str());
+    safe_strcpy(run.msg, sizeof(run.msg), settings.msg.c_str());
+    run.bShm = "shm" == settings.transport;
+    run.port = settings.port;
+    run.secs = settings.secs;
+    run.bytesPerBuf = settings.bytes_per_buf;
+    run.streams = settings.streams;
+    run.sndbuf = settings.sndbuf;
+    run.rcvbuf = settings.rcvbuf;
+    return run;
+}
+
+// Append a run and its intervals to the results file at path, creating it
+// if need be.  Returns false on error.
+bool appendResult(const string &path, ResultRun run, const std::vector<ResultInterval> &intervals)
+{
+    size_t nIntervals = std::min<size_t>(intervals.size(), UINT16_MAX);
+    run.nIntervals = (uint16_t) nIntervals;
+    run.recordBytes = (uint32_t) (sizeof(run) + nIntervals * sizeof(ResultInterval));
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if(fd < 0) return false;
+    bool bOK = false;
+    struct stat st;
+    ResultsHeader *phdr = NULL;
+    flock(fd, LOCK_EX);
+    if(0 == fstat(fd, &st) && (st.st_size > 0 || 0 == ftruncate(fd, RESULTS_GROW_BYTES))) {
+        phdr = (ResultsHeader *) mmap(NULL, sizeof(ResultsHeader), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(MAP_FAILED == phdr) phdr = NULL;
+    }
+    if(phdr && 0 == phdr->magic) {
+        phdr->magic = RESULTS_MAGIC;
+        phdr->version = RESULTS_VERSION;
+        phdr->endOffset = sizeof(ResultsHeader);
+    }
+    if(phdr && RESULTS_MAGIC == phdr->magic && RESULTS_VERSION == phdr->version) {
+        uint64_t offset = phdr->endOffset;
+        uint64_t end = offset + run.recordBytes;
+        off_t fileSize = std::max<off_t>(st.st_size, RESULTS_GROW_BYTES);
+        if((off_t) end > fileSize) {
+            fileSize = (off_t) ((end + RESULTS_GROW_BYTES - 1) / RESULTS_GROW_BYTES * RESULTS_GROW_BYTES);
+        }
+        uint64_t pageStart = offset & ~((uint64_t) sysconf(_SC_PAGESIZE) - 1);
+        size_t len = (size_t) (end - pageStart);
+        unsigned char *pmap = NULL;
+        if(0 == ftruncate(fd, fileSize)) {
+            pmap = (unsigned char *) mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t) pageStart);
+        }
+        if(pmap && MAP_FAILED != pmap) {
+            unsigned char *pdest = pmap + (offset - pageStart);
+            memcpy(pdest, &run, sizeof(run));
+            if(nIntervals) memcpy(pdest + sizeof(run), intervals.data(), nIntervals * sizeof(ResultInterval));
+            munmap(pmap, len);
+            phdr->endOffset = end;
+            phdr->nRuns++;
+            bOK = true;
+        }
+    } else if(phdr) {
+        logMsg("%s isn't a netthru results file", path.c_str());
+    }
+    if(phdr) munmap(phdr, sizeof(ResultsHeader));
+    flock(fd, LOCK_UN);
+    close(fd);
+    return bOK;
+}
+
+// Reads a results file's run records in order through a read-only
+// mapping, so pages are only brought in as the scan reaches them.
+class ResultsReader {
+public:
+    ~ResultsReader() { if(pbase) munmap(pbase, size); }
+
+    bool open(const string &path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd < 0) return false;
+        struct stat st;
+        if(0 == fstat(fd, &st) && st.st_size >= (off_t) sizeof(ResultsHeader)) {
+            size = (size_t) st.st_size;
+            void *p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+            pbase = MAP_FAILED == p ? NULL : (unsigned char *) p;
+        }
+        close(fd);
+        if(!pbase) return false;
+        madvise(pbase, size, MADV_SEQUENTIAL);
+        const ResultsHeader *phdr = (const ResultsHeader *) pbase;
+        if(RESULTS_MAGIC != phdr->magic || RESULTS_VERSION != phdr->version) return false;
+        end = std::min<uint64_t>(phdr->endOffset, size);
+        offset = sizeof(ResultsHeader);
+        return true;
+    }
+    // The next run, or NULL at the end or at a damaged record.
+    const ResultRun *next() {
+        if(offset + sizeof(ResultRun) > end) return NULL;
+        const ResultRun *prun = (const ResultRun *) (pbase + offset);
+        if(prun->recordBytes != sizeof(ResultRun) + prun->nIntervals * sizeof(ResultInterval) ||
+           offset + prun->recordBytes > end) {
+            return NULL;
+        }
+        offset += prun->recordBytes;
+        return prun;
+    }
+    static const ResultInterval *intervals(const ResultRun *prun) {
+        return (const ResultInterval *) (prun + 1);
+    }
+
+private:
+    unsigned char  *pbase = NULL;
+    size_t          size = 0;
+    uint64_t        offset = 0;
+    uint64_t        end = 0;
+};
+
+// What the live view shows of one stream.  The stream's receive loop
+// stores each figure with a plain relaxed store and the view's thread
+// loads them; they're independent, so there's no need for a seqlock,
+// and the receive loop never waits for the view.
+struct alignas(64) StreamLive {
+    std::atomic<uint64_t>   bytes{0};
+    std::atomic<uint32_t>   rttUs{0};
+    std::atomic<uint32_t>   cwnd{0};
+    std::atomic<uint32_t>   retrans{0};
+    std::atomic<uint32_t>   senderCpuMs{0};     // Sender's CPU so far; 0 if unknown.
+    std::atomic<bool>       bDone{false};
+    std::atomic<bool>       bShown{false};      // The view has shown it finished.
+
+    // Receive loop only.
+    void addBytes(uint64_t n) {
+        bytes.store(bytes.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    void setReport(std::map<string,string> &report) {
+        rttUs.store((uint32_t) (1000 * atof(report["rttms"].c_str())), std::memory_order_relaxed);
+        cwnd.store((uint32_t) atol(report["cwnd"].c_str()), std::memory_order_relaxed);
+        retrans.store((uint32_t) atol(report["retrans"].c_str()), std::memory_order_relaxed);
+        senderCpuMs.store((uint32_t) (1000 * atof(report["cpusecs"].c_str())), std::memory_order_relaxed);
+    }
+    // Wait briefly for the view to draw its last frame, so that what's
+    // logged next doesn't land in the middle of it.
+    void finish() {
+        bDone.store(true, std::memory_order_release);
+        for(int j=0; j<100 && !bShown.load(std::memory_order_acquire); j++) sleepSeconds(0.01);
+    }
+};
+
+#define LIVE_HISTORY 40
+#define LIVE_MAX_ROWS 16
+
+// Live terminal view of running streams: a thread that once a second
+// redraws, in place with ANSI escapes (no curses), the total and each
+// stream's throughput with a sparkline of its recent history, its RTT,
+// cwnd, retransmits and the sender's CPU, and the client's CPU.  It
+// stops once every stream has finished.
+struct LiveView {
+    StreamLive         *pstreams = NULL;
+    size_t              nStreams = 0;
+    std::atomic<bool>   bStop;
+    std::thread         thread;
+
+    LiveView() : bStop(false) {}
+
+    void start(StreamLive *pstreamsToShow, size_t n) {
+        pstreams = pstreamsToShow;
+        nStreams = n;
+        thread = std::thread(&LiveView::run, this);
+    }
+
+    void stop() {
+        bStop = true;
+        if(thread.joinable()) thread.join();
+    }
+
+    // Bar characters, lowest first, of a sparkline of vals scaled to their maximum.
+    static string sparkline(const std::deque<double> &vals) {
+        static const char *bars[] = {"▁", "▂", "▃", "▄", "▅", "▆", "▇", "█"};
+        double maxVal = 0;
+        for(double val : vals) maxVal = std::max(maxVal, val);
+        string line;
+        for(double val : vals) {
+            line += bars[maxVal > 0 ? std::min(7, (int) (8 * val / maxVal)) : 0];
+        }
+        line.append(LIVE_HISTORY - vals.size(), ' ');
+        return line;
+    }
+
+    void run() {
+        std::vector<uint64_t> prevBytes(nStreams, 0);
+        std::vector<uint32_t> prevCpuMs(nStreams, 0);
+        std::vector<std::deque<double>> history(nStreams + 1);     // The last is the total.
+        double timeStart = getMonotonicSeconds(), timePrev = timeStart;
+        double cpuPrev = getCpuSeconds(true);
+        int nLinesDrawn = 0;
+        printf("\x1b[?25l");    // Hide the cursor while drawing.
+        bool bAllDone = false;
+        while(!bStop && !bAllDone) {
+            for(int j=0; j<100 && !bStop && getMonotonicSeconds() - timePrev < 1; j++) sleepSeconds(0.01);
+            double timeNow = getMonotonicSeconds(), cpuNow = getCpuSeconds(true);
+            double secs = std::max(1e-3, timeNow - timePrev);
+            double totRate = 0, totSenderCpu = 0;
+            bool bSenderCpu = false;
+            bAllDone = true;
+            string rows;
+            char buf[256];
+            for(size_t j=0; j<nStreams; j++) {
+                StreamLive &live = pstreams[j];
+                bool bDone = live.bDone.load(std::memory_order_acquire);
+                bAllDone = bAllDone && bDone;
+                uint64_t bytes = live.bytes.load(std::memory_order_relaxed);
+                uint32_t cpuMs = live.senderCpuMs.load(std::memory_order_relaxed);
+                double rate = (bytes - prevBytes[j]) / secs / (1024*1024);
+                double senderCpuPct = cpuMs ? (cpuMs - prevCpuMs[j]) / (10 * secs) : 0;
+                prevBytes[j] = bytes;
+                prevCpuMs[j] = cpuMs;
+                totRate += rate;
+                totSenderCpu += senderCpuPct;
+                bSenderCpu = bSenderCpu || cpuMs;
+                history[j].push_back(rate);
+                if(history[j].size() > LIVE_HISTORY) history[j].pop_front();
+                if(j >= LIVE_MAX_ROWS) continue;
+                char cpu[16] = "   -";
+                if(cpuMs) snprintf(cpu, sizeof(cpu), "%3.0f%%", senderCpuPct);
+                snprintf(buf, sizeof(buf), "\x1b[2K%3zu %10.3f %s %8.3f %8u %8u %s%s\n", j, rate,
+                         sparkline(history[j]).c_str(), live.rttUs.load(std::memory_order_relaxed) / 1000.0,
+                         live.cwnd.load(std::memory_order_relaxed) / 1024,
+                         live.retrans.load(std::memory_order_relaxed), cpu, bDone ? " done" : "");
+                rows += buf;
+            }
+            if(nStreams > LIVE_MAX_ROWS) {
+                snprintf(buf, sizeof(buf), "\x1b[2K    ... and %zu more streams\n", nStreams - LIVE_MAX_ROWS);
+                rows += buf;
+            }
+            history[nStreams].push_back(totRate);
+            if(history[nStreams].size() > LIVE_HISTORY) history[nStreams].pop_front();
+            char senderCpu[16] = "-";
+            if(bSenderCpu) snprintf(senderCpu, sizeof(senderCpu), "%.0f%%", totSenderCpu);
+            string frame;
+            if(nLinesDrawn) {
+                snprintf(buf, sizeof(buf), "\x1b[%dA", nLinesDrawn);    // Back to the top of the view.
+                frame = buf;
+            }
+            snprintf(buf, sizeof(buf), "\x1b[2K%6.1f s %10.3f MB/sec (%.3f Mb/sec) total; CPU client %.0f%% server %s\n",
+                     timeNow - timeStart, totRate, 8*totRate, 100 * (cpuNow - cpuPrev) / secs, senderCpu);
+            frame += buf;
+            snprintf(buf, sizeof(buf), "\x1b[2K%-10s %s\n", "", sparkline(history[nStreams]).c_str());
+            frame += buf;
+            snprintf(buf, sizeof(buf), "\x1b[2K%3s %10s %-*s %8s %8s %8s %s\n", "#", "MB/sec",
+                     LIVE_HISTORY, "history", "rtt ms", "cwnd KB", "retrans", "srv CPU");
+            frame += buf;
+            frame += rows;
+            fputs(frame.c_str(), stdout);
+            fflush(stdout);
+            nLinesDrawn = 3 + (int) std::min<size_t>(nStreams, LIVE_MAX_ROWS) + (nStreams > LIVE_MAX_ROWS);
+            timePrev = timeNow;
+            cpuPrev = cpuNow;
+        }
+        printf("\x1b[?25h");
+        fflush(stdout);
+        for(size_t j=0; j<nStreams; j++) {
+            pstreams[j].bShown.store(true, std::memory_order_release);
+        }
+    }
+};
+
+// Build the command line that asks the server to start sending.
+string buildClientCommand(const Settings &settings)
+{
+    char buf[MAX_COMMAND_LEN];
+    snprintf(buf, sizeof(buf), "send|%d|%d|%s|",
+        settings.secs, settings.bytes_per_buf, settings.msg.c_str());
+    string cmd = buf;
+    addField(cmd, "reports", "1");
+    addField(cmd, "ack", "1");
+    if(!settings.think.empty()) addField(cmd, "think", "%s", settings.think.c_str());
+    if(!settings.onoff.empty()) addField(cmd, "onoff", "%s", settings.onoff.c_str());
+    if(settings.sndbuf > 0) addField(cmd, "sndbuf", "%d", settings.sndbuf);
+    if(settings.txts > 0) addField(cmd, "txts", "%d", settings.txts);
+    if("tcp" != settings.transport) addField(cmd, "transport", "%s", settings.transport.c_str());
+    if(settings.pings > 0) addField(cmd, "pings", "%d", settings.pings);
+    if(!settings.cc.empty()) addField(cmd, "cc", "%s", settings.cc.c_str());
+    if(settings.rampMs > 0) {
+        addField(cmd, "ramp", "%d", settings.rampMs);
+        addField(cmd, "rampstep", "%d", settings.rampStepMs);
+    }
+    if(!settings.profile.empty()) addField(cmd, "profile", "%s", settings.profile.c_str());
+    if(settings.counters) addField(cmd, "counters", "1");
+    if(settings.cpustat) addField(cmd, "cpustat", "1");
+    cmd += "\n";
+    return cmd;
+}
+
+// Print the ramp-up profile: bytes the client received in each step since
+// the first byte arrived, next to the sender's cwnd and RTT sampled at
+// the same cadence since it started sending, and when the delivery rate
+// first reached 90% of the average for the whole test.
+void printRampProfile(const Settings &settings, const std::vector<uint64_t> &rampBytes,
+                      const std::vector<RampSample> &senderSamples, double mbPerSecAvg)
+{
+    const double stepSecs = settings.rampStepMs / 1000.0;
+    logMsg("Ramp-up profile, %d ms steps:", settings.rampStepMs);
+    logMsg("%8s %10s %12s %10s %9s %8s", "t ms", "KB", "Mb/sec", "cwnd KB", "rtt ms", "retrans");
+    double msReached = -1;
+    for(size_t j=0; j<rampBytes.size(); j++) {
+        double mbPerSec = rampBytes[j] / stepSecs / (1024.0*1024.0);
+        if(msReached < 0 && mbPerSec >= 0.9 * mbPerSecAvg) {
+            msReached = (j+1) * settings.rampStepMs;
+        }
+        if(j < senderSamples.size()) {
+            const RampSample &sample = senderSamples[j];
+            logMsg("%8d %10.1f %12.3f %10u %9.3f %8u", (int) (j+1) * settings.rampStepMs,
+                   rampBytes[j] / 1024.0, 8*mbPerSec, sample.cwndBytes/1024, sample.rttMs, sample.retrans);
+        } else {
+            logMsg("%8d %10.1f %12.3f", (int) (j+1) * settings.rampStepMs,
+                   rampBytes[j] / 1024.0, 8*mbPerSec);
+        }
+    }
+    if(msReached >= 0) {
+        logMsg("Reached 90%% of the average rate after %.0f ms", msReached);
+    } else {
+        logMsg("Didn't reach 90%% of the average rate within %d ms", settings.rampMs);
+    }
+}
+
+// Add the samples in a "ramp" report record to senderSamples.
+void parseRampRecord(std::map<string,string> &report, std::vector<RampSample> &senderSamples)
+{
+    size_t first = (size_t) atol(report["first"].c_str());
+    std::vector<string> triples = splitFields(report["s"], ';');
+    for(size_t j=0; j<triples.size(); j++) {
+        RampSample sample;
+        if(3 != sscanf(triples[j].c_str(), "%u,%f,%u", &sample.cwndBytes, &sample.rttMs, &sample.retrans)) {
+            continue;
+        }
+        if(senderSamples.size() < first + j + 1) senderSamples.resize(first + j + 1);
+        senderSamples[first + j] = sample;
+    }
+}
+
+// Run a test over a connected socket, on loop ploop or, if NULL, blocking.
+// If presult isn't NULL, the results are returned there rather than
+// printed, for callers running several streams at once.  pstartup, if
+// given, holds the resolve and connect times and gets the command round
+// trip and time to first byte.
+Task<int> handleClientConnection(IoLoop *ploop, int sock, Settings settings, StreamResult *presult = NULL,
+                                 StartupTimes *pstartup = NULL, StreamLive *plive = NULL)
+{
+    int retval = 0;
+    const bool bQuiet = NULL != presult;
+    int mtu, mss;
+    if(getPathMtu(sock, mtu, mss)) {
+        int bytesAligned = alignedBufferSize(settings.align, settings.bytes_per_buf, mss);
+        if(!bQuiet) {
+            logMsg("Path MTU %d; MSS %d; %d bytes per send is %.2f segments%s", mtu, mss, bytesAligned,
+                   (double) bytesAligned / mss, bytesAligned != settings.bytes_per_buf ? " (aligned)" : "");
+        }
+        settings.bytes_per_buf = bytesAligned;
+        if(presult) presult->mss = mss;
+    }
+    if(presult) presult->bytesPerBuf = settings.bytes_per_buf;
+    string cmd = buildClientCommand(settings);
+    ShmRing ring;
+    RunningStats statsPing;
+    StartupTimes startup;
+    if(pstartup) startup = *pstartup;
+    if(ploop && "shm" == settings.transport) {
+        // Reading the ring spins, so it needs a thread of its own.
+        co_await MoveToOwnThread();
+        ploop = NULL;
+        setNonBlocking(sock, false);
+    }
+    double timeCommand = getMonotonicSeconds();
+    // Without pings or shm, we can still test a server that predates the
+    // ready byte; the byte of data we read in its place starts the first buffer.
+    int firstByte = -1;
+    bool bOldServerOK = settings.pings <= 0 && "tcp" == settings.transport;
+    if(!co_await sendAllAsync(ploop, sock, (unsigned char *)cmd.c_str(), cmd.length())) {
+        retval = 3;
+    } else if(!co_await waitForReadyAsync(ploop, sock, timeCommand, startup.commandRttMs,
+                                          bOldServerOK ? &firstByte : NULL)) {
+        retval = 3;
+    } else if(settings.pings > 0 && !co_await doPingsAsync(ploop, sock, settings.pings, statsPing)) {
+        retval = 3;
+    } else if("shm" == settings.transport && !attachShmRing(sock, ring)) {
+        retval = 4;
+    } else {
+        // Command sent to server OK.
+        ssize_t nBytesRec = 0;
+        std::unique_ptr<unsigned char[]> pbuf(new unsigned char[settings.bytes_per_buf]);
+
+        ssize_t totBytesRec = 0;
+        ssize_t bytesRecSinceLastUIUpdate = 0;
+        const bool bCounters = settings.counters && !bQuiet;
+        const string ifname = bCounters ? interfaceOf(sock) : "";
+        StackCounters countersStart, countersEnd;
+        if(bCounters) countersStart.snapshot(ifname);
+        const bool bCpuStat = settings.cpustat && !bQuiet;
+        CpuTimes cpuTimesStart, cpuTimesLast, cpuTimesNow;
+        if(bCpuStat) cpuTimesStart.sample();
+        cpuTimesLast = cpuTimesStart;
+        double timeStart = getCurrentSeconds();
+        double cpuStart = getCpuSeconds();
+        double timeLastUIUpdate = timeStart;
+        ssize_t nCallsToTimer = 0;
+        bool bEOF;
+        // The most recent report from the sender, and its final summary.
+        std::map<string,string> lastReport, finalReport;
+        // With kernel receive timestamps, intervals are timed by when the
+        // data arrived rather than when we woke up to read it.
+        bool bRxTimestamps = settings.rxts && enableTcpRecvTimestamping(sock);
+        if(settings.rxts && !bRxTimestamps) {
+            logMsg("Kernel receive timestamps aren't available; using wakeup times");
+        }
+        RecvTimestamp rxts;
+        double hwFirst = 0;
+        LatencyHistogram histoWakeup;
+        // Bytes received in each step of the ramp-up profile, counted from
+        // the arrival of the first byte.
+        std::vector<uint64_t> rampBytes(settings.rampMs / std::max(1, settings.rampStepMs), 0);
+        std::vector<RampSample> senderRamp;
+        double timeFirstByte = 0;
+        std::vector<ResultInterval> intervals;
+        // When interrupted, we ask the sender to stop, then read on to its
+        // final report; if that doesn't come, we make do without it.
+        double timeAbort = 0;
+        bool bGaveUp = false;
+        size_t nPreread = 0;
+        if(firstByte >= 0) {
+            startup.firstByteMs = startup.commandRttMs;
+            startup.commandRttMs = 0;
+            pbuf.get()[0] = (unsigned char) firstByte;
+            nPreread = 1;
+        } else if(!ring.isMapped() && co_await IoWait(ploop, sock, false, RECV_TIMEOUT_SECS)) {
+            startup.firstByteMs = 1000 * (getMonotonicSeconds() - timeCommand);
+        }
+        do {
+            nBytesRec = ring.isMapped() ?
+                ring.readAll(pbuf.get(), settings.bytes_per_buf, bEOF) :
+                co_await recvAllAsync(ploop, sock, pbuf.get() + nPreread, settings.bytes_per_buf - nPreread, bEOF,
+                                      bRxTimestamps ? &rxts : NULL);
+            if(nPreread && nBytesRec >= 0) nBytesRec += nPreread;
+            nPreread = 0;
+            double timeNow = getCurrentSeconds();
+            nCallsToTimer++;
+            if(0 == startup.firstByteMs && nBytesRec > 0) {
+                startup.firstByteMs = 1000 * (getMonotonicSeconds() - timeCommand);
+            }
+            if(bRxTimestamps && rxts.sw > 0) {
+                if(nBytesRec > 0) histoWakeup.record(1e6 * (timeNow - rxts.sw));
+                if(0 == hwFirst) hwFirst = rxts.hw;
+                timeNow = rxts.sw;
+            }
+            if(nBytesRec >= 0 || bEOF) {
+                totBytesRec += nBytesRec;
+                bytesRecSinceLastUIUpdate += nBytesRec;
+                if(ploop) ploop->countTransfer(nBytesRec);
+                if(plive && nBytesRec > 0) plive->addBytes(nBytesRec);
+                if(!rampBytes.empty() && nBytesRec > 0) {
+                    if(0 == timeFirstByte) timeFirstByte = timeNow;
+                    size_t step = (size_t) ((timeNow - timeFirstByte) * 1000 / settings.rampStepMs);
+                    if(step < rampBytes.size()) rampBytes[step] += nBytesRec;
+                }
+                if(nBytesRec == settings.bytes_per_buf && isReportRecord(pbuf.get(), nBytesRec)) {
+                    std::map<string,string> report;
+                    parseReportRecord(pbuf.get(), nBytesRec, report);
+                    if("final" == report["type"]) {
+                        finalReport = report;
+                    } else if("ramp" == report["type"]) {
+                        parseRampRecord(report, senderRamp);
+                    } else {
+                        lastReport = report;
+                        if(presult) presult->senderRttMs.push_back(atof(report["rttms"].c_str()));
+                        if(plive) plive->setReport(report);
+                    }
+                }
+                double secsSinceLastUIUpdate = timeNow - timeLastUIUpdate;
+                if(nBytesRec > 0 && !bQuiet) {
+                    if(secsSinceLastUIUpdate >= 1.0) {
+                        timeLastUIUpdate = timeNow;
+                        double mbPerSec = (((double) bytesRecSinceLastUIUpdate) / ((double) secsSinceLastUIUpdate)) / (1024*1024);
+                        // Before the lookups below add empty fields to it.
+                        bool bHaveReport = !lastReport.empty();
+                        intervals.push_back({(float) (timeNow - timeStart), (float) mbPerSec,
+                                             (float) atof(lastReport["rttms"].c_str()),
+                                             (uint32_t) atol(lastReport["cwnd"].c_str())});
+                        // Weirdly, nothing prints on macos if I use "\r".
+                        // The sender's TCP details mean nothing for the shared-memory ring.
+                        if(plive) {
+                            // The live view shows it.
+                        } else if(!bHaveReport || ring.isMapped()) {
+                            printf("%9.3f MB/sec (%.3f Mb/sec)\n", mbPerSec, 8*mbPerSec);
+                        } else {
+                            double secsReport = atof(lastReport["secs"].c_str());
+                            double pctIdle = secsReport > 0 ? 100.0*atof(lastReport["idle"].c_str())/secsReport : 0;
+                            printf("%9.3f MB/sec (%.3f Mb/sec)  sender: rtt %s ms cwnd %ld KB retrans %s idle %.0f%%\n",
+                                   mbPerSec, 8*mbPerSec, lastReport["rttms"].c_str(),
+                                   atol(lastReport["cwnd"].c_str())/1024,
+                                   lastReport["retrans"].c_str(), pctIdle);
+                            if(!lastReport["txdelay"].empty()) {
+                                printf("          sender tx delay p50/p99/max: %s\n", lastReport["txdelay"].c_str());
+                            }
+                        }
+                        if(bCpuStat && !plive && cpuTimesNow.sample()) {
+                            printf("          busiest cores: %s\n",
+                                   describeCoreLoads(busiestCores(cpuTimesLast, cpuTimesNow, CPU_STAT_TOP)).c_str());
+                            if(!lastReport["cores"].empty()) {
+                                printf("          sender's busiest: %s\n", lastReport["cores"].c_str());
+                            }
+                            cpuTimesLast = cpuTimesNow;
+                        }
+                        bytesRecSinceLastUIUpdate = 0;
+                    }
+                }
+                if(stopRequested() && 0 == timeAbort) {
+                    timeAbort = getMonotonicSeconds();
+                    unsigned char ch = ABORT_BYTE;
+                    if(!bQuiet) logMsg("Interrupted; asking the server to stop");
+                    if(1 != send(sock, &ch, 1, MSG_DONTWAIT)) bGaveUp = true;
+                } else if(timeAbort > 0 && getMonotonicSeconds() - timeAbort > RECV_TIMEOUT_SECS) {
+                    if(!bQuiet) logMsg("The server didn't stop; giving up on its final report");
+                    bGaveUp = true;
+                }
+                if(bEOF || bGaveUp) {
+                    // Clean disconnect received, or we stopped; end of data.
+                    double secsTot = timeNow - timeStart;
+                    double mBytesPerSec = (((double) totBytesRec) / ((double) secsTot)) / (1024*1024);
+                    double mBitsPerSec = 8*mBytesPerSec;
+                    if(plive && !bQuiet) plive->finish();
+                    if(bQuiet) {
+                        presult->bOK = true;
+                        presult->bytes = totBytesRec;
+                        presult->secs = secsTot;
+                        presult->mbPerSec = mBytesPerSec;
+                        presult->pingRttMs = statsPing.min;
+                        presult->startup = startup;
+                        presult->finalReport = finalReport;
+                        break;
+                    }
+                    if(timeAbort > 0) {
+                        retval = 128 + stopSignal;
+                        logMsg("Test aborted after %.3f of %d secs; the results are partial", secsTot, settings.secs);
+                    } else if(!finalReport["aborted"].empty()) {
+                        logMsg("Test aborted by the %s after %.3f of %d secs; the results are partial",
+                               finalReport["aborted"].c_str(), secsTot, settings.secs);
+                    }
+                    logMsg("%8.3f MB/sec (%.3f Mb/sec) final average; %ld timer calls", mBytesPerSec, mBitsPerSec, nCallsToTimer);
+                    if("none" != settings.store) {
+                        ResultRun run = makeResultRun(settings, timeStart);
+                        run.bAborted = timeAbort > 0 || !finalReport["aborted"].empty();
+                        run.bOK = !run.bAborted;
+                        run.bytes = totBytesRec;
+                        run.secsTot = secsTot;
+                        run.mbPerSec = mBytesPerSec;
+                        run.connectMs = (float) startup.connectMs;
+                        run.firstByteMs = (float) startup.firstByteMs;
+                        run.rttMinMs = (float) atof(finalReport["rttmin"].c_str());
+                        run.rttAvgMs = (float) atof(finalReport["rttavg"].c_str());
+                        run.rttMaxMs = (float) atof(finalReport["rttmax"].c_str());
+                        run.retrans = (uint32_t) atol(finalReport["retrans"].c_str());
+                        double gb = totBytesRec / (1024.0*1024.0*1024.0);
+                        run.senderCpuPerGB = (float) (atof(finalReport["cpusecs"].c_str()) / gb);
+                        if(!ploop) run.receiverCpuPerGB = (float) ((getCpuSeconds() - cpuStart) / gb);
+                        if(!appendResult(settings.store, run, intervals)) {
+                            logMsg("Can't append to results file %s", settings.store.c_str());
+                        }
+                    }
+                    logMsg("Startup: resolve %.3f ms; connect %.3f ms; command round trip %.3f ms; first byte %.3f ms",
+                           startup.resolveMs, startup.connectMs, startup.commandRttMs, startup.firstByteMs);
+                    if(!rampBytes.empty()) {
+                        printRampProfile(settings, rampBytes, senderRamp, mBytesPerSec);
+                    }
+                    if(histoWakeup.count()) {
+                        logMsg("Wakeup latency after kernel arrival: avg %.1f us; p50 %.0f; p99 %.0f; max %.0f over %zu reads",
+                               histoWakeup.stats.avg(), histoWakeup.percentile(50),
+                               histoWakeup.percentile(99), histoWakeup.stats.max, histoWakeup.count());
+                    }
+                    if(hwFirst > 0 && rxts.hw > hwFirst) {
+                        double mbHw = totBytesRec / (rxts.hw - hwFirst) / (1024*1024);
+                        logMsg("%8.3f MB/sec (%.3f Mb/sec) by NIC hardware timestamps", mbHw, 8*mbHw);
+                    }
+                    if(!finalReport.empty() && !ring.isMapped()) {
+                        double secsSent = atof(finalReport["secs"].c_str());
+                        double pctIdle = secsSent > 0 ? 100.0*atof(finalReport["idle"].c_str())/secsSent : 0;
+                        logMsg("Sender: idle %.1f%%; rtt %s/%s/%s ms; cwnd %ld/%ld/%ld KB (min/avg/max); retrans %s",
+                               pctIdle, finalReport["rttmin"].c_str(), finalReport["rttavg"].c_str(),
+                               finalReport["rttmax"].c_str(), atol(finalReport["cwndmin"].c_str())/1024,
+                               atol(finalReport["cwndavg"].c_str())/1024, atol(finalReport["cwndmax"].c_str())/1024,
+                               finalReport["retrans"].c_str());
+                        if(!finalReport["txdelay"].empty()) {
+                            logMsg("Sender tx delay p50/p99/max: %s", finalReport["txdelay"].c_str());
+                        }
+                    }
+                    if(bCpuStat && cpuTimesNow.sample()) {
+                        logMsg("Busiest cores for the whole test: %s",
+                               describeCoreLoads(busiestCores(cpuTimesStart, cpuTimesNow, CPU_STAT_TOP)).c_str());
+                        if(!finalReport["cores"].empty()) {
+                            logMsg("Sender's busiest core: %s", finalReport["cores"].c_str());
+                        }
+                    }
+                    if(bCounters) {
+                        countersEnd.snapshot(ifname);
+                        logCounterDeltas(("Client" + (ifname.empty() ? string() : " (" + ifname + ")")).c_str(),
+                                         countersEnd.deltasSince(countersStart));
+                        string serverIf = finalReport["ifname"];
+                        logCounterDeltas(("Server" + (serverIf.empty() ? string() : " (" + serverIf + ")")).c_str(),
+                                         counterDeltasFromReport(finalReport), atol(finalReport["cdropped"].c_str()));
+                    }
+                    break;
+                }
+            } else {
+                perror("Unexpected error in connection to server");
+                break;
+            }
+        } while(true);
+    }
+    if(ring.isMapped()) {
+        ring.unmap();
+    }
+    
+    co_return retval;
+}
+
+// Resolve the server's address, which may be a host name, and port.
+// getaddrinfo blocks, so callers on a loop that connect repeatedly do
+// this once.
+bool resolveServer(const Settings &settings, struct sockaddr_in &server_addr)
+{
+    struct addrinfo hints, *paddrs = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(settings.remoteip.c_str(), NULL, &hints, &paddrs);
+    if(0 != err || NULL == paddrs) {
+        logMsg("Can't resolve %s: %s", settings.remoteip.c_str(), gai_strerror(err));
+        errno = EHOSTUNREACH;
+        return false;
+    }
+    memcpy(&server_addr, paddrs->ai_addr, sizeof(server_addr));
+    freeaddrinfo(paddrs);
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(settings.port);
+    return true;
+}
+
+// Create a socket and connect it to the server, resolving its address
+// unless presolved gives it.  SO_RCVBUF is set before connecting, since
+// the window scale is negotiated during the handshake.  If ptimes isn't
+// NULL, it gets the time taken by address resolution and by the TCP
+// handshake.  On a loop, the socket is non-blocking and the task waits for
+// the handshake.  bQuiet skips logging, for callers that connect many
+// times a second.  Returns the socket, or -1 on error.
+Task<int> connectToServerAsync(IoLoop *ploop, Settings settings, StartupTimes *ptimes = NULL,
+                               bool bQuiet = false, const struct sockaddr_in *presolved = NULL)
+{
+    int sock;
+    int err;
+    struct sockaddr_in server_addr;
+    
+    double timeResolve = getMonotonicSeconds();
+    if(presolved) {
+        server_addr = *presolved;
+    } else if(!resolveServer(settings, server_addr)) {
+        co_return -1;
+    }
+    double timeConnect = getMonotonicSeconds();
+    
+    //Create socket
+    int protocol = 0;  // protocol is IP.
+    sock = socket(AF_INET, SOCK_STREAM, protocol);
+    if (sock == -1)
+    {
+        printf("Could not create socket");
+        co_return -1;
+    }
+    if(settings.rcvbuf > 0) {
+        setSocketBufferSize(sock, SO_RCVBUF, settings.rcvbuf);
+    }
+    if(settings.mss > 0 && setsockopt(sock, IPPROTO_TCP, TCP_MAXSEG, &settings.mss, sizeof(settings.mss)) < 0) {
+        // Like SO_RCVBUF, the MSS we advertise is fixed by the handshake.
+        perror("setsockopt(TCP_MAXSEG)");
+    }
+    if(ploop) {
+        setNonBlocking(sock, true);
+    }
+
+    // Connect to remote server
+    if(!bQuiet) logMsg("Connecting to %s port %d", settings.remoteip.c_str(), settings.port);
+    int retConnect = connect(sock , (struct sockaddr *)&server_addr , sizeof(server_addr));
+    if(retConnect < 0 && ploop && EINPROGRESS == errno) {
+        socklen_t errLen = sizeof(err);
+        if(!co_await IoWait(ploop, sock, true, RECV_TIMEOUT_SECS)) {
+            err = ETIMEDOUT;
+        } else {
+            getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &errLen);
+        }
+        errno = err;
+        retConnect = 0 == err ? 0 : -1;
+    }
+    if (retConnect < 0)
+    {
+        perror("connect failed. Error");
+        close(sock);
+        co_return -1;
+    }
+    double timeConnected = getMonotonicSeconds();
+    if(ptimes) {
+        ptimes->resolveMs = 1000 * (timeConnect - timeResolve);
+        ptimes->connectMs = 1000 * (timeConnected - timeConnect);
+    }
+    if(!bQuiet) logMsg("Connected to  %s port %d", settings.remoteip.c_str(), settings.port);
+    if(!settings.key.empty() && !co_await answerChallengeAsync(ploop, sock, settings.key)) {
+        logMsg("Authentication with %s failed", settings.remoteip.c_str());
+        close(sock);
+        errno = EACCES;
+        co_return -1;
+    }
+    co_return sock;
+}
+
+int connectToServer(const Settings &settings, StartupTimes *ptimes = NULL)
+{
+    return runSync(connectToServerAsync(NULL, settings, ptimes));
+}
+
+// Results of the bandwidth-delay-product probe.
+struct BdpProbe {
+    double  rttMs = 0;          // Minimum RTT seen by pings or the sender.
+    double  mbPerSec = 0;       // Bottleneck bandwidth: best 100 ms window.
+    double  bdpBytes = 0;
+};
+
+// Measure the path's RTT with a few one-byte pings over a data connection,
+// then its bottleneck bandwidth with a short bulk transfer.
+bool runBdpProbe(const Settings &settings, BdpProbe &probe)
+{
+    int sock = connectToServer(settings);
+    if(sock < 0) return false;
+
+    char buf[MAX_COMMAND_LEN];
+    snprintf(buf, sizeof(buf), "send|%d|%d|BDP probe|reports=1|pings=%d|\n",
+             PROBE_SECS, PROBE_BYTES_PER_BUF, PROBE_PINGS);
+    double timeCommand = getMonotonicSeconds(), commandRttMs;
+    bool bOK = sendAll(sock, (unsigned char *)buf, strlen(buf));
+    bool bEOF = false;
+    RunningStats statsPing;
+    bOK = bOK && waitForReady(sock, timeCommand, commandRttMs) &&
+          doPings(sock, PROBE_PINGS, statsPing);
+
+    std::unique_ptr<unsigned char[]> pbuf(new unsigned char[PROBE_BYTES_PER_BUF]);
+    double timeWindowStart = getCurrentSeconds();
+    size_t bytesInWindow = 0;
+    std::map<string,string> finalReport;
+    while(bOK && !bEOF) {
+        ssize_t nBytesRec = recvAll(sock, pbuf.get(), PROBE_BYTES_PER_BUF, bEOF);
+        if(nBytesRec < 0) {
+            bOK = false;
+            break;
+        }
+        if(PROBE_BYTES_PER_BUF == nBytesRec && isReportRecord(pbuf.get(), nBytesRec)) {
+            std::map<string,string> report;
+            parseReportRecord(pbuf.get(), nBytesRec, report);
+            if("final" == report["type"]) finalReport = report;
+        }
+        bytesInWindow += nBytesRec;
+        double timeNow = getCurrentSeconds();
+        if(timeNow - timeWindowStart >= 0.1) {
+            double mbPerSec = bytesInWindow / (timeNow - timeWindowStart) / (1024.0*1024.0);
+            probe.mbPerSec = std::max(probe.mbPerSec, mbPerSec);
+            timeWindowStart = timeNow;
+            bytesInWindow = 0;
+        }
+    }
+    close(sock);
+    if(!bOK) {
+        logMsg("BDP probe failed");
+        return false;
+    }
+
+    probe.rttMs = statsPing.min;
+    double rttSender = atof(finalReport["rttmin"].c_str());
+    if(rttSender > 0 && rttSender < probe.rttMs) probe.rttMs = rttSender;
+    probe.bdpBytes = probe.mbPerSec * 1024.0 * 1024.0 * probe.rttMs / 1000.0;
+    logMsg("BDP probe: rtt %.3f ms (ping min/avg/max %.3f/%.3f/%.3f); bandwidth %.3f MB/sec; BDP %.0f KB",
+           probe.rttMs, statsPing.min, statsPing.avg(), statsPing.max, probe.mbPerSec,
+           probe.bdpBytes/1024);
+    return true;
+}
+
+// Choose socket buffer sizes and the application buffer size from the BDP.
+// Socket buffers get twice the BDP, so a full window fits with room for
+// the receiver to lag; each send is about an eighth of the BDP, so several
+// writes are in flight per round trip.
+void applyBdp(const BdpProbe &probe, Settings &settings)
+{
+    const double minSockBuf = 64*1024, maxSockBuf = 64*1024*1024;
+    const double minAppBuf = 8*1024, maxAppBuf = 1024*1024;
+    int sockBuf = (int) std::min(maxSockBuf, std::max(minSockBuf, 2*probe.bdpBytes));
+    int appBuf = (int) std::min(maxAppBuf, std::max(minAppBuf, probe.bdpBytes/8));
+    appBuf = (appBuf + 4095) & ~4095;
+    settings.sndbuf = sockBuf;
+    settings.rcvbuf = sockBuf;
+    settings.bytes_per_buf = appBuf;
+    logMsg("Auto-tuned: sndbuf=%d rcvbuf=%d nbytes=%d", settings.sndbuf, settings.rcvbuf,
+           settings.bytes_per_buf);
+}
+
+// Enable kernel receive timestamps on a UDP socket: nanosecond resolution
+// where the platform has it, else microseconds.
+void enableRecvTimestamps(int sock)
+{
+    int option_value = 1;
+#if defined(SO_TIMESTAMPNS)
+    if(setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &option_value, sizeof(option_value)) < 0) {
+        perror("setsockopt(,,SO_TIMESTAMPNS)");
+    }
+#else
+    if(setsockopt(sock, SOL_SOCKET, SO_TIMESTAMP, &option_value, sizeof(option_value)) < 0) {
+        perror("setsockopt(,,SO_TIMESTAMP)");
+    }
+#endif
+}
+
+// Receive a datagram along with its kernel arrival time in seconds.
+// Falls back to the current time if the kernel didn't supply one.
+ssize_t recvTimestamped(int sock, unsigned char *pbuf, size_t nbytes, double &arrival)
+{
+    char control[256];
+    struct iovec iov;
+    struct msghdr msg;
+    iov.iov_base = pbuf;
+    iov.iov_len = nbytes;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t nBytesRec = recvmsg(sock, &msg, 0);
+    arrival = 0;
+    if(nBytesRec < 0) return nBytesRec;
+    for(struct cmsghdr *pcmsg = CMSG_FIRSTHDR(&msg); pcmsg; pcmsg = CMSG_NXTHDR(&msg, pcmsg)) {
+        if(SOL_SOCKET != pcmsg->cmsg_level) continue;
+#if defined(SCM_TIMESTAMPNS)
+        if(SCM_TIMESTAMPNS == pcmsg->cmsg_type) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(pcmsg), sizeof(ts));
+            arrival = ts.tv_sec + 1e-9 * ts.tv_nsec;
+        }
+#endif
+        if(SCM_TIMESTAMP == pcmsg->cmsg_type) {
+            struct timeval tv;
+            memcpy(&tv, CMSG_DATA(pcmsg), sizeof(tv));
+            arrival = tv.tv_sec + 1e-6 * tv.tv_usec;
+        }
+    }
+    if(0 == arrival) arrival = getCurrentSeconds();
+    return nBytesRec;
+}
+
+// A UDP socket for the server's datagrams, bound to a port of the
+// system's choosing, which is returned in udp_addr.  Returns -1 on error.
+int openUdpReceiver(struct sockaddr_in &udp_addr)
+{
+    int sockUdp = socket(AF_INET, SOCK_DGRAM, 0);
+    if(sockUdp < 0) {
+        perror("Could not create UDP socket");
+        return -1;
+    }
+    memset(&udp_addr, 0, sizeof(udp_addr));
+    udp_addr.sin_family = AF_INET;
+    udp_addr.sin_addr.s_addr = INADDR_ANY;
+    udp_addr.sin_port = 0;
+    socklen_t addr_len = sizeof(udp_addr);
+    if(bind(sockUdp, (struct sockaddr *)&udp_addr, sizeof(udp_addr)) < 0 ||
+       getsockname(sockUdp, (struct sockaddr *)&udp_addr, &addr_len) < 0) {
+        perror("Binding UDP socket");
+        close(sockUdp);
+        return -1;
+    }
+    setSocketBufferSize(sockUdp, SO_RCVBUF, 4*1024*1024);
+    return sockUdp;
+}
+
+// Estimate bottleneck capacity and available bandwidth from the arrival
+// dispersion of UDP packet trains sent back-to-back by the server.
+// Each pair of consecutive packets is a packet-pair capacity sample;
+// the dispersion of a whole train gives its dispersion rate, which falls
+// below capacity as cross traffic competes for the bottleneck.
+int doCapacityTest(const Settings &settings)
+{
+    struct sockaddr_in udp_addr;
+    int sockUdp = openUdpReceiver(udp_addr);
+    if(sockUdp < 0) {
+        return 1;
+    }
+    enableRecvTimestamps(sockUdp);
+
+    int sock = connectToServer(settings);
+    if(sock < 0) {
+        close(sockUdp);
+        return errno;
+    }
+    char buf[MAX_COMMAND_LEN];
+    snprintf(buf, sizeof(buf), "train|0|%d|%s|udpport=%d|trains=%d|trainlen=%d|\n",
+             settings.pktsize, settings.msg.c_str(), ntohs(udp_addr.sin_port),
+             settings.trains, settings.trainlen);
+    if(!sendAll(sock, (unsigned char *)buf, strlen(buf))) {
+        close(sock);
+        close(sockUdp);
+        return 3;
+    }
+
+    // Arrival times, indexed by train and then sequence number; 0 if lost.
+    std::vector<std::vector<double>> arrivals(settings.trains, std::vector<double>(settings.trainlen, 0));
+    std::unique_ptr<unsigned char[]> pbuf(new unsigned char[settings.pktsize + 1]);
+    size_t nReceived = 0;
+    bool bTcpClosed = false;
+    do {
+        fd_set fd_read;
+        FD_ZERO(&fd_read);
+        FD_SET(sockUdp, &fd_read);
+        if(!bTcpClosed) FD_SET(sock, &fd_read);
+        // Once the server has closed the control connection, wait only
+        // briefly for stragglers.
+        struct timeval timeout;
+        timeout.tv_sec = bTcpClosed ? 0 : 5;
+        timeout.tv_usec = bTcpClosed ? 200000 : 0;
+        int nfds = select(1 + std::max(sock, sockUdp), &fd_read, NULL, NULL, &timeout);
+        if(nfds <= 0) break;
+        if(FD_ISSET(sockUdp, &fd_read)) {
+            double arrival;
+            ssize_t nBytesRec = recvTimestamped(sockUdp, pbuf.get(), settings.pktsize + 1, arrival);
+            TrainPacketHeader hdr;
+            if(nBytesRec >= (ssize_t) sizeof(hdr)) {
+                memcpy(&hdr, pbuf.get(), sizeof(hdr));
+                uint32_t train = ntohl(hdr.train), seq = ntohl(hdr.seq);
+                if(TRAIN_MAGIC == ntohl(hdr.magic) && train < (uint32_t) settings.trains &&
+                   seq < (uint32_t) settings.trainlen) {
+                    arrivals[train][seq] = arrival;
+                    nReceived++;
+                }
+            }
+        }
+        if(!bTcpClosed && FD_ISSET(sock, &fd_read)) {
+            ssize_t n = recv(sock, buf, sizeof(buf) - 1, 0);
+            if(n > 0 && 'e' == buf[0]) {
+                // An agent refusing the trains, with its reason.
+                buf[n] = '\0';
+                buf[strcspn(buf, "\n")] = '\0';
+                logMsg("Server refused the test: %s", buf + 1);
+                close(sock);
+                close(sockUdp);
+                return 1;
+            }
+            bTcpClosed = n <= 0;
+        }
+    } while(true);
+    close(sock);
+    close(sockUdp);
+
+    std::vector<double> pairRates, trainRates;
+    const double bitsPerPkt = 8.0 * settings.pktsize;
+    for(int train=0; train<settings.trains; train++) {
+        const std::vector<double> &arr = arrivals[train];
+        double first = 0, last = 0;
+        int nInTrain = 0;
+        for(int seq=0; seq<settings.trainlen; seq++) {
+            if(0 == arr[seq]) continue;
+            if(0 == first) first = arr[seq];
+            last = arr[seq];
+            nInTrain++;
+            if(seq > 0 && arr[seq-1] > 0 && arr[seq] > arr[seq-1]) {
+                pairRates.push_back(bitsPerPkt / (arr[seq] - arr[seq-1]) / 1e6);
+            }
+        }
+        if(nInTrain > 1 && last > first) {
+            trainRates.push_back((nInTrain-1) * bitsPerPkt / (last - first) / 1e6);
+        }
+    }
+    size_t nSent = (size_t) settings.trains * settings.trainlen;
+    logMsg("Capacity probe: %d trains of %d packets of %d bytes; received %zu of %zu (%.1f%% loss)",
+           settings.trains, settings.trainlen, settings.pktsize, nReceived, nSent,
+           nSent ? 100.0 * (nSent - nReceived) / nSent : 0.0);
+    if(pairRates.empty() || trainRates.empty()) {
+        logMsg("Not enough packets arrived to estimate capacity");
+        return 1;
+    }
+    logMsg("Bottleneck capacity (packet pairs): median %.3f Mb/sec; IQR %.3f-%.3f from %zu pairs",
+           percentile(pairRates, 50), percentile(pairRates, 25), percentile(pairRates, 75),
+           pairRates.size());
+    logMsg("Available bandwidth (train dispersion): median %.3f Mb/sec; min %.3f from %zu trains",
+           percentile(trainRates, 50), percentile(trainRates, 0), trainRates.size());
+    return 0;
+}
+
+// One stream of a multi-stream test: connect, run the test, and leave the
+// outcome in *presult.
+Task<int> runStream(IoLoop *ploop, Settings settings, StreamResult *presult, StreamLive *plive = NULL)
+{
+    int sock = co_await connectToServerAsync(ploop, settings, &presult->startup);
+    if(sock < 0) {
+        if(plive) plive->bDone = true;
+        co_return 1;
+    }
+    int retval = co_await handleClientConnection(ploop, sock, settings, presult, &presult->startup, plive);
+    if(plive) plive->bDone = true;
+    close(sock);
+    co_return retval;
+}
+
+// Run several streams at once, as tasks on an event loop with a worker
+// per CPU (but no more than there are streams).  With -live, the live
+// view replaces the loop's once-a-second log lines.
+void runStreamsConcurrently(const std::vector<Settings> &streamSettings, std::vector<StreamResult> &results)
+{
+    size_t nStreams = streamSettings.size();
+    int nWorkers = (int) std::min<size_t>(nStreams, std::max(1u, std::thread::hardware_concurrency()));
+    IoLoop loop(nWorkers, streamSettings[0].pin);
+    LoopReporter reporter;
+    LiveView view;
+    std::unique_ptr<StreamLive[]> plive;
+    if(streamSettings[0].live) {
+        plive.reset(new StreamLive[nStreams]);
+        view.start(plive.get(), nStreams);
+    } else {
+        reporter.start(&loop, 1.0);
+    }
+    for(size_t j=0; j<nStreams; j++) {
+        loop.spawn(runStream(&loop, streamSettings[j], &results[j], plive ? &plive[j] : NULL));
+    }
+    loop.run(false);
+    reporter.stop();
+    view.stop();
+    logMsg("Loop workers (busy runs/steals): %s", loop.describeWorkers().c_str());
+}
+
+// Run -streams parallel copies of the test and report each stream's share
+// and the total.  The server needs -concurrent.
+int doMultiStream(const Settings &settings)
+{
+    size_t nStreams = settings.streams;
+    std::vector<StreamResult> results(nStreams);
+    std::vector<Settings> streamSettings(nStreams, settings);
+    // The counters are host-wide, so one snapshot covers all the streams.
+    const string ifname = settings.counters ? interfaceToward(settings.remoteip) : "";
+    StackCounters countersStart, countersEnd;
+    if(settings.counters) countersStart.snapshot(ifname);
+    CpuTimes cpuTimesStart, cpuTimesEnd;
+    if(settings.cpustat) cpuTimesStart.sample();
+    double timeStart = getCurrentSeconds();
+    double cpuStart = getCpuSeconds(true);
+    runStreamsConcurrently(streamSettings, results);
+    double cpuSecs = getCpuSeconds(true) - cpuStart;
+    if(settings.counters) countersEnd.snapshot(ifname);
+    if(settings.cpustat) cpuTimesEnd.sample();
+
+    int retval = 0;
+    size_t totBytes = 0;
+    double secsMax = 0;
+    RunningStats statsRate;
+    logMsg("%zu parallel streams, %d secs%s:", nStreams, settings.secs,
+           stopRequested() ? ", interrupted; the results are partial" : "");
+    for(size_t j=0; j<nStreams; j++) {
+        StreamResult &res = results[j];
+        if(!res.bOK) {
+            logMsg("  stream %3zu failed", j);
+            retval = 1;
+            continue;
+        }
+        totBytes += res.bytes;
+        secsMax = std::max(secsMax, res.secs);
+        statsRate.add(res.mbPerSec);
+        logMsg("  stream %3zu %9.3f MB/sec; first byte %.3f ms; retrans %s", j, res.mbPerSec,
+               res.startup.firstByteMs, res.finalReport["retrans"].c_str());
+    }
+    if(secsMax > 0) {
+        double mbPerSec = totBytes / secsMax / (1024.0*1024.0);
+        logMsg("%8.3f MB/sec (%.3f Mb/sec) total; per stream %.3f/%.3f/%.3f MB/sec (min/avg/max)",
+               mbPerSec, 8*mbPerSec, statsRate.min, statsRate.avg(), statsRate.max);
+        if(settings.cpustat && !cpuTimesEnd.cores.empty()) {
+            logMsg("Busiest cores: %s",
+                   describeCoreLoads(busiestCores(cpuTimesStart, cpuTimesEnd, CPU_STAT_TOP)).c_str());
+        }
+        if(settings.counters) {
+            logCounterDeltas(("Client" + (ifname.empty() ? string() : " (" + ifname + ")")).c_str(),
+                             countersEnd.deltasSince(countersStart));
+            // The server's are host-wide too, so the first stream's cover
+            // them all, over that stream's time.
+            for(size_t j=0; j<nStreams; j++) {
+                if(!results[j].bOK || !results[j].finalReport.count("ifname")) continue;
+                string serverIf = results[j].finalReport["ifname"];
+                logCounterDeltas(("Server" + (serverIf.empty() ? string() : " (" + serverIf + ")")).c_str(),
+                                 counterDeltasFromReport(results[j].finalReport),
+                                 atol(results[j].finalReport["cdropped"].c_str()));
+                break;
+            }
+        }
+        if("none" != settings.store) {
+            // One record for the whole run; its RTTs span all the streams.
+            ResultRun run = makeResultRun(settings, timeStart);
+            RunningStats statsRtt, statsRttAvg;
+            run.bAborted = stopRequested();
+            run.bOK = 0 == retval && !run.bAborted;
+            run.bytes = totBytes;
+            run.secsTot = secsMax;
+            run.mbPerSec = mbPerSec;
+            for(size_t j=0; j<nStreams; j++) {
+                if(!results[j].bOK || results[j].finalReport["rttavg"].empty()) continue;
+                statsRtt.add(atof(results[j].finalReport["rttmin"].c_str()));
+                statsRtt.add(atof(results[j].finalReport["rttmax"].c_str()));
+                run.retrans += (uint32_t) atol(results[j].finalReport["retrans"].c_str());
+                statsRttAvg.add(atof(results[j].finalReport["rttavg"].c_str()));
+            }
+            run.rttAvgMs = (float) statsRttAvg.avg();
+            run.receiverCpuPerGB = (float) (cpuSecs / (totBytes / (1024.0*1024.0*1024.0)));
+            run.rttMinMs = (float) statsRtt.min;
+            run.rttMaxMs = (float) statsRtt.max;
+            if(!appendResult(settings.store, run, std::vector<ResultInterval>())) {
+                logMsg("Can't append to results file %s", settings.store.c_str());
+            }
+        }
+    }
+    return retval;
+}
+
+// Latency seen by the mixed workload's probe, in microseconds: before the
+// bulk streams start, while they run, and in the current report interval.
+struct ProbeLatency {
+    LatencyHistogram    histoIdle;
+    LatencyHistogram    histoLoaded;
+    LatencyHistogram    histoInterval;
+    bool                bOK = false;
+};
+
+// Sum of the bytes every worker of a loop has counted so far.
+uint64_t loopBytes(IoLoop *ploop)
+{
+    uint64_t bytes = 0;
+    for(size_t j=0; j<ploop->workers.size(); j++) {
+        bytes += ploop->workers[j]->counters.snapshot().bytes;
+    }
+    return bytes;
+}
+
+// The mixed workload's latency probe: on a connection of its own, send a
+// small request every probe interval and time its echo.  Probes for
+// secsIdle before the bulk streams start and secsLoaded while they run,
+// logging each second's probe latency alongside the bulk throughput.
+Task<int> runLatencyProbe(IoLoop *ploop, Settings settings, double secsIdle, double secsLoaded,
+                          ProbeLatency *platency)
+{
+    int sock = co_await connectToServerAsync(ploop, settings);
+    if(sock < 0) co_return 1;
+    int option_value = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &option_value, sizeof(option_value));
+    char buf[MAX_COMMAND_LEN];
+    snprintf(buf, sizeof(buf), "echo|%d|%d|%s|", (int) ceil(secsIdle + secsLoaded),
+             PROBE_REQUEST_BYTES, settings.msg.c_str());
+    string cmd = buf;
+    addField(cmd, "ack", "1");
+    cmd += "\n";
+    double commandRttMs;
+    bool bOK = co_await sendAllAsync(ploop, sock, (unsigned char *)cmd.c_str(), cmd.length()) &&
+               co_await waitForReadyAsync(ploop, sock, getMonotonicSeconds(), commandRttMs);
+
+    unsigned char request[PROBE_REQUEST_BYTES];
+    memset(request, 'q', sizeof(request));
+    double timeStart = getMonotonicSeconds();
+    double timeLastReport = timeStart;
+    uint64_t bytesAtReport = loopBytes(ploop);
+    bool bEOF = false;
+    while(bOK) {
+        double timeSend = getMonotonicSeconds();
+        if(timeSend - timeStart >= secsIdle + secsLoaded || stopRequested()) break;
+        bOK = co_await sendAllAsync(ploop, sock, request, sizeof(request)) &&
+              (ssize_t) sizeof(request) == co_await recvAllAsync(ploop, sock, request, sizeof(request), bEOF);
+        if(!bOK) break;
+        double timeNow = getMonotonicSeconds();
+        double usecs = 1e6 * (timeNow - timeSend);
+        (timeSend - timeStart < secsIdle ? platency->histoIdle : platency->histoLoaded).record(usecs);
+        platency->histoInterval.record(usecs);
+        if(timeNow - timeLastReport >= 1.0) {
+            uint64_t bytes = loopBytes(ploop);
+            double mbPerSec = (bytes - bytesAtReport) / (timeNow - timeLastReport) / (1024*1024);
+            const LatencyHistogram &histo = platency->histoInterval;
+            logMsg("%5.0f s  bulk %9.3f MB/sec (%.3f Mb/sec); probe p50/p99/max %.3f/%.3f/%.3f ms (%zu)",
+                   timeNow - timeStart, mbPerSec, 8*mbPerSec, histo.percentile(50) / 1000,
+                   histo.percentile(99) / 1000, histo.stats.max / 1000, histo.count());
+            platency->histoInterval.reset();
+            bytesAtReport = bytes;
+            timeLastReport = timeNow;
+        }
+        co_await SleepFor(ploop, timeSend + settings.probeIntervalMs / 1000.0 - getMonotonicSeconds());
+    }
+    platency->bOK = bOK;
+    close(sock);
+    co_return bOK ? 0 : 1;
+}
+
+// Start a stream after a delay.
+Task<int> runStreamAfter(IoLoop *ploop, double secsDelay, Settings settings, StreamResult *presult)
+{
+    co_await SleepFor(ploop, secsDelay);
+    co_return co_await runStream(ploop, settings, presult);
+}
+
+// Run -mixed bulk streams through the usual send loop while a latency
+// probe times small request/response exchanges on another connection, to
+// show how much queueing the bulk traffic adds for latency-sensitive
+// traffic on the same path (bufferbloat).  The probe runs alone for a
+// moment first, to get the idle latency.  The server needs -concurrent.
+int doMixedWorkload(const Settings &settings)
+{
+    size_t nBulk = settings.mixed;
+    std::vector<StreamResult> results(nBulk);
+    ProbeLatency latency;
+    int nWorkers = (int) std::min<size_t>(nBulk + 1, std::max(1u, std::thread::hardware_concurrency()));
+    IoLoop loop(nWorkers, settings.pin);
+    logMsg("Mixed workload: %zu bulk streams for %d secs; probe every %d ms after %d secs idle",
+           nBulk, settings.secs, settings.probeIntervalMs, MIXED_IDLE_SECS);
+    loop.spawn(runLatencyProbe(&loop, settings, MIXED_IDLE_SECS, settings.secs, &latency));
+    for(size_t j=0; j<nBulk; j++) {
+        loop.spawn(runStreamAfter(&loop, MIXED_IDLE_SECS, settings, &results[j]));
+    }
+    loop.run(false);
+
+    int retval = latency.bOK ? 0 : 1;
+    size_t totBytes = 0;
+    double secsMax = 0;
+    for(size_t j=0; j<nBulk; j++) {
+        if(!results[j].bOK) retval = 1;
+        totBytes += results[j].bytes;
+        secsMax = std::max(secsMax, results[j].secs);
+    }
+    double mbPerSec = secsMax > 0 ? totBytes / secsMax / (1024*1024) : 0;
+    logMsg("Bulk: %8.3f MB/sec (%.3f Mb/sec) over %zu streams", mbPerSec, 8*mbPerSec, nBulk);
+    const LatencyHistogram &idle = latency.histoIdle, &loaded = latency.histoLoaded;
+    logMsg("Probe idle:   p50 %.3f ms; p90 %.3f; p99 %.3f; max %.3f (%zu)", idle.percentile(50) / 1000,
+           idle.percentile(90) / 1000, idle.percentile(99) / 1000, idle.stats.max / 1000, idle.count());
+    logMsg("Probe loaded: p50 %.3f ms; p90 %.3f; p99 %.3f; max %.3f (%zu)", loaded.percentile(50) / 1000,
+           loaded.percentile(90) / 1000, loaded.percentile(99) / 1000, loaded.stats.max / 1000, loaded.count());
+    if(idle.count() && loaded.count()) {
+        logMsg("Latency under load: %+.3f ms at p50, %+.3f ms at p99",
+               (loaded.percentile(50) - idle.percentile(50)) / 1000,
+               (loaded.percentile(99) - idle.percentile(99)) / 1000);
+    }
+    return retval;
+}
+
+// Round trips measured by the responsiveness test, in ms.
+struct ResponsivenessSamples {
+    std::vector<double> connectIdle, requestIdle;       // Before the load starts.
+    std::vector<double> connectLoaded, requestLoaded;   // On new connections under load.
+    size_t              nFailed = 0;
+};
+
+// The responsiveness test's new-connection probes: every probe interval,
+// open a connection, time the handshake and then a request and response
+// on it (the command and the server's ready byte), and close it.
+Task<int> runConnectionProbes(IoLoop *ploop, Settings settings, double secsIdle, double secsTotal,
+                              ResponsivenessSamples *psamples)
+{
+    double timeStart = getMonotonicSeconds();
+    char buf[MAX_COMMAND_LEN];
+    snprintf(buf, sizeof(buf), "echo|1|%d|%s|", PROBE_REQUEST_BYTES, settings.msg.c_str());
+    string cmd = buf;
+    addField(cmd, "ack", "1");
+    cmd += "\n";
+    // Resolve once, rather than block the loop's thread on each probe.
+    struct sockaddr_in server_addr;
+    if(!resolveServer(settings, server_addr)) co_return 1;
+    while(getMonotonicSeconds() - timeStart < secsTotal && !stopRequested()) {
+        double timeProbe = getMonotonicSeconds();
+        bool bLoaded = timeProbe - timeStart >= secsIdle;
+        StartupTimes times;
+        int sock = co_await connectToServerAsync(ploop, settings, &times, true, &server_addr);
+        bool bOK = sock >= 0;
+        if(bOK) {
+            int option_value = 1;
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &option_value, sizeof(option_value));
+            double timeCommand = getMonotonicSeconds();
+            bOK = co_await sendAllAsync(ploop, sock, (unsigned char *)cmd.c_str(), cmd.length()) &&
+                  co_await waitForReadyAsync(ploop, sock, timeCommand, times.commandRttMs);
+            close(sock);
+        }
+        if(bOK) {
+            (bLoaded ? psamples->connectLoaded : psamples->connectIdle).push_back(times.connectMs);
+            (bLoaded ? psamples->requestLoaded : psamples->requestIdle).push_back(times.commandRttMs);
+        } else {
+            psamples->nFailed++;
+        }
+        co_await SleepFor(ploop, timeProbe + RPM_PROBE_INTERVAL_MS / 1000.0 - getMonotonicSeconds());
+    }
+    co_return 0;
+}
+
+// Responsiveness under working conditions, in the spirit of the IETF
+// "Round-trips Per Minute" metric: saturate the path with parallel bulk
+// streams while timing round trips, and express the result as round trips
+// per minute.  Foreign round trips are new connections' handshakes and
+// first request/response; self round trips are on the loaded connections
+// themselves, here the senders' smoothed RTTs from their interval reports.
+// With no TLS to time, RPM = 60000 / (1/4 TM(handshake) + 1/4 TM(request)
+// + 1/2 TM(self)), TM being the 95% trimmed mean.  The server needs
+// -concurrent.
+int doResponsiveness(const Settings &settings)
+{
+    size_t nBulk = settings.streams > 1 ? settings.streams : RPM_DEFAULT_STREAMS;
+    std::vector<StreamResult> results(nBulk);
+    ResponsivenessSamples samples;
+    int nWorkers = (int) std::min<size_t>(nBulk + 1, std::max(1u, std::thread::hardware_concurrency()));
+    IoLoop loop(nWorkers, settings.pin);
+    logMsg("Responsiveness: %d secs idle, then %zu bulk streams for %d secs", RPM_IDLE_SECS, nBulk, settings.secs);
+    loop.spawn(runConnectionProbes(&loop, settings, RPM_IDLE_SECS, RPM_IDLE_SECS + settings.secs, &samples));
+    for(size_t j=0; j<nBulk; j++) {
+        loop.spawn(runStreamAfter(&loop, RPM_IDLE_SECS, settings, &results[j]));
+    }
+    loop.run(false);
+
+    int retval = 0;
+    size_t totBytes = 0;
+    double secsMax = 0;
+    std::vector<double> selfMs;
+    for(size_t j=0; j<nBulk; j++) {
+        if(!results[j].bOK) retval = 1;
+        totBytes += results[j].bytes;
+        secsMax = std::max(secsMax, results[j].secs);
+        selfMs.insert(selfMs.end(), results[j].senderRttMs.begin(), results[j].senderRttMs.end());
+    }
+    if(samples.requestIdle.empty() || samples.requestLoaded.empty()) {
+        logMsg("Responsiveness: too few successful probes (%zu failed)", samples.nFailed);
+        return 1;
+    }
+    double mbPerSec = secsMax > 0 ? totBytes / secsMax / (1024*1024) : 0;
+    double idleMs = percentile(samples.requestIdle, 50);
+    double idleConnectMs = percentile(samples.connectIdle, 50);
+    double tmConnect = trimmedMean(samples.connectLoaded, 95);
+    double tmRequest = trimmedMean(samples.requestLoaded, 95);
+    double tmSelf = selfMs.empty() ? tmRequest : trimmedMean(selfMs, 95);
+    double rpm = 60000 / (0.25 * tmConnect + 0.25 * tmRequest + 0.5 * tmSelf);
+    double rpmIdle = 60000 / (0.5 * trimmedMean(samples.connectIdle, 95) + 0.5 * trimmedMean(samples.requestIdle, 95));
+    logMsg("Load: %8.3f MB/sec (%.3f Mb/sec) over %zu streams", mbPerSec, 8*mbPerSec, nBulk);
+    logMsg("Idle latency: %.3f ms request, %.3f ms handshake (median of %zu)",
+           idleMs, idleConnectMs, samples.requestIdle.size());
+    logMsg("Loaded latency: %.3f ms request, %.3f ms handshake (trimmed mean of %zu); "
+           "%.3f ms in-connection (%zu sender samples)", tmRequest, tmConnect,
+           samples.requestLoaded.size(), tmSelf, selfMs.size());
+    if(samples.nFailed) {
+        logMsg("%zu probes failed", samples.nFailed);
+    }
+    logMsg("Responsiveness: %.0f RPM under load (%.0f RPM idle)", rpm, rpmIdle);
+    return retval;
+}
+
+// Compare congestion control algorithms: one stream per algorithm, all at
+// once so they compete for the bottleneck, or one after another to see
+// each in isolation.  Competing streams need a server run with -concurrent.
+int doCcComparison(const Settings &settings)
+{
+    size_t nStreams = settings.ccList.size();
+    std::vector<StreamResult> results(nStreams);
+    std::vector<Settings> streamSettings(nStreams, settings);
+    for(size_t j=0; j<nStreams; j++) {
+        streamSettings[j].cc = settings.ccList[j];
+        streamSettings[j].pings = std::max(settings.pings, PROBE_PINGS);
+    }
+    if(settings.ccSequential) {
+        // After an interrupt, the rest are left out as failed.
+        for(size_t j=0; j<nStreams && !stopRequested(); j++) {
+            runSync(runStream(NULL, streamSettings[j], &results[j]));
+        }
+    } else {
+        runStreamsConcurrently(streamSettings, results);
+    }
+
+    logMsg("Congestion control comparison (%s, %d secs per stream):",
+           settings.ccSequential ? "sequential" : "concurrent", settings.secs);
+    logMsg("  %-10s %-10s %10s %11s %10s %10s %9s %8s", "requested", "used", "MB/sec", "Mb/sec",
+           "idle rtt", "avg rtt", "inflation", "retrans");
+    int retval = 0;
+    for(size_t j=0; j<nStreams; j++) {
+        StreamResult &res = results[j];
+        if(!res.bOK) {
+            logMsg("  %-10s failed", settings.ccList[j].c_str());
+            retval = 1;
+            continue;
+        }
+        double rttAvg = atof(res.finalReport["rttavg"].c_str());
+        double inflation = res.pingRttMs > 0 ? rttAvg / res.pingRttMs : 0;
+        logMsg("  %-10s %-10s %10.3f %11.3f %7.3f ms %7.3f ms %8.1fx %8s", settings.ccList[j].c_str(),
+               res.finalReport["cc"].c_str(), res.mbPerSec, 8*res.mbPerSec, res.pingRttMs, rttAvg,
+               inflation, res.finalReport["retrans"].c_str());
+    }
+    return retval;
+}
+
+// One packet size probed with don't-fragment UDP datagrams from the server.
+struct MtuProbe {
+    int     mtu = 0;            // IP packet size probed.
+    int     received = 0;       // Of PMTU_PROBE_PKTS.
+    int     tooBig = 0;         // Refused by the server's kernel as bigger than...
+    int     senderMtu = 0;      // ...the path MTU it knows; 0 if unknown.
+    bool    passed() const { return received >= PMTU_PROBE_PASS; }
+};
+
+// Have the server send PMTU_PROBE_PKTS datagrams of mtu bytes (IP packet
+// size) with DF set, and count those that arrive whole.  If pmss isn't
+// NULL, it and plocalMtu get the control connection's MSS and path MTU.
+// Returns false if the server couldn't be asked.
+bool probeMtu(const Settings &settings, int mtu, MtuProbe &probe, int *pmss = NULL, int *plocalMtu = NULL)
+{
+    probe = MtuProbe();
+    probe.mtu = mtu;
+    struct sockaddr_in udp_addr;
+    int sockUdp = openUdpReceiver(udp_addr);
+    if(sockUdp < 0) return false;
+    int sock = runSync(connectToServerAsync(NULL, settings, NULL, true));
+    if(sock < 0) {
+        close(sockUdp);
+        return false;
+    }
+    if(pmss) getPathMtu(sock, *plocalMtu, *pmss);
+    int payload = mtu - UDP_IP_HEADER_BYTES;
+    char buf[MAX_COMMAND_LEN];
+    snprintf(buf, sizeof(buf), "train|0|%d|%s|udpport=%d|trains=1|trainlen=%d|df=1|\n",
+             payload, settings.msg.c_str(), ntohs(udp_addr.sin_port), PMTU_PROBE_PKTS);
+    bool bOK = sendAll(sock, (unsigned char *)buf, strlen(buf));
+    std::unique_ptr<unsigned char[]> pbuf(new unsigned char[payload + 1]);
+    string reply;
+    bool bTcpClosed = !bOK;
+    while(bOK) {
+        // As for -capacity: once the server closes, wait briefly for stragglers.
+        fd_set fd_read;
+        FD_ZERO(&fd_read);
+        FD_SET(sockUdp, &fd_read);
+        if(!bTcpClosed) FD_SET(sock, &fd_read);
+        struct timeval timeout;
+        timeout.tv_sec = bTcpClosed ? 0 : RECV_TIMEOUT_SECS;
+        timeout.tv_usec = bTcpClosed ? 200000 : 0;
+        if(select(1 + std::max(sock, sockUdp), &fd_read, NULL, NULL, &timeout) <= 0) break;
+        if(FD_ISSET(sockUdp, &fd_read)) {
+            TrainPacketHeader hdr;
+            ssize_t nBytesRec = recv(sockUdp, pbuf.get(), payload + 1, 0);
+            memcpy(&hdr, pbuf.get(), sizeof(hdr));
+            if(nBytesRec == payload && TRAIN_MAGIC == ntohl(hdr.magic)) probe.received++;
+        }
+        if(!bTcpClosed && FD_ISSET(sock, &fd_read)) {
+            ssize_t n = recv(sock, buf, sizeof(buf), 0);
+            if(n > 0) reply.append(buf, n);
+            bTcpClosed = n <= 0;
+        }
+    }
+    close(sock);
+    close(sockUdp);
+    if(!reply.empty() && 'e' == reply[0]) {
+        logMsg("Server refused the probe: %s", trimSpaces(reply.substr(1)).c_str());
+        return false;
+    }
+    std::map<string,string> values;
+    parseNameValues(splitFields(trimSpaces(reply), '|'), 1, values);
+    probe.tooBig = atoi(values["toobig"].c_str());
+    probe.senderMtu = atoi(values["mtu"].c_str());
+    return bOK;
+}
+
+// Find the usable path MTU from the server to us, which a misconfigured
+// overlay can silently shrink: DF-flagged UDP probes at common MTUs until
+// one doesn't get through, then a bisection between the last that did and
+// the first that didn't; the TCP connection's MSS and the kernels' own path
+// MTUs alongside.  Then a short TCP test at each candidate MTU, its MSS
+// clamped to fit, shows where throughput changes.  A size that's lost
+// without the server's kernel refusing it points to a PMTU black hole.
+int doPathMtuTest(const Settings &settings)
+{
+    std::vector<int> candidates = {PMTU_MIN, 1280, 1400, 1420, 1450, 1480, 1492, 1500, 4000, 9000};
+    int tcpMss = 0, localMtu = 0;
+    std::map<int, MtuProbe> probes;
+    MtuProbe probe;
+    if(!probeMtu(settings, PMTU_MIN, probe, &tcpMss, &localMtu)) {
+        return 3;
+    }
+    if(localMtu > candidates.back()) candidates.push_back(std::min(localMtu, 65535));
+    int lo = 0, hi = 0;
+    for(size_t j=0; j<candidates.size() && !stopRequested(); j++) {
+        if(j > 0 && !probeMtu(settings, candidates[j], probe)) break;
+        probes[candidates[j]] = probe;
+        logMsg("UDP DF probe %5d bytes: %d of %d arrived%s", probe.mtu, probe.received, PMTU_PROBE_PKTS,
+               probe.tooBig ? "; the server's kernel refused them as too big" : "");
+        if(!probe.passed()) {
+            hi = candidates[j];
+            break;
+        }
+        lo = candidates[j];
+    }
+    if(0 == lo) {
+        logMsg("Even %d-byte DF datagrams don't arrive: UDP from the server may be blocked", PMTU_MIN);
+        return 1;
+    }
+    while(hi > lo + 4 && !stopRequested()) {
+        int mid = (lo + hi) / 2;
+        if(!probeMtu(settings, mid, probe)) break;
+        probes[mid] = probe;
+        logMsg("UDP DF probe %5d bytes: %d of %d arrived%s", probe.mtu, probe.received, PMTU_PROBE_PKTS,
+               probe.tooBig ? "; the server's kernel refused them as too big" : "");
+        (probe.passed() ? lo : hi) = mid;
+    }
+    int senderMtu = 0;
+    bool bRefused = false;
+    for(const auto &p : probes) {
+        senderMtu = std::max(senderMtu, p.second.senderMtu);
+        bRefused = bRefused || p.second.tooBig > 0;
+    }
+    logMsg("UDP path MTU %s%d bytes%s", hi ? "" : "at least ", lo,
+           hi ? (bRefused ? " (the server knows it, from ICMP or its route)" :
+                 " (bigger datagrams vanish without a trace: a PMTU black hole?)") : "");
+    logMsg("TCP: MSS %d, so about %d-byte packets; path MTU %d here and %d at the server", tcpMss,
+           tcpMss + TCP_IP_HEADER_BYTES, localMtu, senderMtu);
+
+    // A throughput test at each candidate up to the path MTU, the path MTU
+    // itself, and the first size that failed, to show what it costs.
+    std::vector<int> sizes;
+    for(int mtu : candidates) {
+        if(mtu <= lo) sizes.push_back(mtu);
+    }
+    if(sizes.back() != lo) sizes.push_back(lo);
+    if(hi) sizes.push_back(hi);
+    std::vector<StreamResult> results(sizes.size());
+    for(size_t j=0; j<sizes.size() && !stopRequested(); j++) {
+        Settings runSettings = settings;
+        runSettings.secs = PMTU_TEST_SECS;
+        // Linux won't clamp the MSS above 32767, which no real link needs.
+        runSettings.mss = sizes[j] - TCP_IP_HEADER_BYTES <= 32767 ? sizes[j] - TCP_IP_HEADER_BYTES : 0;
+        runSync(runStream(NULL, runSettings, &results[j]));
+    }
+
+    int retval = 0;
+    logMsg("Throughput by MTU (%d secs each, TCP MSS clamped to fit):", PMTU_TEST_SECS);
+    logMsg("  %6s %8s %8s %10s %11s %8s", "MTU", "UDP DF", "TCP MSS", "MB/sec", "Mb/sec", "retrans");
+    double mbPerSecPrev = 0;
+    for(size_t j=0; j<sizes.size(); j++) {
+        StreamResult &res = results[j];
+        char udp[16] = "-";
+        auto it = probes.find(sizes[j]);
+        if(it != probes.end()) snprintf(udp, sizeof(udp), "%d/%d", it->second.received, PMTU_PROBE_PKTS);
+        if(!res.bOK) {
+            logMsg("  %6d %8s %8s failed%s", sizes[j], udp, "-",
+                   sizes[j] > lo ? ": the connection stalls above the path MTU" : "");
+            retval = 1;
+            continue;
         }
-    } while (true);
-    
+        string note;
+        if(mbPerSecPrev > 0 && fabs(res.mbPerSec - mbPerSecPrev) > 0.2 * mbPerSecPrev) {
+            note = res.mbPerSec < mbPerSecPrev ? "  <- throughput drops" : "  <- throughput rises";
+        }
+        if(sizes[j] > lo) note += "  <- above the path MTU";
+        logMsg("  %6d %8s %8s %10.3f %11.3f %8s%s", sizes[j], udp, res.finalReport["mss"].c_str(),
+               res.mbPerSec, 8*res.mbPerSec, res.finalReport["retrans"].c_str(), note.c_str());
+        mbPerSecPrev = res.mbPerSec;
+    }
     return retval;
 }
 
-int handleClientConnection(int sock, Settings settings)
+// Run the test three times, one after another: with writes of nbytes as
+// given, rounded to whole segments, and GSO-sized, to show what aligning
+// writes with segment and super-packet boundaries does to throughput and
+// CPU per byte.  The sender's CPU is known only from a server that isn't
+// -concurrent.  Jumbo frames show up as a larger MSS and GSO writes.
+int doAlignmentComparison(const Settings &settings)
 {
+    static const char *aligns[] = {"", "mss", "gso"};
+    const size_t nRuns = sizeof(aligns) / sizeof(aligns[0]);
+    std::vector<StreamResult> results(nRuns);
+    std::vector<double> receiverCpu(nRuns, 0);
+    for(size_t j=0; j<nRuns && !stopRequested(); j++) {
+        Settings runSettings = settings;
+        runSettings.align = aligns[j];
+        double cpuStart = getCpuSeconds(true);
+        runSync(runStream(NULL, runSettings, &results[j]));
+        receiverCpu[j] = getCpuSeconds(true) - cpuStart;
+    }
+
     int retval = 0;
-    char buf[256];
-    int nbytes = snprintf(buf, sizeof(buf), "send|%d|%d|%s|\n",
-        settings.secs, settings.bytes_per_buf, settings.msg.c_str());
-    if(!sendAll(sock, (unsigned char *)buf, nbytes)) {
-        retval = 3;
+    logMsg("Write alignment comparison (%d secs each; MSS %d, and %s at the sender):", settings.secs,
+           results[0].mss, results[0].finalReport["mss"].empty() ? "unknown" : results[0].finalReport["mss"].c_str());
+    logMsg("  %-9s %9s %9s %10s %11s %13s %13s %8s", "writes", "bytes", "segments", "MB/sec", "Mb/sec",
+           "sender s/GB", "receiver s/GB", "retrans");
+    for(size_t j=0; j<nRuns; j++) {
+        StreamResult &res = results[j];
+        const char *pszName = aligns[j][0] ? aligns[j] : "as given";
+        if(!res.bOK) {
+            logMsg("  %-9s failed", pszName);
+            retval = 1;
+            continue;
+        }
+        double gb = res.bytes / (1024.0*1024.0*1024.0);
+        char senderCpu[32] = "-";
+        if(!res.finalReport["cpusecs"].empty()) {
+            snprintf(senderCpu, sizeof(senderCpu), "%.3f", atof(res.finalReport["cpusecs"].c_str()) / gb);
+        }
+        logMsg("  %-9s %9d %9.2f %10.3f %11.3f %13s %13.3f %8s", pszName, res.bytesPerBuf,
+               res.mss > 0 ? (double) res.bytesPerBuf / res.mss : 0.0, res.mbPerSec, 8*res.mbPerSec,
+               senderCpu, receiverCpu[j] / gb, res.finalReport["retrans"].c_str());
+    }
+    return retval;
+}
+
+// Whether a stored run passes the query's filter.
+bool matchesFilter(const ResultRun &run, const ResultFilter &filter)
+{
+    time_t start = (time_t) (run.startUs / 1000000);
+    return (0 == filter.from || start >= filter.from) &&
+           (0 == filter.to || start < filter.to) &&
+           (filter.host.empty() || filter.host == run.host) &&
+           (filter.cc.empty() || filter.cc == run.cc) &&
+           (filter.msg.empty() || NULL != strstr(run.msg, filter.msg.c_str())) &&
+           (0 == filter.secs || filter.secs == run.secs) &&
+           (0 == filter.nbytes || filter.nbytes == run.bytesPerBuf) &&
+           (0 == filter.streams || filter.streams == run.streams);
+}
+
+// The group a run falls in for the query's -by.
+string resultGroup(const ResultRun &run, const string &by)
+{
+    char buf[64];
+    if("day" == by) {
+        time_t start = (time_t) (run.startUs / 1000000);
+        std::tm tmBuf;
+        strftime(buf, sizeof(buf), "%Y-%m-%d", localtime_r(&start, &tmBuf));
+        return buf;
+    } else if("host" == by) {
+        return run.host;
+    } else if("cc" == by) {
+        return run.cc[0] ? run.cc : "default";
+    } else if("msg" == by) {
+        return run.msg;
+    } else if("nbytes" == by) {
+        snprintf(buf, sizeof(buf), "%d", run.bytesPerBuf);
+    } else if("streams" == by) {
+        snprintf(buf, sizeof(buf), "%d", run.streams);
     } else {
-        // Command sent to server OK.
-        size_t nBytesRec = 0;
-        std::unique_ptr<unsigned char> pbuf(new unsigned char[settings.bytes_per_buf]);
+        return "all";
+    }
+    return buf;
+}
 
-        ssize_t totBytesRec = 0;
-        ssize_t bytesRecSinceLastUIUpdate = 0;
-        double timeStart = getCurrentSeconds();
-        double timeLastUIUpdate = timeStart;
-        ssize_t nCallsToTimer = 0;
-        bool bEOF;
-        do {
-            nBytesRec = recvAll(sock, pbuf.get(), settings.bytes_per_buf, bEOF);
-            double timeNow = getCurrentSeconds();
-            nCallsToTimer++;
-            if(nBytesRec >= 0 || bEOF) {
-                totBytesRec += nBytesRec;
-                bytesRecSinceLastUIUpdate += nBytesRec;
-                double secsSinceLastUIUpdate = timeNow - timeLastUIUpdate;
-                if(nBytesRec > 0) {
-                    if(secsSinceLastUIUpdate >= 1.0) {
-                        timeLastUIUpdate = timeNow;
-                        double mbPerSec = (((double) bytesRecSinceLastUIUpdate) / ((double) secsSinceLastUIUpdate)) / (1024*1024);
-                        // Weirdly, nothing prints on macos if I use "\r".
-                        printf("%9.3f MB/sec (%.3f Mb/sec)\n", mbPerSec, 8*mbPerSec);
-                        bytesRecSinceLastUIUpdate = 0;
-                    }
-                }
-                if(bEOF) {
-                    // Clean disconnect received; end of data.
-                    double secsTot = timeNow - timeStart;
-                    double mBytesPerSec = (((double) totBytesRec) / ((double) secsTot)) / (1024*1024);
-                    double mBitsPerSec = 8*mBytesPerSec;
-                    logMsg("%8.3f MB/sec (%.3f Mb/sec) final average; %ld timer calls", mBytesPerSec, mBitsPerSec, nCallsToTimer);
-                    break;
-                }
-            } else {
-                perror("Unexpected error in connection to server");
-                break;
+// Totals for a group of stored runs.
+struct ResultAggregate {
+    size_t      nFailed = 0;
+    RunningStats statsRate;         // MB/sec.
+    RunningStats statsRtt;          // Average RTT, ms, of runs that have one.
+    uint64_t    retrans = 0;
+    std::vector<double> rates;      // For the median.
+};
+
+// Scan the results file for runs matching the filter and print each
+// group's count, throughput and RTT, or with -list each run.  The file is
+// mapped rather than read, and only the matching runs' rates are kept.
+int doQuery(const Settings &settings)
+{
+    ResultsReader reader;
+    if(!reader.open(settings.store)) {
+        printf("Can't read results file %s\n", settings.store.c_str());
+        return 1;
+    }
+    const ResultFilter &filter = settings.filter;
+    std::map<string, ResultAggregate> groups;
+    size_t nRuns = 0, nMatched = 0;
+    while(const ResultRun *prun = reader.next()) {
+        nRuns++;
+        if(!matchesFilter(*prun, filter)) continue;
+        nMatched++;
+        if(filter.list) {
+            time_t start = (time_t) (prun->startUs / 1000000);
+            std::tm tmBuf;
+            char stamp[32];
+            strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime_r(&start, &tmBuf));
+            printf("%s %s:%d secs=%d nbytes=%d streams=%d cc=%s %s%9.3f MB/sec rtt %.3f ms retrans %u "
+                   "cpu %.2f/%.2f s/GB%s%s\n",
+                   stamp, prun->host, prun->port, prun->secs, prun->bytesPerBuf, prun->streams,
+                   prun->cc[0] ? prun->cc : "default", prun->bShm ? "shm " : "", prun->mbPerSec,
+                   prun->rttAvgMs, prun->retrans, prun->senderCpuPerGB, prun->receiverCpuPerGB,
+                   prun->bAborted ? " ABORTED" : prun->bOK ? "" : " FAILED",
+                   prun->msg[0] ? (string(" msg=") + prun->msg).c_str() : "");
+            const ResultInterval *pint = ResultsReader::intervals(prun);
+            for(int j=0; j<prun->nIntervals; j++) {
+                printf("    %6.1f s %9.3f MB/sec rtt %.3f ms cwnd %u KB\n",
+                       pint[j].secs, pint[j].mbPerSec, pint[j].rttMs, pint[j].cwnd/1024);
             }
-        } while(true);
+        }
+        ResultAggregate &agg = groups[resultGroup(*prun, filter.by)];
+        if(!prun->bOK) {
+            agg.nFailed++;
+            continue;
+        }
+        agg.statsRate.add(prun->mbPerSec);
+        agg.rates.push_back(prun->mbPerSec);
+        if(prun->rttAvgMs > 0) agg.statsRtt.add(prun->rttAvgMs);
+        agg.retrans += prun->retrans;
     }
-    
-    return retval;
+    printf("%zu of %zu runs in %s match\n", nMatched, nRuns, settings.store.c_str());
+    if(0 == nMatched) return 0;
+    printf("%-20s %7s %6s %10s %10s %10s %10s %9s %9s\n", filter.by.empty() ? "" : filter.by.c_str(),
+           "runs", "failed", "MB/s min", "median", "avg", "max", "rtt ms", "retrans");
+    for(auto &group : groups) {
+        ResultAggregate &agg = group.second;
+        printf("%-20s %7zu %6zu %10.3f %10.3f %10.3f %10.3f %9.3f %9llu\n", group.first.c_str(),
+               agg.statsRate.n + agg.nFailed, agg.nFailed, agg.statsRate.min, percentile(agg.rates, 50),
+               agg.statsRate.avg(), agg.statsRate.max, agg.statsRtt.avg(), (unsigned long long) agg.retrans);
+    }
+    return 0;
+}
+
+// Per-run metrics of one side of a comparison.
+struct ResultMetrics {
+    size_t  nRuns = 0;
+    std::vector<double> rate;           // MB/sec.
+    std::vector<double> senderCpu;      // CPU s/GB, where known.
+    std::vector<double> receiverCpu;
+    std::vector<double> rttP50;         // Of each run's interval RTTs, ms.
+    std::vector<double> rttP99;
+};
+
+// Gather the metrics of the successful runs in path that pass filter.
+// Returns false if the file can't be read.
+bool collectMetrics(const string &path, const ResultFilter &filter, ResultMetrics &metrics)
+{
+    ResultsReader reader;
+    if(!reader.open(path)) {
+        printf("Can't read results file %s\n", path.c_str());
+        return false;
+    }
+    while(const ResultRun *prun = reader.next()) {
+        if(!prun->bOK || !matchesFilter(*prun, filter)) continue;
+        metrics.nRuns++;
+        metrics.rate.push_back(prun->mbPerSec);
+        if(prun->senderCpuPerGB > 0) metrics.senderCpu.push_back(prun->senderCpuPerGB);
+        if(prun->receiverCpuPerGB > 0) metrics.receiverCpu.push_back(prun->receiverCpuPerGB);
+        std::vector<double> rtts;
+        const ResultInterval *pint = ResultsReader::intervals(prun);
+        for(int j=0; j<prun->nIntervals; j++) {
+            if(pint[j].rttMs > 0) rtts.push_back(pint[j].rttMs);
+        }
+        if(!rtts.empty()) {
+            metrics.rttP50.push_back(percentile(rtts, 50));
+            metrics.rttP99.push_back(percentile(rtts, 99));
+        }
+    }
+    return true;
+}
+
+// Compare one metric before and after, and print its line of the table.
+// It's worse if the difference is significant and the median moved the
+// wrong way by more than the tolerance.  Returns false if it's worse.
+bool compareMetric(const char *name, std::vector<double> &before, std::vector<double> &after,
+                   bool bHigherIsBetter, double tolerancePct)
+{
+    if(before.size() < 2 || after.size() < 2) {
+        printf("%-18s %5zu %5zu   too few runs\n", name, before.size(), after.size());
+        return true;
+    }
+    double delta;
+    double p = mannWhitney(before, after, delta);
+    double medBefore = percentile(before, 50), medAfter = percentile(after, 50);
+    double pctChange = medBefore != 0 ? 100 * (medAfter - medBefore) / medBefore : 0;
+    double pctBetter = bHigherIsBetter ? pctChange : -pctChange;
+    const char *verdict = "same";
+    if(p < COMPARE_ALPHA && pctBetter < -tolerancePct) {
+        verdict = "WORSE";
+    } else if(p < COMPARE_ALPHA && pctBetter > tolerancePct) {
+        verdict = "better";
+    }
+    printf("%-18s %5zu %5zu %10.3f %10.3f %+8.1f%% %8.4f %+7.2f  %s\n", name, before.size(), after.size(),
+           medBefore, medAfter, pctChange, p, delta, verdict);
+    return 'W' != verdict[0];
+}
+
+// Compare the stored runs before a change with those after it, e.g. a
+// kernel upgrade: the runs in store against those in the -against file,
+// or those in store before and after -split.  Each metric gets a
+// Mann-Whitney test and Cliff's delta; exits 1 if any got worse, so it
+// can gate a rollout.
+int doCompare(const Settings &settings)
+{
+    ResultFilter filterBefore = settings.filter, filterAfter = settings.filter;
+    string pathAfter = settings.against.empty() ? settings.store : settings.against;
+    if(settings.split) {
+        filterBefore.to = filterBefore.to ? std::min(filterBefore.to, settings.split) : settings.split;
+        filterAfter.from = std::max(filterAfter.from, settings.split);
+    }
+    ResultMetrics before, after;
+    if(!collectMetrics(settings.store, filterBefore, before) || !collectMetrics(pathAfter, filterAfter, after)) {
+        return 1;
+    }
+    printf("Before: %zu runs from %s; after: %zu runs from %s\n", before.nRuns, settings.store.c_str(),
+           after.nRuns, pathAfter.c_str());
+    printf("%-18s %5s %5s %10s %10s %9s %8s %7s\n", "median of runs", "n", "n", "before", "after",
+           "change", "p", "delta");
+    bool bPass = compareMetric("MB/sec", before.rate, after.rate, true, settings.tolerancePct);
+    bPass = compareMetric("sender CPU s/GB", before.senderCpu, after.senderCpu, false, settings.tolerancePct) && bPass;
+    bPass = compareMetric("receiver CPU s/GB", before.receiverCpu, after.receiverCpu, false, settings.tolerancePct) && bPass;
+    bPass = compareMetric("RTT p50 ms", before.rttP50, after.rttP50, false, settings.tolerancePct) && bPass;
+    bPass = compareMetric("RTT p99 ms", before.rttP99, after.rttP99, false, settings.tolerancePct) && bPass;
+    printf("%s: %s at p < %.2f and a %.1f%% tolerance\n", bPass ? "PASS" : "FAIL",
+           bPass ? "no metric got significantly worse" : "regression", COMPARE_ALPHA, settings.tolerancePct);
+    return bPass ? 0 : 1;
 }
 
 int doClient(Settings settings)
 {
     int retval = 0;
     
+    if(settings.capacity) {
+        return doCapacityTest(settings);
+    }
+    if(settings.pmtu) {
+        return doPathMtuTest(settings);
+    }
+    if(!settings.ccList.empty()) {
+        return doCcComparison(settings);
+    }
+    if("compare" == settings.align) {
+        return doAlignmentComparison(settings);
+    }
+    if(settings.rpm) {
+        return doResponsiveness(settings);
+    }
+    if(settings.mixed > 0) {
+        return doMixedWorkload(settings);
+    }
+    if(settings.streams > 1) {
+        return doMultiStream(settings);
+    }
+    if(settings.autotune) {
+        BdpProbe probe;
+        if(runBdpProbe(settings, probe)) {
+            applyBdp(probe, settings);
+        }
+    }
     logMsg("Client parameters: remoteip=%s secs=%d bytePerBuf=%d msg=%s",
            settings.remoteip.c_str(), settings.secs, settings.bytes_per_buf,
            settings.msg.c_str());
-    int sock;
-    struct sockaddr_in server_addr;
-    
-    //Create socket
-    int protocol = 0;  // protocol is IP.
-    sock = socket(AF_INET, SOCK_STREAM, protocol);
-    if (sock == -1)
-    {
-        printf("Could not create socket");
+    if(settings.sndbuf > 0 || settings.rcvbuf > 0) {
+        logMsg("Socket buffers: sndbuf=%d rcvbuf=%d", settings.sndbuf, settings.rcvbuf);
     }
-    
-    server_addr.sin_addr.s_addr = inet_addr(settings.remoteip.c_str());
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(settings.port);
-
-    // Connect to remote server
-    logMsg("Connecting to %s port %d", settings.remoteip.c_str(), settings.port);
-    if (connect(sock , (struct sockaddr *)&server_addr , sizeof(server_addr)) < 0)
-    {
-        perror("connect failed. Error");
+    if(!settings.think.empty() || !settings.onoff.empty()) {
+        logMsg("App-limited sender: think=%s onoff=%s",
+               settings.think.empty() ? "none" : settings.think.c_str(),
+               settings.onoff.empty() ? "none" : settings.onoff.c_str());
+    }
+    StartupTimes startup;
+    int sock = connectToServer(settings, &startup);
+    if(sock < 0) {
         return errno;
     }
-    logMsg("Connected to  %s port %d", settings.remoteip.c_str(), settings.port);
     
-    retval = handleClientConnection(sock, settings);
+    StreamLive live;
+    LiveView view;
+    if(settings.live) {
+        view.start(&live, 1);
+    }
+    retval = runSync(handleClientConnection(NULL, sock, settings, NULL, &startup, settings.live ? &live : NULL));
+    live.bDone = true;
+    view.stop();
 
     return retval;
 }
@@ -488,21 +5765,157 @@ void usage()
         "Run two copies of this program, one in server mode and one in client mode.",
         "",
         "Usage for server mode:",
-        "  netthru -mode:server [-port:port]",
+        "  netthru -mode:server [-port:port] [-concurrent[:threads]] [-workers:n [-pin]]",
         "where port     is the TCP port. Defaults to " xstr(DEFAULT_PORT) ".",
+        "      -concurrent serves connections simultaneously rather than one at a",
+        "               time, for client modes that run competing streams.",
+        "               Connections are tasks shared by threads event-loop",
+        "               workers (default: one per CPU) that steal work from each",
+        "               other; -pin pins each worker to its own CPU.",
+        "      -workers:n pre-forks n worker processes (up to " xstr(MAX_WORKERS) ") to accept and",
+        "               serve connections, so a crash only loses that worker's",
+        "               tests; the master restarts it and logs total throughput.",
+        "               -pin pins each worker process to its own CPU.",
         "(Server mode is simple, because the server takes its directions from ",
         "the client.)",
+        "Ctrl-C (SIGINT) or SIGTERM stops either end cleanly: tests in progress",
+        "end early on both ends with their partial results reported, and are",
+        "stored marked as aborted.  A second signal stops the program at once.",
+        "",
+        "Usage for agent mode, a server left running where others can reach it:",
+        "  netthru -mode:agent -keyfile:file [-maxsecs:secs] [-maxrate:MB/sec]",
+        "    [-maxstreams:n] [-maxtests:n] [server options]",
+        "where file     holds the key shared with clients on its first line; clients",
+        "               pass the same -keyfile and must answer a challenge (HMAC-",
+        "               SHA256 over a random nonce) before their command is read.",
+        "      secs     caps each test's duration (default " xstr(DEFAULT_AGENT_MAX_SECS) ").",
+        "      MB/sec   caps each client's rate across all its tests (default none).",
+        "      -maxstreams caps each client's concurrent tests (default " xstr(DEFAULT_AGENT_MAX_STREAMS) "), and",
+        "               -maxtests all concurrent tests (default " xstr(DEFAULT_AGENT_MAX_TESTS) ").  Tests over a",
+        "               limit are refused with the reason, as are tests with nbytes",
+        "               over 4 MB and -capacity trains that would outlast secs or",
+        "               average over MB/sec.  With -workers, each worker enforces",
+        "               the limits separately.",
+        "      -profiles:file, for an agent or server, makes clients that name a",
+        "               profile in file get its secs, pacing and socket options",
+        "               rather than their own; an agent refuses tests that name",
+        "               a profile it doesn't have.  Clients that name none still",
+        "               run their own settings, within an agent's limits.",
         "",
         "Usage for client mode:",
         "  netthru -mode:client -remoteip:remoteip [-port:port] [-secs:secs] ",
-        "    [-nbytes:nbytes] [-msg:msg]",
-        "where remoteip is the IPv4 address of the server.",
+        "    [-nbytes:nbytes] [-msg:msg] [-think:dist] [-onoff:on/off]",
+        "    [-sndbuf:bytes] [-rcvbuf:bytes] [-autotune]",
+        "    [-capacity [-trains:n] [-trainlen:n] [-pktsize:bytes]] [-rxts] [-txts:n]",
+        "    [-transport:tcp|shm] [-cc:algo[,algo...] [-ccmode:concurrent|sequential]]",
+        "    [-ramp:ms [-rampstep:ms]] [-streams:n [-pin]] [-mixed:n [-probeint:ms]]",
+        "    [-rpm] [-store:file|none] [-live] [-keyfile:keyfile]",
+        "    [-profile:name [-profiles:file]] [-counters] [-cpustat]",
+        "    [-align:mss|gso|compare] [-mss:bytes] [-pmtu]",
+        "where remoteip is the IPv4 address or host name of the server.",
         "      port     is the TCP port. Defaults to " xstr(DEFAULT_PORT) ".",
         "      secs     is the number of seconds for which the server should send.",
         "               Defaults to " xstr(DEFAULT_SECS) ".",
         "      nbytes   is the number of bytes the server should send at once.",
         "               Defaults to " xstr(DEFAULT_BYTES_PER_BUF) ".",
         "      msg      is an arbitrary message for the server to log.",
+        "      dist     makes the server application-limited by idling after each",
+        "               send for a think time in ms: fixed:MS, uniform:LO-HI or exp:MEAN.",
+        "      on/off   makes the server send in bursts: flat out for on ms, then",
+        "               idle for off ms.  E.g. -onoff:200/800",
+        "      sndbuf   is SO_SNDBUF for the server's socket; rcvbuf is SO_RCVBUF",
+        "               for the client's.  Default to the system's autotuning.",
+        "      -autotune first probes the path's RTT and bandwidth, then sets sndbuf,",
+        "               rcvbuf and nbytes from the bandwidth-delay product.",
+        "      -capacity instead of a bulk test, estimates bottleneck capacity and",
+        "               available bandwidth from the arrival spacing of short UDP",
+        "               packet trains: trains trains (default " xstr(DEFAULT_TRAINS) ") of trainlen",
+        "               packets (default " xstr(DEFAULT_TRAIN_LEN) ") of pktsize bytes (default " xstr(DEFAULT_PKT_SIZE) ").",
+        "      -rxts    times arrivals with kernel (and NIC, if enabled) receive",
+        "               timestamps, and reports the wakeup latency after arrival.",
+        "      -txts:n  has the server request transmit timestamps on every nth",
+        "               send and report how long data waited before entering the",
+        "               qdisc (sched), reaching the driver (sw) and being acked.",
+        "      transport is tcp (the default), or shm to move the same buffers",
+        "               through a shared-memory ring instead of TCP, as a baseline",
+        "               for the host's own ceiling.  Client and server must share",
+        "               a host; the TCP connection is still used for control.",
+        "      algo     is the congestion control the server should use.  With a",
+        "               list, runs one stream per algorithm and compares their",
+        "               throughput, RTT inflation over idle RTT and retransmits.",
+        "               concurrent streams compete (server needs -concurrent);",
+        "               sequential runs each in isolation.",
+        "      -ramp:ms profiles the first ms (up to " xstr(MAX_RAMP_MS) ") of the connection: bytes",
+        "               delivered, sender cwnd and RTT every rampstep ms (1-" xstr(MAX_RAMP_STEP_MS) ",",
+        "               default " xstr(DEFAULT_RAMP_STEP_MS) ").",
+        "      -streams:n runs n copies of the test at once and reports each",
+        "               stream's throughput and the total.  The server needs",
+        "               -concurrent.  Streams are shared by a worker thread per",
+        "               CPU; -pin pins each to its own CPU.",
+        "      -mixed:n runs n bulk streams while a probe connection times a",
+        "               small request/response every probeint ms (default " xstr(DEFAULT_PROBE_INTERVAL_MS) "),",
+        "               and reports probe latency alongside bulk throughput,",
+        "               idle versus loaded.  The server needs -concurrent.",
+        "      -rpm     measures responsiveness: idle latency, then latency of new",
+        "               connections and of the loaded connections themselves while",
+        "               -streams (default " xstr(RPM_DEFAULT_STREAMS) ") bulk streams saturate the path,",
+        "               scored in round trips per minute (RPM).  The server needs",
+        "               -concurrent.",
+        "      -live    replaces the line printed every second with a view redrawn",
+        "               in place: total and per-stream throughput with sparklines",
+        "               of their history, RTT, cwnd, retransmits, and CPU on both",
+        "               ends (the server's only when it isn't -concurrent).",
+        "               Needs a terminal that understands ANSI escapes.",
+        "      keyfile  holds the key for authenticating with an agent.",
+        "      -counters reports what the stack and NIC did during the test, on",
+        "               both ends: changes in /proc/net/snmp and /proc/net/netstat",
+        "               (retransmits, drops, prunes), and in the interface's",
+        "               statistics and ethtool -S counters (Linux only).",
+        "      -align   sizes the server's writes by the path's MSS, which is logged",
+        "               with the path MTU: mss rounds nbytes down to whole segments,",
+        "               gso makes each write the most segments that fit in a 64 KB",
+        "               GSO/TSO super-packet, and compare runs the test as given,",
+        "               mss and gso in turn and tabulates throughput and CPU s/GB.",
+        "      -mss     clamps the connection's MSS, as a smaller path MTU would.",
+        "      -pmtu    probes the path MTU from the server with don't-fragment UDP",
+        "               datagrams of increasing size, reports the TCP MSS and the",
+        "               kernels' path MTUs, then runs a " xstr(PMTU_TEST_SECS) "-second test at each",
+        "               candidate MTU (MSS clamped to fit) to show where throughput",
+        "               and loss change.",
+        "      -cpustat shows the busiest cores each second and for the whole test,",
+        "               on both ends, split into user, system, irq and softirq time,",
+        "               with their NET_RX/NET_TX softirq counts, to show one core",
+        "               saturated by a NIC queue (Linux only).",
+        "      -profile applies the options of a named profile in file (default",
+        "               " DEFAULT_PROFILES_FILE "), as if given where -profile is.  A profile is",
+        "               a [name] line followed by option lines, each a command-",
+        "               line option without its '-' and with '=' for ':', e.g.",
+        "               \"streams = 4\".  The profile's name goes to the server.",
+        "      file     is the binary results file each test and -streams run is",
+        "               appended to, for -mode:query.  Defaults to " DEFAULT_RESULTS_FILE ".",
+        "",
+        "Usage for query mode:",
+        "  netthru -mode:query [-store:file] [-from:date] [-to:date] [-remoteip:host]",
+        "    [-secs:secs] [-nbytes:nbytes] [-streams:n] [-cc:algo] [-msg:text]",
+        "    [-by:day|host|nbytes|cc|msg|streams] [-list]",
+        "where date     is a local YYYY-MM-DD, or \"YYYY-MM-DD HH:MM\"; -to is exclusive,",
+        "               but a date alone includes that whole day.",
+        "      the other options select runs with those parameters; text need only",
+        "               appear in the run's msg.",
+        "      -by      prints runs, failures, MB/sec min/median/avg/max, average RTT",
+        "               and retransmits per group instead of for all matching runs.",
+        "      -list    also prints each matching run and its per-second intervals.",
+        "",
+        "Usage for compare mode:",
+        "  netthru -mode:compare [-store:file] -against:file|-split:date",
+        "    [-tolerance:pct] [query options]",
+        "where the runs before a change (in store) are compared with those after it,",
+        "      in the -against file or in store from the -split date on.  Throughput,",
+        "      CPU per GB on each end and each run's RTT p50 and p99 get a",
+        "      Mann-Whitney test; a metric fails if it's significantly worse (p < " xstr(COMPARE_ALPHA) ")",
+        "      and its median moved by more than pct percent (default " xstr(DEFAULT_TOLERANCE_PCT) ").",
+        "      Exits with 1 on failure, for use as a regression gate.  The query",
+        "      options (not -by or -list) select the configuration to compare.",
         "",
         "MRR  2023-01-20",
         NULL
@@ -513,47 +5926,293 @@ void usage()
     }
 }
 
+// Parse a local date, YYYY-MM-DD, optionally followed by HH:MM.  A date
+// alone as the end of a range means the end of that day.
+bool parseQueryDate(const string &val, bool bEnd, time_t &when)
+{
+    std::tm tmDate;
+    memset(&tmDate, 0, sizeof(tmDate));
+    tmDate.tm_isdst = -1;
+    int n = sscanf(val.c_str(), "%d-%d-%d %d:%d", &tmDate.tm_year, &tmDate.tm_mon, &tmDate.tm_mday,
+                   &tmDate.tm_hour, &tmDate.tm_min);
+    if(3 != n && 5 != n) return false;
+    tmDate.tm_year -= 1900;
+    tmDate.tm_mon -= 1;
+    if(3 == n && bEnd) tmDate.tm_mday++;
+    when = mktime(&tmDate);
+    return when != (time_t) -1;
+}
+
+// Read a shared key: the first line of path, which should be readable
+// only by its owner.  Returns false if there's no key.
+bool readKeyFile(const string &path, string &key)
+{
+    FILE *file = fopen(path.c_str(), "r");
+    if(NULL == file) return false;
+    char buf[256] = "";
+    if(NULL == fgets(buf, sizeof(buf), file)) buf[0] = '\0';
+    fclose(file);
+    key = buf;
+    while(!key.empty() && ('\n' == key.back() || '\r' == key.back())) key.pop_back();
+    return !key.empty();
+}
+
+// Apply one option, from the command line or a profile, to settings.
+// Returns false, having said why, if it's invalid.
+bool applyOption(const string &name, const string &val, Settings &settings)
+{
+    bool bOK=true;
+    if("mode"==name) {
+        if("server"==val) {
+            settings.mode = Settings::server;
+            settings.logfilename = "netthruserver.log";
+        } else if("agent"==val) {
+            settings.mode = Settings::server;
+            settings.agent = true;
+            settings.logfilename = "netthruagent.log";
+        } else if("client"==val) {
+            settings.mode = Settings::client;
+            settings.logfilename = "netthruclient.log";
+        } else if("query"==val) {
+            settings.mode = Settings::query;
+        } else if("compare"==val) {
+            settings.mode = Settings::compare;
+        } else {
+            printf("Invalid mode: %s\n", val.c_str());
+            bOK = false;
+        }
+    } else if("remoteip"==name) {
+        settings.remoteip = val;
+        settings.filter.host = val;
+    } else if("secs"==name) {
+        settings.secs = atoi(val.c_str());
+        settings.filter.secs = settings.secs;
+    } else if("nbytes"==name) {
+        settings.bytes_per_buf = atoi((val.c_str()));
+        settings.filter.nbytes = settings.bytes_per_buf;
+    } else if("port"==name) {
+        settings.port = atoi(val.c_str());
+    } else if("msg"==name) {
+        settings.msg = val;
+        settings.filter.msg = val;
+    } else if("sndbuf"==name) {
+        settings.sndbuf = atoi(val.c_str());
+    } else if("rcvbuf"==name) {
+        settings.rcvbuf = atoi(val.c_str());
+    } else if("autotune"==name) {
+        settings.autotune = true;
+    } else if("capacity"==name) {
+        settings.capacity = true;
+    } else if("trains"==name) {
+        settings.trains = std::max(1, atoi(val.c_str()));
+    } else if("trainlen"==name) {
+        settings.trainlen = std::max(2, atoi(val.c_str()));
+    } else if("pktsize"==name) {
+        settings.pktsize = std::max((int) sizeof(TrainPacketHeader), atoi(val.c_str()));
+    } else if("cc"==name) {
+        settings.ccList = splitFields(val, ',');
+        if(1 == settings.ccList.size()) {
+            settings.cc = val;
+            settings.filter.cc = val;
+            settings.ccList.clear();
+        }
+    } else if("ccmode"==name) {
+        settings.ccSequential = "sequential" == val;
+        if("sequential" != val && "concurrent" != val) {
+            printf("Invalid ccmode: %s\n", val.c_str());
+            bOK = false;
+        }
+    } else if("streams"==name) {
+        settings.streams = atoi(val.c_str());
+        settings.filter.streams = settings.streams;
+        if(settings.streams < 1) {
+            printf("Invalid number of streams: %s\n", val.c_str());
+            bOK = false;
+        }
+    } else if("mixed"==name) {
+        settings.mixed = atoi(val.c_str());
+        if(settings.mixed < 1) {
+            printf("Invalid number of bulk streams: %s\n", val.c_str());
+            bOK = false;
+        }
+    } else if("rpm"==name) {
+        settings.rpm = true;
+    } else if("live"==name) {
+        settings.live = true;
+    } else if("counters"==name) {
+        settings.counters = true;
+    } else if("cpustat"==name) {
+        settings.cpustat = true;
+    } else if("mss"==name) {
+        settings.mss = atoi(val.c_str());
+    } else if("pmtu"==name) {
+        settings.pmtu = true;
+    } else if("align"==name) {
+        settings.align = val;
+        if("mss" != val && "gso" != val && "compare" != val) {
+            printf("Invalid alignment: %s\n", val.c_str());
+            bOK = false;
+        }
+    } else if("probeint"==name) {
+        settings.probeIntervalMs = atoi(val.c_str());
+        if(settings.probeIntervalMs < 1) {
+            printf("Invalid probe interval: %s\n", val.c_str());
+            bOK = false;
+        }
+    } else if("ramp"==name) {
+        settings.rampMs = atoi(val.c_str());
+        if(settings.rampMs < 0 || settings.rampMs > MAX_RAMP_MS) {
+            printf("ramp must be 0 to " xstr(MAX_RAMP_MS) " ms\n");
+            bOK = false;
+        }
+    } else if("rampstep"==name) {
+        settings.rampStepMs = atoi(val.c_str());
+        if(settings.rampStepMs < 1 || settings.rampStepMs > MAX_RAMP_STEP_MS) {
+            printf("rampstep must be 1 to " xstr(MAX_RAMP_STEP_MS) " ms\n");
+            bOK = false;
+        }
+    } else if("concurrent"==name) {
+        settings.concurrent = val.empty() ?
+            (int) std::max(1u, std::thread::hardware_concurrency()) : atoi(val.c_str());
+        if(settings.concurrent < 1) {
+            printf("Invalid number of event-loop threads: %s\n", val.c_str());
+            bOK = false;
+        }
+    } else if("workers"==name) {
+        settings.workers = atoi(val.c_str());
+        if(settings.workers < 0 || settings.workers > MAX_WORKERS) {
+            printf("workers must be 0 to %d\n", MAX_WORKERS);
+            bOK = false;
+        }
+    } else if("pin"==name) {
+        settings.pin = true;
+    } else if("keyfile"==name) {
+        if(!readKeyFile(val, settings.key)) {
+            printf("Can't read a key from %s\n", val.c_str());
+            bOK = false;
+        }
+    } else if("maxsecs"==name) {
+        settings.maxSecs = atoi(val.c_str());
+    } else if("maxrate"==name) {
+        settings.maxRate = atof(val.c_str());
+    } else if("maxstreams"==name) {
+        settings.maxStreams = atoi(val.c_str());
+    } else if("maxtests"==name) {
+        settings.maxTests = atoi(val.c_str());
+    } else if("store"==name) {
+        settings.store = val;
+    } else if("from"==name || "to"==name) {
+        if(!parseQueryDate(val, "to"==name, "to"==name ? settings.filter.to : settings.filter.from)) {
+            printf("Invalid date: %s\n", val.c_str());
+            bOK = false;
+        }
+    } else if("against"==name) {
+        settings.against = val;
+    } else if("split"==name) {
+        if(!parseQueryDate(val, false, settings.split)) {
+            printf("Invalid date: %s\n", val.c_str());
+            bOK = false;
+        }
+    } else if("tolerance"==name) {
+        settings.tolerancePct = atof(val.c_str());
+    } else if("by"==name) {
+        settings.filter.by = val;
+        if("day" != val && "host" != val && "cc" != val && "msg" != val &&
+           "nbytes" != val && "streams" != val) {
+            printf("Invalid grouping: %s\n", val.c_str());
+            bOK = false;
+        }
+    } else if("list"==name) {
+        settings.filter.list = true;
+    } else if("transport"==name) {
+        settings.transport = val;
+        if("tcp" != val && "shm" != val) {
+            printf("Invalid transport: %s\n", val.c_str());
+            bOK = false;
+        }
+    } else if("txts"==name) {
+        settings.txts = atoi(val.c_str());
+    } else if("rxts"==name) {
+        settings.rxts = true;
+    } else if("think"==name) {
+        ThinkTime think;
+        settings.think = val;
+        if(!parseThinkTime(val, think)) {
+            printf("Invalid think time: %s\n", val.c_str());
+            bOK = false;
+        }
+    } else if("onoff"==name) {
+        double onSecs, offSecs;
+        settings.onoff = val;
+        if(!parseOnOff(val, onSecs, offSecs)) {
+            printf("Invalid on/off pattern: %s\n", val.c_str());
+            bOK = false;
+        }
+    } else {
+        printf("Unrecognized argument: %s\n", name.c_str());
+        bOK = false;
+    }
+    return bOK;
+}
+
 bool parseCmdLine(int argc, const char * argv[], Settings &settings)
 {
     bool bOK=true;
+    string name, val;
+    // The profiles file, wherever it is on the line, applies to every -profile.
+    for(int j=1; j<argc; j++) {
+        if(parseArg(argv[j], name, val) && "profiles"==name) {
+            settings.profilesFile = val;
+        }
+    }
+    TestProfiles profiles;
+    bool bProfilesRead = false;
     for(int j=1; j<argc; j++) {
-        string name, val;
         const char *parg;
         parg = argv[j];
-        if(parseArg(parg, name, val)) {
-            if("mode"==name) {
-                if("server"==val) {
-                    settings.mode = Settings::server;
-                    settings.logfilename = "netthruserver.log";
-                } else if("client"==val) {
-                    settings.mode = Settings::client;
-                    settings.logfilename = "netthruclient.log";
-                } else {
-                    printf("Invalid mode: %s\n", val.c_str());
+        if(!parseArg(parg, name, val)) {
+            printf("Invalid argument: %s\n", parg);
+            bOK = false;
+        } else if("profiles"==name) {
+            // Done above.
+        } else if("profile"==name) {
+            string path = settings.profilesFile.empty() ? DEFAULT_PROFILES_FILE : settings.profilesFile;
+            string error;
+            if(!bProfilesRead && !profiles.read(path, error)) {
+                printf("Can't load profile %s: %s\n", val.c_str(), error.c_str());
+                bOK = false;
+                continue;
+            }
+            bProfilesRead = true;
+            const ProfileOptions *poptions = profiles.find(val);
+            if(!poptions) {
+                printf("No profile %s in %s\n", val.c_str(), path.c_str());
+                bOK = false;
+                continue;
+            }
+            settings.profile = val;
+            for(const auto &opt : *poptions) {
+                if(!applyOption(opt.first, opt.second, settings)) {
+                    printf("  in profile %s\n", val.c_str());
                     bOK = false;
                 }
-            } else if("remoteip"==name) {
-                settings.remoteip = val;
-            } else if("secs"==name) {
-                settings.secs = atoi(val.c_str());
-            } else if("nbytes"==name) {
-                settings.bytes_per_buf = atoi((val.c_str()));
-            } else if("port"==name) {
-                settings.port = atoi(val.c_str());
-            } else if("msg"==name) {
-                settings.msg = val;
-            } else {
-                printf("Unrecognized argument: %s\n", name.c_str());
-                bOK = false;
             }
-        } else {
-            printf("Invalid argument: %s\n", parg);
+        } else if(!applyOption(name, val, settings)) {
             bOK = false;
         }
     }
     if(settings.mode == Settings::unknown) {
         bOK = false;
-        printf("Mode must be server or client\n");
+        printf("Mode must be server, client, query or compare\n");
+    }
+    if(settings.agent && (settings.key.empty() || settings.maxSecs < 1 || settings.maxStreams < 1 ||
+                          settings.maxTests < 1 || settings.maxRate < 0)) {
+        bOK = false;
+        printf("Agent mode needs -keyfile, and limits of at least 1\n");
+    }
+    if(settings.mode == Settings::compare && settings.against.empty() && 0 == settings.split) {
+        bOK = false;
+        printf("Compare needs -against:file or -split:date\n");
     }
     return bOK;
 }
@@ -562,20 +6221,49 @@ int doMain(int argc, const char * argv[])
 {
     int retval = 0;
     Settings settings;
+#ifndef SO_NOSIGPIPE
+    // There's no per-socket SO_NOSIGPIPE on Linux, so ignore SIGPIPE
+    // process-wide; a closed connection then shows up as an EPIPE error.
+    signal(SIGPIPE, SIG_IGN);
+#endif
     if(parseCmdLine(argc, argv, settings)) {
-        openLogFile(settings.logfilename);
-        if(settings.mode == Settings::server) {
-            retval = doServer(settings);
+        // Queries and comparisons only read results files; there's nothing to log.
+        if(settings.mode == Settings::query) {
+            retval = doQuery(settings);
+        } else if(settings.mode == Settings::compare) {
+            retval = doCompare(settings);
         } else {
-            retval = doClient(settings);
+            openLogFile(settings.logfilename);
+            installStopHandlers();
+            if(settings.mode == Settings::server) {
+                retval = doServer(settings);
+            } else {
+                retval = doClient(settings);
+            }
+            closeLogFile();
         }
-        closeLogFile();
     } else {
         usage();
     }
     return retval;
 }
 
+// For the IoLoop test: send or receive nbytes in 64 KB pieces, adding
+// what got through to *pdone.
+Task<int> testTransfer(IoLoop *ploop, int sock, bool bSend, size_t nbytes, size_t *pdone)
+{
+    std::vector<unsigned char> buf(65536, 'x');
+    bool bEOF = false;
+    while(*pdone < nbytes) {
+        bool bOK = bSend ? co_await sendAllAsync(ploop, sock, buf.data(), buf.size()) :
+            buf.size() == (size_t) co_await recvAllAsync(ploop, sock, buf.data(), buf.size(), bEOF);
+        if(!bOK) break;
+        *pdone += buf.size();
+    }
+    co_await SleepFor(ploop, 0.01);
+    co_return 0;
+}
+
 int test(int argc, const char * argv[])
 {
     int retval = 0;
@@ -616,6 +6304,251 @@ int test(int argc, const char * argv[])
         retval = 1;
     }
     
+    // Test parseClientCommand, including an empty msg followed by options.
+    ClientCommand cmd;
+    const char *mycmd = "send|8|8192||think=exp:5|reports=1|\n";
+    bOK = parseClientCommand(mycmd, cmd);
+    if(bOK && cmd.secs == 8 && cmd.bytesPerBuf == 8192 && cmd.msg == "" &&
+       cmd.option("think") == "exp:5" && cmd.optionInt("reports", 0) == 1) {
+        printf("parseClientCommand \"%s\" passed\n", "send|8|8192||think=exp:5|reports=1|");
+    } else {
+        printf("** parseClientCommand failed: secs=%d bytes=%d msg=%s\n", cmd.secs, cmd.bytesPerBuf, cmd.msg.c_str());
+        retval = 1;
+    }
+
+    // Test parseThinkTime.
+    ThinkTime think;
+    bOK = parseThinkTime("uniform:1-10", think);
+    if(bOK && think.kind == ThinkTime::uniform && think.a == 1 && think.b == 10 &&
+       !parseThinkTime("uniform:10-1", think) && !parseThinkTime("bogus:3", think)) {
+        printf("parseThinkTime passed\n");
+    } else {
+        printf("** parseThinkTime failed\n");
+        retval = 1;
+    }
+
+    // Test report records.
+    unsigned char rec[MIN_BYTES_FOR_REPORTS];
+    memset(rec, 'A', sizeof(rec));
+    string fields;
+    addField(fields, "type", "interval");
+    addField(fields, "rttms", "%.3f", 1.5);
+    makeReportRecord(rec, sizeof(rec), fields);
+    std::map<string,string> report;
+    parseReportRecord(rec, sizeof(rec), report);
+    if(isReportRecord(rec, sizeof(rec)) && report["type"] == "interval" && report["rttms"] == "1.500") {
+        printf("report record passed\n");
+    } else {
+        printf("** report record failed\n");
+        retval = 1;
+    }
+
+    // Test percentile.
+    std::vector<double> samples = {4, 1, 3, 2, 5};
+    if(percentile(samples, 50) == 3 && percentile(samples, 0) == 1 &&
+       percentile(samples, 100) == 5 && percentile(samples, 25) == 2) {
+        printf("percentile passed\n");
+    } else {
+        printf("** percentile failed\n");
+        retval = 1;
+    }
+
+    // Test LatencyHistogram.
+    LatencyHistogram histo;
+    for(int j=1; j<=1000; j++) histo.record(j);
+    double p50 = histo.percentile(50), p99 = histo.percentile(99);
+    if(histo.count() == 1000 && p50 >= 480 && p50 <= 500 && p99 >= 960 && p99 <= 990 &&
+       histo.percentile(0) == 1 && histo.percentile(100) == 1000) {
+        printf("LatencyHistogram passed\n");
+    } else {
+        printf("** LatencyHistogram failed: p50=%.0f p99=%.0f\n", p50, p99);
+        retval = 1;
+    }
+
+    // Test tasks on an IoLoop: a sender and a receiver on the same thread,
+    // moving more than the socket buffers hold, so both have to wait.
+    int socks[2];
+    size_t nSent = 0, nReceived = 0;
+    const size_t nToMove = 64 * 65536;
+    if(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, socks)) {
+        setNonBlocking(socks[0], true);
+        setNonBlocking(socks[1], true);
+        IoLoop loop;
+        loop.spawn(testTransfer(&loop, socks[0], true, nToMove, &nSent));
+        loop.spawn(testTransfer(&loop, socks[1], false, nToMove, &nReceived));
+        loop.run(false);
+        close(socks[0]);
+        close(socks[1]);
+    }
+    if(nToMove == nSent && nToMove == nReceived) {
+        printf("IoLoop passed\n");
+    } else {
+        printf("** IoLoop failed: sent %zu received %zu\n", nSent, nReceived);
+        retval = 1;
+    }
+
+    // Test ThreadCounters: snapshots taken while another thread writes
+    // must always see bytes and ops from the same update.
+    ThreadCounters counters;
+    std::thread writer([&counters]() {
+        for(int j=0; j<1000000; j++) counters.addTransfer(100);
+    });
+    bool bConsistent = true;
+    ThreadCounters::Values vals;
+    do {
+        vals = counters.snapshot();
+        bConsistent = bConsistent && vals.bytes == 100 * vals.ops;
+    } while(vals.ops < 1000000);
+    writer.join();
+    if(bConsistent) {
+        printf("ThreadCounters passed\n");
+    } else {
+        printf("** ThreadCounters failed: torn snapshot\n");
+        retval = 1;
+    }
+
+    // Test LiveView::sparkline: scaled to the maximum, padded to the history length.
+    string spark = LiveView::sparkline(std::deque<double>{0, 4, 8});
+    if(spark == "▁▅█" + string(LIVE_HISTORY - 3, ' ')) {
+        printf("sparkline passed\n");
+    } else {
+        printf("** sparkline failed: %s\n", spark.c_str());
+        retval = 1;
+    }
+
+    // Test profiles: read a file, apply a profile to settings and to a command.
+    char profilesPath[] = "/tmp/netthrutestXXXXXX";
+    int fdProfiles = mkstemp(profilesPath);
+    bool bProfilesOK = fdProfiles >= 0;
+    if(bProfilesOK) {
+        const char *text = "# Test\n[bulk]\nsecs = 30\n-streams=4\nmsg = \"a b\"\nrxts\n\n[paced]\nthink = fixed:5\n";
+        bProfilesOK = (ssize_t) strlen(text) == write(fdProfiles, text, strlen(text));
+        close(fdProfiles);
+        TestProfiles profiles;
+        string error;
+        Settings profileSettings;
+        bProfilesOK = bProfilesOK && profiles.read(profilesPath, error) && 2 == profiles.byName.size();
+        for(const auto &opt : bProfilesOK ? *profiles.find("bulk") : ProfileOptions()) {
+            bProfilesOK = bProfilesOK && applyOption(opt.first, opt.second, profileSettings);
+        }
+        ClientCommand profileCmd;
+        bProfilesOK = bProfilesOK && parseClientCommand("send|10|8192||think=exp:1|", profileCmd);
+        if(bProfilesOK) applyProfileToCommand(*profiles.find("paced"), profileCmd);
+        bProfilesOK = bProfilesOK && 30 == profileSettings.secs && 4 == profileSettings.streams &&
+                      "a b" == profileSettings.msg && profileSettings.rxts &&
+                      10 == profileCmd.secs && "fixed:5" == profileCmd.option("think");
+        unlink(profilesPath);
+    }
+    if(bProfilesOK) {
+        printf("TestProfiles passed\n");
+    } else {
+        printf("** TestProfiles failed\n");
+        retval = 1;
+    }
+
+#if defined(__linux__)
+    // Test StackCounters: the MIBs parse, and deltas are only what changed.
+    StackCounters countersBefore, countersAfter;
+    countersBefore.snapshot("");
+    countersAfter.values = countersBefore.values;
+    countersAfter.values["Tcp.InSegs"] += 5;
+    std::vector<std::pair<string,int64_t>> deltas = countersAfter.deltasSince(countersBefore);
+    if(countersBefore.values.count("TcpExt.PruneCalled") && 1 == deltas.size() &&
+       "Tcp.InSegs" == deltas[0].first && 5 == deltas[0].second) {
+        printf("StackCounters passed\n");
+    } else {
+        printf("** StackCounters failed: %zu counters\n", countersBefore.values.size());
+        retval = 1;
+    }
+#endif
+
+    // Test busiestCores: the softirq-bound core comes first, with its breakdown.
+    CpuTimes cpuBefore, cpuAfter;
+    cpuBefore.cores.resize(2);
+    cpuAfter.cores.resize(2);
+    for(int j=0; j<2; j++) {
+        cpuBefore.cores[j].bOnline = cpuAfter.cores[j].bOnline = true;
+        cpuAfter.cores[j].total = 100;
+    }
+    cpuAfter.cores[0].idle = 90;
+    cpuAfter.cores[0].user = 10;
+    cpuAfter.cores[1].softirq = 80;
+    cpuAfter.cores[1].sys = 15;
+    cpuAfter.cores[1].idle = 5;
+    cpuAfter.cores[1].netRx = 1234;
+    std::vector<CoreLoad> loads = busiestCores(cpuBefore, cpuAfter, 1);
+    if(1 == loads.size() && 1 == loads[0].cpu && 95 == loads[0].busyPct && 80 == loads[0].softirqPct &&
+       describeCoreLoads(loads, true) == "cpu1 95% si 80%") {
+        printf("busiestCores passed\n");
+    } else {
+        printf("** busiestCores failed: %s\n", describeCoreLoads(loads).c_str());
+        retval = 1;
+    }
+
+    // Test alignedBufferSize for Ethernet and jumbo-frame MSSs.
+    if(11584 == alignedBufferSize("mss", 12288, 1448) && 65160 == alignedBufferSize("gso", 12288, 1448) &&
+       62636 == alignedBufferSize("gso", 12288, 8948) && 8948 == alignedBufferSize("mss", 4096, 8948) &&
+       12288 == alignedBufferSize("", 12288, 1448)) {
+        printf("alignedBufferSize passed\n");
+    } else {
+        printf("** alignedBufferSize failed\n");
+        retval = 1;
+    }
+
+    // Test hmacSha256 against RFC 4231 test case 2.
+    string mac = hmacSha256("Jefe", "what do ya want for nothing?");
+    if(mac == "5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843") {
+        printf("hmacSha256 passed\n");
+    } else {
+        printf("** hmacSha256 failed: %s\n", mac.c_str());
+        retval = 1;
+    }
+
+    // Test mannWhitney: disjoint samples differ, identical ones don't.
+    std::vector<double> lower = {1, 2, 3, 4, 5, 6, 7, 8}, higher = {11, 12, 13, 14, 15, 16, 17, 18};
+    double delta, deltaSame;
+    double pDiff = mannWhitney(lower, higher, delta);
+    double pSame = mannWhitney(lower, lower, deltaSame);
+    if(pDiff < 0.001 && 1 == delta && pSame > 0.9 && 0 == deltaSame) {
+        printf("mannWhitney passed\n");
+    } else {
+        printf("** mannWhitney failed: p %.4f delta %.2f; same p %.4f delta %.2f\n", pDiff, delta, pSame, deltaSame);
+        retval = 1;
+    }
+
+    // Test the results store: append runs to a fresh file, read them back.
+    char storePath[] = "/tmp/netthrutestXXXXXX";
+    int fdStore = mkstemp(storePath);
+    size_t nStored = 0;
+    bool bStoreOK = fdStore >= 0;
+    if(bStoreOK) {
+        close(fdStore);
+        unlink(storePath);
+        Settings storeSettings;
+        storeSettings.remoteip = "testhost";
+        std::vector<ResultInterval> series = {{1, 10, 2, 65536}, {2, 20, 3, 131072}};
+        for(int j=0; j<3 && bStoreOK; j++) {
+            ResultRun run = makeResultRun(storeSettings, 1700000000 + j);
+            run.mbPerSec = j;
+            bStoreOK = appendResult(storePath, run, j == 1 ? series : std::vector<ResultInterval>());
+        }
+        ResultsReader reader;
+        bStoreOK = bStoreOK && reader.open(storePath);
+        while(const ResultRun *prun = bStoreOK ? reader.next() : NULL) {
+            bStoreOK = prun->mbPerSec == nStored && 0 == strcmp(prun->host, "testhost") &&
+                       prun->nIntervals == (nStored == 1 ? 2 : 0) &&
+                       (nStored != 1 || ResultsReader::intervals(prun)[1].cwnd == 131072);
+            nStored++;
+        }
+        unlink(storePath);
+    }
+    if(bStoreOK && 3 == nStored) {
+        printf("results store passed\n");
+    } else {
+        printf("** results store failed: read %zu runs\n", nStored);
+        retval = 1;
+    }
+
     // Test returning time to milliseconds.
     const auto tp = Clock::now();
     std::cout << timePointToString(tp, "%Z %Y-%m-%d %H:%M:%S.") << std::endl;